@@ -35,6 +35,8 @@ void spice_channel_handle_set_ack(SpiceChannel *channel, SpiceMsgIn *in)
     };
 
     c->message_ack_window = c->message_ack_count = ack->window;
+    /* a new generation, the server ignores the acks of the previous one */
+    spice_channel_reset_acks(channel);
     c->marshallers->msgc_ack_sync(out->marshaller, &sync);
     spice_msg_out_send_internal(out);
 }
@@ -0,0 +1,319 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
+#include <gst/app/gstappsink.h>
+#include <gst/video/video.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+
+#include "channel-display-priv.h"
+
+/* how long to wait for the decoder to output a frame, in us */
+#define GSTVIDEO_DECODE_TIMEOUT (100 * 1000)
+/* once the decoder is known to hold frames back, only drain its output */
+#define GSTVIDEO_DRAIN_TIMEOUT (5 * 1000)
+
+static const struct {
+    int codec_type;
+    const char *caps;
+} gstvideo_codecs[] = {
+    { SPICE_VIDEO_CODEC_TYPE_VP8, "video/x-vp8" },
+    { SPICE_VIDEO_CODEC_TYPE_H264, "video/x-h264,stream-format=byte-stream" },
+};
+
+typedef struct gstvideo_decoder {
+    display_stream_decoder      base;
+
+    GstElement                  *pipeline;
+    GstAppSrc                   *appsrc;
+    GstAppSink                  *appsink;
+
+    /* GstSample, decoded by the streaming threads */
+    GAsyncQueue                 *decoded;
+    gboolean                    in_sync; /* one frame in, one frame out */
+} gstvideo_decoder;
+
+static gboolean gstvideo_init(void)
+{
+    static int success = -1;
+
+    if (success == -1) {
+        GError *err = NULL;
+
+        success = gst_init_check(NULL, NULL, &err);
+        if (!success) {
+            g_warning("failed to initialize GStreamer: %s", err->message);
+            g_clear_error(&err);
+        }
+    }
+
+    return success;
+}
+
+static const char *gstvideo_get_caps(int codec_type)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(gstvideo_codecs); i++) {
+        if (gstvideo_codecs[i].codec_type == codec_type)
+            return gstvideo_codecs[i].caps;
+    }
+
+    return NULL;
+}
+
+/* streaming thread */
+static GstFlowReturn gstvideo_new_sample(GstAppSink *appsink, gpointer data)
+{
+    gstvideo_decoder *decoder = data;
+    GstSample *sample = gst_app_sink_pull_sample(appsink);
+
+    if (sample != NULL)
+        g_async_queue_push(decoder->decoded, sample);
+
+    return GST_FLOW_OK;
+}
+
+/* streaming thread */
+static GstBusSyncReply gstvideo_bus_handler(GstBus *bus, GstMessage *msg, gpointer data)
+{
+    if (GST_MESSAGE_TYPE(msg) == GST_MESSAGE_ERROR) {
+        GError *err = NULL;
+        gchar *debug = NULL;
+
+        gst_message_parse_error(msg, &err, &debug);
+        g_warning("video decoder error: %s (%s)", err->message, debug ? debug : "");
+        g_clear_error(&err);
+        g_free(debug);
+    }
+
+    return GST_BUS_DROP;
+}
+
+/* decoder thread */
+static gboolean gstvideo_copy_sample(GstSample *sample, display_frame *frame)
+{
+    GstVideoInfo info;
+    GstVideoFrame vframe;
+    guint8 *src, *dest;
+    gint src_stride;
+    int y;
+
+    if (!gst_video_info_from_caps(&info, gst_sample_get_caps(sample)))
+        return FALSE;
+
+    if (GST_VIDEO_INFO_WIDTH(&info) != frame->width ||
+        GST_VIDEO_INFO_HEIGHT(&info) != frame->height) {
+        SPICE_DEBUG("decoded frame is %dx%d, expected %dx%d",
+                    GST_VIDEO_INFO_WIDTH(&info), GST_VIDEO_INFO_HEIGHT(&info),
+                    frame->width, frame->height);
+        return FALSE;
+    }
+
+    if (!gst_video_frame_map(&vframe, &info, gst_sample_get_buffer(sample), GST_MAP_READ))
+        return FALSE;
+
+    src = GST_VIDEO_FRAME_PLANE_DATA(&vframe, 0);
+    src_stride = GST_VIDEO_FRAME_PLANE_STRIDE(&vframe, 0);
+    dest = frame->out;
+    for (y = 0; y < frame->height; y++) {
+        memcpy(dest, src, frame->width * 4);
+        src += src_stride;
+        dest += frame->out_stride;
+    }
+    gst_video_frame_unmap(&vframe);
+
+    return TRUE;
+}
+
+/* decoder thread */
+static gboolean gstvideo_decoder_decode_frame(display_stream_decoder *base,
+                                              display_frame *frame)
+{
+    gstvideo_decoder *decoder = (gstvideo_decoder *)base;
+    GstClockTime pts = frame->mm_time * GST_MSECOND;
+    GstSample *sample, *latest = NULL;
+    GstBuffer *buffer;
+    gboolean valid = FALSE;
+
+    /* the frame data belongs to the message, which may be gone before
+     * the pipeline is done with the buffer */
+    buffer = gst_buffer_new_wrapped(g_memdup(frame->data, frame->data_size),
+                                    frame->data_size);
+    GST_BUFFER_PTS(buffer) = pts;
+    GST_BUFFER_DTS(buffer) = GST_CLOCK_TIME_NONE;
+    if (gst_app_src_push_buffer(decoder->appsrc, buffer) != GST_FLOW_OK) {
+        SPICE_DEBUG("failed to push the frame to the video decoder");
+        return FALSE;
+    }
+
+    /* wait for this frame, skipping the ones that came out too late */
+    while ((sample = g_async_queue_timeout_pop(decoder->decoded,
+                                               decoder->in_sync ?
+                                               GSTVIDEO_DECODE_TIMEOUT :
+                                               GSTVIDEO_DRAIN_TIMEOUT)) != NULL) {
+        GstClockTime sample_pts = GST_BUFFER_PTS(gst_sample_get_buffer(sample));
+
+        if (sample_pts == pts) {
+            if (latest != NULL)
+                gst_sample_unref(latest);
+            latest = sample;
+            decoder->in_sync = TRUE;
+            break;
+        }
+        if (sample_pts > pts) {
+            /* shouldn't happen, the frames come in order */
+            gst_sample_unref(sample);
+            break;
+        }
+        if (latest != NULL)
+            gst_sample_unref(latest);
+        latest = sample;
+    }
+
+    if (sample == NULL) {
+        /* the decoder keeps frames back, show the latest one it gave */
+        decoder->in_sync = FALSE;
+    }
+
+    if (latest != NULL) {
+        valid = gstvideo_copy_sample(latest, frame);
+        gst_sample_unref(latest);
+    }
+
+    return valid;
+}
+
+/* main context */
+static void gstvideo_decoder_destroy(display_stream_decoder *base)
+{
+    gstvideo_decoder *decoder = (gstvideo_decoder *)base;
+    GstSample *sample;
+
+    if (decoder->pipeline != NULL) {
+        gst_element_set_state(decoder->pipeline, GST_STATE_NULL);
+        gst_object_unref(decoder->appsrc);
+        gst_object_unref(decoder->appsink);
+        gst_object_unref(decoder->pipeline);
+    }
+
+    while ((sample = g_async_queue_try_pop(decoder->decoded)) != NULL)
+        gst_sample_unref(sample);
+    g_async_queue_unref(decoder->decoded);
+
+    g_free(decoder);
+}
+
+static gboolean gstvideo_create_pipeline(gstvideo_decoder *decoder, const char *caps)
+{
+    GstAppSinkCallbacks appsink_cbs = { NULL, NULL, gstvideo_new_sample };
+    GError *err = NULL;
+    GstBus *bus;
+    gchar *desc;
+
+    desc = g_strdup_printf("appsrc name=src is-live=true format=time caps=\"%s\" ! "
+                           "decodebin ! videoconvert ! "
+                           "appsink name=sink caps=video/x-raw,format=BGRx sync=false",
+                           caps);
+    SPICE_DEBUG("video decoder pipeline: %s", desc);
+    decoder->pipeline = gst_parse_launch_full(desc, NULL, GST_PARSE_FLAG_FATAL_ERRORS, &err);
+    g_free(desc);
+    if (decoder->pipeline == NULL) {
+        g_warning("failed to create the video decoder pipeline: %s", err->message);
+        g_clear_error(&err);
+        return FALSE;
+    }
+
+    decoder->appsrc = GST_APP_SRC(gst_bin_get_by_name(GST_BIN(decoder->pipeline), "src"));
+    decoder->appsink = GST_APP_SINK(gst_bin_get_by_name(GST_BIN(decoder->pipeline), "sink"));
+    gst_app_sink_set_callbacks(decoder->appsink, &appsink_cbs, decoder, NULL);
+
+    bus = gst_pipeline_get_bus(GST_PIPELINE(decoder->pipeline));
+    gst_bus_set_sync_handler(bus, gstvideo_bus_handler, decoder, NULL);
+    gst_object_unref(bus);
+
+    if (gst_element_set_state(decoder->pipeline, GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+        g_warning("failed to start the video decoder pipeline");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+G_GNUC_INTERNAL
+gboolean gstvideo_has_codec(int codec_type)
+{
+    GList *all, *decoders;
+    const char *caps_str;
+    GstCaps *caps;
+
+    caps_str = gstvideo_get_caps(codec_type);
+    if (caps_str == NULL || !gstvideo_init())
+        return FALSE;
+
+    all = gst_element_factory_list_get_elements(GST_ELEMENT_FACTORY_TYPE_DECODER,
+                                                GST_RANK_MARGINAL);
+    caps = gst_caps_from_string(caps_str);
+    decoders = gst_element_factory_list_filter(all, caps, GST_PAD_SINK, FALSE);
+    gst_caps_unref(caps);
+    gst_plugin_feature_list_free(all);
+
+    if (decoders == NULL)
+        return FALSE;
+
+    gst_plugin_feature_list_free(decoders);
+    return TRUE;
+}
+
+G_GNUC_INTERNAL
+display_stream_decoder *gstvideo_decoder_new(int codec_type)
+{
+    gstvideo_decoder *decoder;
+    const char *caps;
+
+    caps = gstvideo_get_caps(codec_type);
+    g_return_val_if_fail(caps != NULL, NULL);
+
+    if (!gstvideo_init())
+        return NULL;
+
+    decoder = g_new0(gstvideo_decoder, 1);
+    decoder->base.codec_type = codec_type;
+    /* decode_frame() may wait for the pipeline, for up to
+     * GSTVIDEO_DECODE_TIMEOUT, too long to hold the draws back, or the
+     * shared decoder threads */
+    decoder->base.strided = FALSE;
+    decoder->base.inter_frames = TRUE;
+    decoder->base.blocking = TRUE;
+    decoder->base.decode_frame = gstvideo_decoder_decode_frame;
+    decoder->base.destroy = gstvideo_decoder_destroy;
+    decoder->decoded = g_async_queue_new();
+    decoder->in_sync = TRUE;
+
+    if (!gstvideo_create_pipeline(decoder, caps)) {
+        gstvideo_decoder_destroy((display_stream_decoder *)decoder);
+        return NULL;
+    }
+
+    return (display_stream_decoder *)decoder;
+}
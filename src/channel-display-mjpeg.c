@@ -23,13 +23,23 @@
 
 #include "channel-display-priv.h"
 
+typedef struct mjpeg_decoder {
+    display_stream_decoder         base;
+
+    struct jpeg_source_mgr         mjpeg_src;
+    struct jpeg_decompress_struct  mjpeg_cinfo;
+    struct jpeg_error_mgr          mjpeg_jerr;
+    gboolean                       back_compat;
+
+    display_frame                  *frame; /* being decoded */
+} mjpeg_decoder;
+
 static void mjpeg_src_init(struct jpeg_decompress_struct *cinfo)
 {
-    display_stream *st = SPICE_CONTAINEROF(cinfo->src, display_stream, mjpeg_src);
-    uint8_t *data;
+    mjpeg_decoder *decoder = SPICE_CONTAINEROF(cinfo->src, mjpeg_decoder, mjpeg_src);
 
-    cinfo->src->bytes_in_buffer = stream_get_current_frame(st, &data);
-    cinfo->src->next_input_byte = data;
+    cinfo->src->bytes_in_buffer = decoder->frame->data_size;
+    cinfo->src->next_input_byte = decoder->frame->data;
 }
 
 static boolean mjpeg_src_fill(struct jpeg_decompress_struct *cinfo)
@@ -49,77 +59,73 @@ static void mjpeg_src_term(struct jpeg_decompress_struct *cinfo)
     /* nothing */
 }
 
-G_GNUC_INTERNAL
-void stream_mjpeg_init(display_stream *st)
-{
-    st->mjpeg_cinfo.err = jpeg_std_error(&st->mjpeg_jerr);
-    jpeg_create_decompress(&st->mjpeg_cinfo);
-
-    st->mjpeg_src.init_source         = mjpeg_src_init;
-    st->mjpeg_src.fill_input_buffer   = mjpeg_src_fill;
-    st->mjpeg_src.skip_input_data     = mjpeg_src_skip;
-    st->mjpeg_src.resync_to_restart   = jpeg_resync_to_restart;
-    st->mjpeg_src.term_source         = mjpeg_src_term;
-    st->mjpeg_cinfo.src               = &st->mjpeg_src;
-}
-
-G_GNUC_INTERNAL
-void stream_mjpeg_data(display_stream *st)
+/* decoder thread */
+static gboolean mjpeg_decoder_decode_frame(display_stream_decoder *base,
+                                           display_frame *frame)
 {
-    gboolean back_compat = st->channel->priv->peer_hdr.major_version == 1;
-    int width;
-    int height;
+    mjpeg_decoder *decoder = (mjpeg_decoder *)base;
+    struct jpeg_decompress_struct *cinfo = &decoder->mjpeg_cinfo;
+    gboolean back_compat = decoder->back_compat;
+    int width = frame->width;
+    int height = frame->height;
+    int stride = frame->out_stride;
     uint8_t *dest;
     uint8_t *lines[4];
 
-    stream_get_dimensions(st, &width, &height);
-    dest = g_malloc0(width * height * 4);
-
-    g_free(st->out_frame);
-    st->out_frame = dest;
+    dest = frame->out;
+    decoder->frame = frame;
 
-    jpeg_read_header(&st->mjpeg_cinfo, 1);
+    jpeg_read_header(cinfo, 1);
 #ifdef JCS_EXTENSIONS
     // requires jpeg-turbo
     if (back_compat)
-        st->mjpeg_cinfo.out_color_space = JCS_EXT_RGBX;
+        cinfo->out_color_space = JCS_EXT_RGBX;
     else
-        st->mjpeg_cinfo.out_color_space = JCS_EXT_BGRX;
+        cinfo->out_color_space = JCS_EXT_BGRX;
 #else
 #warning "You should consider building with libjpeg-turbo"
-    st->mjpeg_cinfo.out_color_space = JCS_RGB;
+    cinfo->out_color_space = JCS_RGB;
 #endif
 
 #ifndef SPICE_QUALITY
-    st->mjpeg_cinfo.dct_method = JDCT_IFAST;
-    st->mjpeg_cinfo.do_fancy_upsampling = FALSE;
-    st->mjpeg_cinfo.do_block_smoothing = FALSE;
-    st->mjpeg_cinfo.dither_mode = JDITHER_ORDERED;
+    cinfo->dct_method = JDCT_IFAST;
+    cinfo->do_fancy_upsampling = FALSE;
+    cinfo->do_block_smoothing = FALSE;
+    cinfo->dither_mode = JDITHER_ORDERED;
 #endif
-    // TODO: in theory should check cinfo.output_height match with our height
-    jpeg_start_decompress(&st->mjpeg_cinfo);
+    jpeg_start_decompress(cinfo);
+    /* the output buffer is sized after the stream (or sized frame)
+     * dimensions, don't write past it */
+    if (cinfo->output_width != width ||
+        cinfo->output_height > height) {
+        g_warning("mjpeg frame is %ux%u, expected %dx%d",
+                  cinfo->output_width, cinfo->output_height,
+                  width, height);
+        jpeg_abort_decompress(cinfo);
+        return FALSE;
+    }
     /* rec_outbuf_height is the recommended size of the output buffer we
      * pass to libjpeg for optimum performance
      */
-    if (st->mjpeg_cinfo.rec_outbuf_height > G_N_ELEMENTS(lines)) {
-        jpeg_abort_decompress(&st->mjpeg_cinfo);
-        g_return_if_reached();
+    if (cinfo->rec_outbuf_height > G_N_ELEMENTS(lines)) {
+        jpeg_abort_decompress(cinfo);
+        g_return_val_if_reached(FALSE);
     }
 
-    while (st->mjpeg_cinfo.output_scanline < st->mjpeg_cinfo.output_height) {
+    while (cinfo->output_scanline < cinfo->output_height) {
         /* only used when JCS_EXTENSIONS is undefined */
         G_GNUC_UNUSED unsigned int lines_read;
 
-        for (unsigned int j = 0; j < st->mjpeg_cinfo.rec_outbuf_height; j++) {
+        for (unsigned int j = 0; j < cinfo->rec_outbuf_height; j++) {
             lines[j] = dest;
 #ifdef JCS_EXTENSIONS
-            dest += 4 * width;
+            dest += stride;
 #else
             dest += 3 * width;
 #endif
         }
-        lines_read = jpeg_read_scanlines(&st->mjpeg_cinfo, lines,
-                                st->mjpeg_cinfo.rec_outbuf_height);
+        lines_read = jpeg_read_scanlines(cinfo, lines,
+                                cinfo->rec_outbuf_height);
 #ifndef JCS_EXTENSIONS
         {
             uint8_t *s = lines[0];
@@ -142,15 +148,52 @@ void stream_mjpeg_data(display_stream *st)
             }
         }
 #endif
-        dest = &st->out_frame[st->mjpeg_cinfo.output_scanline * width * 4];
+        dest = &frame->out[cinfo->output_scanline * stride];
+    }
+    /* the buffer is recycled, clear what the image didn't cover */
+    for (int y = cinfo->output_height; y < height; y++) {
+        memset(dest, 0, width * 4);
+        dest += stride;
     }
-    jpeg_finish_decompress(&st->mjpeg_cinfo);
+    jpeg_finish_decompress(cinfo);
+
+    return TRUE;
+}
+
+/* main context */
+static void mjpeg_decoder_destroy(display_stream_decoder *base)
+{
+    mjpeg_decoder *decoder = (mjpeg_decoder *)base;
+
+    jpeg_destroy_decompress(&decoder->mjpeg_cinfo);
+    g_free(decoder);
 }
 
 G_GNUC_INTERNAL
-void stream_mjpeg_cleanup(display_stream *st)
+display_stream_decoder *mjpeg_decoder_new(gboolean back_compat)
 {
-    jpeg_destroy_decompress(&st->mjpeg_cinfo);
-    g_free(st->out_frame);
-    st->out_frame = NULL;
+    mjpeg_decoder *decoder = g_new0(mjpeg_decoder, 1);
+
+    decoder->base.codec_type = SPICE_VIDEO_CODEC_TYPE_MJPEG;
+    decoder->base.decode_frame = mjpeg_decoder_decode_frame;
+    decoder->base.destroy = mjpeg_decoder_destroy;
+#ifdef JCS_EXTENSIONS
+    decoder->base.strided = TRUE;
+#else
+    /* the fallback color conversion needs a packed buffer */
+    decoder->base.strided = FALSE;
+#endif
+    decoder->back_compat = back_compat;
+
+    decoder->mjpeg_cinfo.err = jpeg_std_error(&decoder->mjpeg_jerr);
+    jpeg_create_decompress(&decoder->mjpeg_cinfo);
+
+    decoder->mjpeg_src.init_source         = mjpeg_src_init;
+    decoder->mjpeg_src.fill_input_buffer   = mjpeg_src_fill;
+    decoder->mjpeg_src.skip_input_data     = mjpeg_src_skip;
+    decoder->mjpeg_src.resync_to_restart   = jpeg_resync_to_restart;
+    decoder->mjpeg_src.term_source         = mjpeg_src_term;
+    decoder->mjpeg_cinfo.src               = &decoder->mjpeg_src;
+
+    return (display_stream_decoder *)decoder;
 }
@@ -46,6 +46,7 @@ typedef struct display_surface {
     SpiceGlzDecoder             *glz_decoder;
     SpiceZlibDecoder            *zlib_decoder;
     SpiceJpegDecoder            *jpeg_decoder;
+    QRegion                     damage; /* not invalidated yet */
 } display_surface;
 
 typedef struct drops_sequence_stats {
@@ -54,10 +55,63 @@ typedef struct drops_sequence_stats {
     uint32_t duration;
 } drops_sequence_stats;
 
+typedef struct display_frame {
+    SpiceMsgIn                  *msg;
+    uint32_t                    mm_time;
+    uint32_t                    playout_time; /* mm_time + jitter buffer delay */
+    SpiceRect                   *dest;
+    int                         width, height;
+
+    /* compressed data, owned by msg */
+    uint8_t                     *data;
+    uint32_t                    data_size;
+
+    /* decoded 32bpp pixels, written by the decoder thread, either in
+     * a stream frame pool buffer, or straight in the surface */
+    uint8_t                     *out;
+    int                         out_stride;
+    gboolean                    out_valid;
+    gboolean                    direct;
+    gboolean                    decoded;
+    gboolean                    dropped; /* while being decoded */
+    gboolean                    late; /* decoded for the next frames, not rendered */
+} display_frame;
+
+typedef struct display_stream_decoder display_stream_decoder;
+
+/* a video codec implementation, one per stream */
+struct display_stream_decoder {
+    int                         codec_type;
+    /* whether decode_frame() can write rows out_stride apart, and
+     * returns promptly, which allows decoding straight in the surfaces:
+     * the draws wait for it */
+    gboolean                    strided;
+    /* whether frames are predicted from the previous ones, which must
+     * then all be decoded, even those too late to be shown */
+    gboolean                    inter_frames;
+    /* whether decode_frame() may wait on the codec, the stream then
+     * gets a decoder thread of its own rather than holding one of the
+     * shared ones */
+    gboolean                    blocking;
+
+    /* decoder thread: decodes frame->data in the preallocated
+     * frame->out, frame->width x frame->height 32bpp pixels. Frames
+     * are given one at a time, in mm_time order */
+    gboolean (*decode_frame)(display_stream_decoder *decoder, display_frame *frame);
+    /* main context, not while decoding */
+    void (*destroy)(display_stream_decoder *decoder);
+};
+
+/* recycled decoded frame buffers, all of the same dimensions */
+typedef struct display_frame_pool {
+    int                         width, height;
+    GSList                      *buffers;
+    guint                       num_buffers;
+} display_frame_pool;
+
 typedef struct display_stream {
     SpiceMsgIn                  *msg_create;
     SpiceMsgIn                  *msg_clip;
-    SpiceMsgIn                  *msg_data;
 
     /* from messages */
     display_surface             *surface;
@@ -65,14 +119,16 @@ typedef struct display_stream {
     QRegion                     region;
     int                         have_region;
     int                         codec;
-
-    /* mjpeg decoder */
-    struct jpeg_source_mgr         mjpeg_src;
-    struct jpeg_decompress_struct  mjpeg_cinfo;
-    struct jpeg_error_mgr          mjpeg_jerr;
-
-    uint8_t                     *out_frame;
-    GQueue                      *msgq;
+    display_stream_decoder      *decoder;
+
+    GQueue                      *msgq; /* display_frame, in mm_time order */
+    display_frame               *decoding; /* in the decoder thread */
+    GThreadPool                 *decode_thread; /* for a blocking decoder */
+    display_frame_pool          frame_pool;
+    STATIC_MUTEX                direct_lock; /* held while decoding in the surface */
+    gboolean                    direct_cancelled;
+    gboolean                    render_pending; /* waiting for the decoder */
+    gboolean                    destroyed;
     guint                       timeout;
     SpiceChannel                *channel;
 
@@ -88,6 +144,12 @@ typedef struct display_stream {
 
     uint32_t             playback_sync_drops_seq_len;
 
+    /* jitter buffer */
+    gboolean             jitter_valid;
+    int32_t              jitter_last_latency;
+    gdouble              jitter; /* ms, smoothed interarrival jitter */
+    uint32_t             playout_delay; /* ms, added to the frames mm_time */
+
     /* playback quality report to server */
     gboolean report_is_active;
     uint32_t report_id;
@@ -100,13 +162,17 @@ typedef struct display_stream {
     uint32_t report_drops_seq_len;
 } display_stream;
 
-void stream_get_dimensions(display_stream *st, int *width, int *height);
-uint32_t stream_get_current_frame(display_stream *st, uint8_t **data);
+/* channel-display.c */
+gsize spice_display_channel_get_surfaces_size(SpiceDisplayChannel *channel);
 
 /* channel-display-mjpeg.c */
-void stream_mjpeg_init(display_stream *st);
-void stream_mjpeg_data(display_stream *st);
-void stream_mjpeg_cleanup(display_stream *st);
+display_stream_decoder *mjpeg_decoder_new(gboolean back_compat);
+
+#ifdef WITH_GSTVIDEO
+/* channel-display-gst.c */
+gboolean gstvideo_has_codec(int codec_type);
+display_stream_decoder *gstvideo_decoder_new(int codec_type);
+#endif
 
 G_END_DECLS
 
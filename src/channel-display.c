@@ -62,11 +62,20 @@
     (G_TYPE_INSTANCE_GET_PRIVATE((obj), SPICE_TYPE_DISPLAY_CHANNEL, SpiceDisplayChannelPrivate))
 
 #define MONITORS_MAX 256
+/* beyond this, the damage bounding box is invalidated instead */
+#define DAMAGE_MAX_RECTS 32
+
+/* decoded frames kept ahead of the rendering, per stream */
+#define STREAM_DECODE_AHEAD 3
+#define STREAM_DECODE_MAX_THREADS 4
+/* a few more than decoded ahead, for the rendered and in-flight ones */
+#define STREAM_FRAME_POOL_MAX (STREAM_DECODE_AHEAD + 2)
 
 struct _SpiceDisplayChannelPrivate {
     GHashTable                  *surfaces;
     display_surface             *primary;
     display_cache               *images;
+    GCoroutineWaitQueue         *images_waiters;
     display_cache               *palettes;
     SpiceImageCache             image_cache;
     SpicePaletteCache           palette_cache;
@@ -79,6 +88,13 @@ struct _SpiceDisplayChannelPrivate {
     GArray                      *monitors;
     guint                       monitors_max;
     gboolean                    enable_adaptive_streaming;
+    guint                       direct_decodes; /* stream frames decoded in surfaces */
+    GCoroutineWaitQueue         *direct_waiters; /* for direct_decodes to be 0 */
+    gboolean                    in_draw; /* a draw may be suspended, waiting for an image */
+    guint                       max_invalidate_rate;
+    guint                       damage_flush_id;
+    guint64                     raw_invalidates;
+    guint64                     coalesced_invalidates;
 #ifdef G_OS_WIN32
     HDC dc;
 #endif
@@ -92,7 +108,10 @@ enum {
     PROP_WIDTH,
     PROP_HEIGHT,
     PROP_MONITORS,
-    PROP_MONITORS_MAX
+    PROP_MONITORS_MAX,
+    PROP_MAX_INVALIDATE_RATE,
+    PROP_RAW_INVALIDATES,
+    PROP_COALESCED_INVALIDATES,
 };
 
 enum {
@@ -113,11 +132,14 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary);
 static void clear_streams(SpiceChannel *channel);
 static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id);
 static gboolean display_stream_render(display_stream *st);
+static void display_stream_decode_func(gpointer data, gpointer user_data);
+static gboolean display_stream_decode_done(gpointer data);
+static void display_stream_invalidate(display_stream *st, SpiceRect *dest);
 static void spice_display_channel_reset(SpiceChannel *channel, gboolean migrating);
 static void spice_display_channel_reset_capabilities(SpiceChannel *channel);
 static void destroy_canvas(display_surface *surface);
-static void _msg_in_unref_func(gpointer data, gpointer user_data);
 static void display_session_mm_time_reset_cb(SpiceSession *session, gpointer data);
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg);
 
 /* ------------------------------------------------------------------ */
 
@@ -130,6 +152,11 @@ static void spice_display_channel_dispose(GObject *object)
         c->mark_false_event_id = 0;
     }
 
+    if (c->damage_flush_id != 0) {
+        g_source_remove(c->damage_flush_id);
+        c->damage_flush_id = 0;
+    }
+
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->dispose(object);
 }
@@ -139,10 +166,12 @@ static void spice_display_channel_finalize(GObject *object)
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
 
     g_clear_pointer(&c->monitors, g_array_unref);
+    /* streams first, they may be decoding in the surfaces */
+    clear_streams(SPICE_CHANNEL(object));
     clear_surfaces(SPICE_CHANNEL(object), FALSE);
     g_hash_table_unref(c->surfaces);
-    clear_streams(SPICE_CHANNEL(object));
     g_clear_pointer(&c->palettes, cache_free);
+    g_clear_pointer(&c->direct_waiters, g_coroutine_wait_queue_free);
 
     if (G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize)
         G_OBJECT_CLASS(spice_display_channel_parent_class)->finalize(object);
@@ -154,11 +183,12 @@ static void spice_display_channel_constructed(GObject *object)
     SpiceSession *s = spice_channel_get_session(SPICE_CHANNEL(object));
 
     g_return_if_fail(s != NULL);
-    spice_session_get_caches(s, &c->images, &c->glz_window);
+    spice_session_get_caches(s, &c->images, &c->images_waiters, &c->glz_window);
     c->palettes = cache_new(g_free);
 
     g_return_if_fail(c->glz_window != NULL);
     g_return_if_fail(c->images != NULL);
+    g_return_if_fail(c->images_waiters != NULL);
     g_return_if_fail(c->palettes != NULL);
 
     c->monitors = g_array_new(FALSE, TRUE, sizeof(SpiceDisplayMonitorConfig));
@@ -196,6 +226,15 @@ static void spice_display_get_property(GObject    *object,
         g_value_set_uint(value, c->monitors_max);
         break;
     }
+    case PROP_MAX_INVALIDATE_RATE:
+        g_value_set_uint(value, c->max_invalidate_rate);
+        break;
+    case PROP_RAW_INVALIDATES:
+        g_value_set_uint64(value, c->raw_invalidates);
+        break;
+    case PROP_COALESCED_INVALIDATES:
+        g_value_set_uint64(value, c->coalesced_invalidates);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -207,7 +246,12 @@ static void spice_display_set_property(GObject      *object,
                                        const GValue *value,
                                        GParamSpec   *pspec)
 {
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(object)->priv;
+
     switch (prop_id) {
+    case PROP_MAX_INVALIDATE_RATE:
+        c->max_invalidate_rate = g_value_get_uint(value);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
         break;
@@ -236,6 +280,7 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
     gobject_class->constructed = spice_display_channel_constructed;
 
     channel_class->channel_up   = spice_display_channel_up;
+    channel_class->handle_msg   = spice_display_handle_msg;
     channel_class->channel_reset = spice_display_channel_reset;
     channel_class->channel_reset_capabilities = spice_display_channel_reset_capabilities;
 
@@ -291,6 +336,60 @@ static void spice_display_channel_class_init(SpiceDisplayChannelClass *klass)
                            G_PARAM_READABLE |
                            G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceDisplayChannel:max-invalidate-rate:
+     *
+     * The maximum number of times per second
+     * #SpiceDisplayChannel::display-invalidate is emitted. The areas
+     * drawn in between are accumulated and invalidated together. 0
+     * emits the signal for every drawing operation.
+     *
+     * Since: 0.31
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_MAX_INVALIDATE_RATE,
+         g_param_spec_uint("max-invalidate-rate",
+                           "Max invalidate rate",
+                           "Maximum invalidations per second",
+                           0, 1000, 60,
+                           G_PARAM_READWRITE |
+                           G_PARAM_CONSTRUCT |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:raw-invalidates:
+     *
+     * The number of areas of the primary surface drawn by the server,
+     * before coalescing.
+     *
+     * Since: 0.31
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_RAW_INVALIDATES,
+         g_param_spec_uint64("raw-invalidates",
+                             "Raw invalidates",
+                             "Number of areas drawn",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceDisplayChannel:coalesced-invalidates:
+     *
+     * The number of times #SpiceDisplayChannel::display-invalidate
+     * was emitted.
+     *
+     * Since: 0.31
+     */
+    g_object_class_install_property
+        (gobject_class, PROP_COALESCED_INVALIDATES,
+         g_param_spec_uint64("coalesced-invalidates",
+                             "Coalesced invalidates",
+                             "Number of invalidate signals emitted",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceDisplayChannel::display-primary-create:
      * @display: the #SpiceDisplayChannel that emitted the signal
@@ -467,6 +566,7 @@ static void image_put(SpiceImageCache *cache, uint64_t id, pixman_image_t *image
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
 
     cache_add(c->images, id, pixman_image_ref(image));
+    g_coroutine_wait_queue_wake(c->images_waiters, id);
 }
 
 typedef struct _WaitImageData
@@ -475,6 +575,7 @@ typedef struct _WaitImageData
     SpiceImageCache *cache;
     uint64_t id;
     pixman_image_t *image;
+    gboolean looked_up;
 } WaitImageData;
 
 static gboolean wait_image(gpointer data)
@@ -483,7 +584,21 @@ static gboolean wait_image(gpointer data)
     WaitImageData *wait = data;
     SpiceDisplayChannelPrivate *c =
         SPICE_CONTAINEROF(wait->cache, SpiceDisplayChannelPrivate, image_cache);
-    pixman_image_t *image = cache_find_lossy(c->images, wait->id, &lossy);
+    pixman_image_t *image;
+
+    /* only the first lookup counts in the cache statistics */
+    if (!wait->looked_up) {
+        image = cache_find_lossy(c->images, wait->id, &lossy);
+        wait->looked_up = TRUE;
+    } else {
+        image = cache_peek_lossy(c->images, wait->id, &lossy);
+    }
+
+    if (!image && cache_is_evicted(c->images, wait->id)) {
+        /* the server won't send it again */
+        g_warning("image %" PRIx64 " was evicted from the cache", wait->id);
+        return TRUE;
+    }
 
     if (!image || (lossy && !wait->lossy))
         return FALSE;
@@ -495,13 +610,17 @@ static gboolean wait_image(gpointer data)
 
 static pixman_image_t *image_get(SpiceImageCache *cache, uint64_t id)
 {
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
     WaitImageData wait = {
         .lossy = TRUE,
         .cache = cache,
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+
+    if (!g_coroutine_wait_queue_wait(c->images_waiters, g_coroutine_self(), id,
+                                     wait_image, &wait))
         SPICE_DEBUG("wait image got cancelled");
 
     return wait.image;
@@ -548,10 +667,12 @@ static void image_put_lossy(SpiceImageCache *cache, uint64_t id,
         SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
 
 #ifndef NDEBUG
-    g_warn_if_fail(cache_find(c->images, id) == NULL);
+    gboolean lossy;
+    g_warn_if_fail(cache_peek_lossy(c->images, id, &lossy) == NULL);
 #endif
 
     cache_add_lossy(c->images, id, pixman_image_ref(surface), TRUE);
+    g_coroutine_wait_queue_wake(c->images_waiters, id);
 }
 
 static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
@@ -562,13 +683,17 @@ static void image_replace_lossy(SpiceImageCache *cache, uint64_t id,
 
 static pixman_image_t* image_get_lossless(SpiceImageCache *cache, uint64_t id)
 {
+    SpiceDisplayChannelPrivate *c =
+        SPICE_CONTAINEROF(cache, SpiceDisplayChannelPrivate, image_cache);
     WaitImageData wait = {
         .lossy = FALSE,
         .cache = cache,
         .id = id,
         .image = NULL
     };
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_image, &wait))
+
+    if (!g_coroutine_wait_queue_wait(c->images_waiters, g_coroutine_self(), id,
+                                     wait_image, &wait))
         SPICE_DEBUG("wait lossless got cancelled");
 
     return wait.image;
@@ -628,6 +753,16 @@ static void spice_display_channel_reset_capabilities(SpiceChannel *channel)
     if (SPICE_DISPLAY_CHANNEL(channel)->priv->enable_adaptive_streaming) {
         spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_STREAM_REPORT);
     }
+    spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_MULTI_CODEC);
+    spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_CODEC_MJPEG);
+#ifdef WITH_GSTVIDEO
+    if (gstvideo_has_codec(SPICE_VIDEO_CODEC_TYPE_VP8)) {
+        spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_CODEC_VP8);
+    }
+    if (gstvideo_has_codec(SPICE_VIDEO_CODEC_TYPE_H264)) {
+        spice_channel_set_capability(SPICE_CHANNEL(channel), SPICE_DISPLAY_CAP_CODEC_H264);
+    }
+#endif
 }
 
 static void destroy_surface(gpointer data)
@@ -648,6 +783,7 @@ static void spice_display_channel_init(SpiceDisplayChannel *channel)
     c->image_cache.ops = &image_cache_ops;
     c->palette_cache.ops = &palette_cache_ops;
     c->image_surfaces.ops = &image_surfaces_ops;
+    c->direct_waiters = g_coroutine_wait_queue_new();
 #if defined(G_OS_WIN32)
     c->dc = create_compatible_dc();
 #endif
@@ -725,6 +861,7 @@ static int create_canvas(SpiceChannel *channel, display_surface *surface)
                                              surface->zlib_decoder);
 
     g_return_val_if_fail(surface->canvas != NULL, 0);
+    region_init(&surface->damage);
     g_hash_table_insert(c->surfaces, GINT_TO_POINTER(surface->surface_id), surface);
 
     if (surface->primary) {
@@ -770,6 +907,23 @@ static void destroy_canvas(display_surface *surface)
 
     surface->canvas->ops->destroy(surface->canvas);
     surface->canvas = NULL;
+    region_destroy(&surface->damage);
+}
+
+/* main context */
+G_GNUC_INTERNAL
+gsize spice_display_channel_get_surfaces_size(SpiceDisplayChannel *channel)
+{
+    SpiceDisplayChannelPrivate *c = channel->priv;
+    GHashTableIter iter;
+    display_surface *surface;
+    gsize size = 0;
+
+    g_hash_table_iter_init(&iter, c->surfaces);
+    while (g_hash_table_iter_next(&iter, NULL, (gpointer*)&surface))
+        size += surface->size;
+
+    return size;
 }
 
 static display_surface *find_surface(SpiceDisplayChannelPrivate *c, guint32 surface_id)
@@ -804,13 +958,74 @@ static void clear_surfaces(SpiceChannel *channel, gboolean keep_primary)
     }
 }
 
-/* coroutine context */
-static void emit_invalidate(SpiceChannel *channel, SpiceRect *bbox)
+/* main context */
+static void display_emit_invalidate(SpiceChannel *channel, SpiceRect *rect)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    c->coalesced_invalidates++;
+    g_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                  rect->left, rect->top,
+                  rect->right - rect->left,
+                  rect->bottom - rect->top);
+}
+
+/* main context */
+static gboolean display_flush_damage(gpointer data)
+{
+    SpiceChannel *channel = data;
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    display_surface *surface = c->primary;
+    SpiceRect *rects;
+    int i, n;
+
+    c->damage_flush_id = 0;
+    if (surface == NULL || region_is_empty(&surface->damage))
+        return FALSE;
+
+    n = pixman_region32_n_rects(&surface->damage);
+    if (n > DAMAGE_MAX_RECTS) {
+        SpiceRect extents;
+
+        region_extents(&surface->damage, &extents);
+        region_clear(&surface->damage);
+        display_emit_invalidate(channel, &extents);
+        return FALSE;
+    }
+
+    rects = g_newa(SpiceRect, n);
+    region_ret_rects(&surface->damage, rects, n);
+    /* the handlers may draw, and add damage */
+    region_clear(&surface->damage);
+    for (i = 0; i < n; i++)
+        display_emit_invalidate(channel, &rects[i]);
+
+    return FALSE;
+}
+
+/* main or coroutine context */
+static void display_surface_damage(SpiceChannel *channel, display_surface *surface,
+                                   SpiceRect *bbox)
 {
-    g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                            bbox->left, bbox->top,
-                            bbox->right - bbox->left,
-                            bbox->bottom - bbox->top);
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+
+    if (!surface->primary)
+        return;
+
+    c->raw_invalidates++;
+    if (c->max_invalidate_rate == 0) {
+        c->coalesced_invalidates++;
+        g_coroutine_signal_emit(channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
+                                bbox->left, bbox->top,
+                                bbox->right - bbox->left,
+                                bbox->bottom - bbox->top);
+        return;
+    }
+
+    region_add(&surface->damage, bbox);
+    if (c->damage_flush_id == 0)
+        c->damage_flush_id = g_timeout_add(1000 / c->max_invalidate_rate,
+                                           display_flush_damage, channel);
 }
 
 /* ------------------------------------------------------------------ */
@@ -823,13 +1038,18 @@ static void spice_display_channel_up(SpiceChannel *channel)
     SpiceMsgcDisplayInit init;
     int cache_size;
     int glz_window_size;
+    guint64 cache_limit;
     SpiceImageCompression preferred_compression = SPICE_IMAGE_COMPRESSION_INVALID;
 
     g_object_get(s,
                  "cache-size", &cache_size,
                  "glz-window-size", &glz_window_size,
+                 "image-cache-limit", &cache_limit,
                  "preferred-compression", &preferred_compression,
                  NULL);
+    /* the server must not count on more images than the cache keeps */
+    if (cache_limit != 0 && cache_limit < (guint64)cache_size)
+        cache_size = cache_limit;
     CHANNEL_DEBUG(channel, "%s: cache_size %d, glz_window_size %d (bytes)", __FUNCTION__,
                   cache_size, glz_window_size);
     init.pixmap_cache_id = 1;
@@ -855,9 +1075,7 @@ static void spice_display_channel_up(SpiceChannel *channel)
         g_return_if_fail(surface != NULL);                              \
         surface->canvas->ops->draw_##type(surface->canvas, &op->base.box, \
                                           &op->base.clip, &op->data);   \
-        if (surface->primary) {                                         \
-            emit_invalidate(channel, &op->base.box);                    \
-        }                                                               \
+        display_surface_damage(channel, surface, &op->base.box);        \
 }
 
 /* coroutine context */
@@ -922,9 +1140,7 @@ static void display_handle_copy_bits(SpiceChannel *channel, SpiceMsgIn *in)
     g_return_if_fail(surface != NULL);
     surface->canvas->ops->copy_bits(surface->canvas, &op->base.box,
                                     &op->base.clip, &op->src_pos);
-    if (surface->primary) {
-        emit_invalidate(channel, &op->base.box);
-    }
+    display_surface_damage(channel, surface, &op->base.box);
 }
 
 /* coroutine context */
@@ -996,6 +1212,23 @@ static void display_update_stream_region(display_stream *st)
     }
 }
 
+/* coroutine context */
+static display_stream_decoder *display_stream_decoder_new(SpiceChannel *channel, int codec)
+{
+    switch (codec) {
+    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
+        return mjpeg_decoder_new(channel->priv->peer_hdr.major_version == 1);
+#ifdef WITH_GSTVIDEO
+    case SPICE_VIDEO_CODEC_TYPE_VP8:
+    case SPICE_VIDEO_CODEC_TYPE_H264:
+        return gstvideo_decoder_new(codec);
+#endif
+    default:
+        g_warning("unsupported video codec %d", codec);
+        return NULL;
+    }
+}
+
 /* coroutine context */
 static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
 {
@@ -1029,64 +1262,179 @@ static void display_handle_stream_create(SpiceChannel *channel, SpiceMsgIn *in)
     st->channel = channel;
     st->drops_seqs_stats_arr = g_array_new(FALSE, FALSE, sizeof(drops_sequence_stats));
 
+    STATIC_MUTEX_INIT(st->direct_lock);
+
     region_init(&st->region);
     display_update_stream_region(st);
 
-    switch (st->codec) {
-    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-        stream_mjpeg_init(st);
-        break;
+    st->decoder = display_stream_decoder_new(channel, st->codec);
+    if (st->decoder != NULL && st->decoder->blocking) {
+        GError *error = NULL;
+
+        st->decode_thread = g_thread_pool_new(display_stream_decode_func, NULL,
+                                              1, TRUE, &error);
+        if (error != NULL) {
+            g_warning("failed to create the stream decoder thread: %s", error->message);
+            g_clear_error(&error);
+        }
     }
 }
 
+/* main context */
+static void display_frame_pool_clear(display_frame_pool *pool)
+{
+    g_slist_free_full(pool->buffers, g_free);
+    pool->buffers = NULL;
+    pool->num_buffers = 0;
+}
+
+/* main context */
+static uint8_t *display_frame_pool_get(display_frame_pool *pool, int width, int height)
+{
+    uint8_t *buffer;
+
+    if (pool->width != width || pool->height != height) {
+        /* sized frames changed the dimensions, the old buffers are useless */
+        display_frame_pool_clear(pool);
+        pool->width = width;
+        pool->height = height;
+    }
+
+    if (pool->buffers == NULL)
+        return g_malloc(width * height * 4);
+
+    buffer = pool->buffers->data;
+    pool->buffers = g_slist_delete_link(pool->buffers, pool->buffers);
+    pool->num_buffers--;
+
+    return buffer;
+}
+
+/* main context */
+static void display_frame_pool_put(display_frame_pool *pool, uint8_t *buffer,
+                                   int width, int height)
+{
+    if (pool->width != width || pool->height != height ||
+        pool->num_buffers >= STREAM_FRAME_POOL_MAX) {
+        g_free(buffer);
+        return;
+    }
+
+    pool->buffers = g_slist_prepend(pool->buffers, buffer);
+    pool->num_buffers++;
+}
+
+/* main context */
+static void display_frame_free(display_stream *st, display_frame *frame)
+{
+    spice_msg_in_unref(frame->msg);
+    if (frame->out != NULL && !frame->direct)
+        display_frame_pool_put(&st->frame_pool, frame->out, frame->width, frame->height);
+    g_free(frame);
+}
+
+/* main context */
+static void display_stream_drop_frame(display_stream *st, display_frame *frame)
+{
+    if (frame == st->decoding) {
+        /* the decoder thread still uses it, it is freed when done */
+        frame->dropped = TRUE;
+        return;
+    }
+    display_frame_free(st, frame);
+}
+
+static void _frame_drop_func(gpointer data, gpointer user_data)
+{
+    display_stream_drop_frame(user_data, data);
+}
+
+static void _frame_skip_func(gpointer data, gpointer user_data)
+{
+    display_frame *frame = data;
+
+    frame->late = TRUE;
+}
+
+/* main context */
+static void display_stream_free(display_stream *st)
+{
+    /* idle, but its last decode may not have returned yet */
+    if (st->decode_thread != NULL)
+        g_thread_pool_free(st->decode_thread, FALSE, TRUE);
+    if (st->decoder != NULL)
+        st->decoder->destroy(st->decoder);
+    display_frame_pool_clear(&st->frame_pool);
+    STATIC_MUTEX_CLEAR(st->direct_lock);
+    g_free(st);
+}
+
+/* whether the frames must all be decoded, even those not shown */
+static gboolean display_stream_has_inter_frames(display_stream *st)
+{
+    return st->decoder != NULL && st->decoder->inter_frames;
+}
+
 /* coroutine or main context */
 static gboolean display_stream_schedule(display_stream *st)
 {
     SpiceSession *session = spice_channel_get_session(st->channel);
     guint32 time, d;
-    SpiceStreamDataHeader *op;
-    SpiceMsgIn *in;
+    display_frame *frame;
 
     SPICE_DEBUG("%s", __FUNCTION__);
-    if (st->timeout || !session)
+    if (st->timeout || st->render_pending || !session)
         return TRUE;
 
     time = spice_session_get_mm_time(session);
-    in = g_queue_peek_head(st->msgq);
+    frame = g_queue_peek_head(st->msgq);
 
-    if (in == NULL) {
+    if (frame == NULL) {
         return TRUE;
     }
 
-    op = spice_msg_in_parsed(in);
-    if (time < op->multi_media_time) {
-        d = op->multi_media_time - time;
-        SPICE_DEBUG("scheduling next stream render in %u ms", d);
-        st->timeout = g_timeout_add(d, (GSourceFunc)display_stream_render, st);
-        return TRUE;
-    } else {
-        SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, mmtime: %u), dropping ",
-                    __FUNCTION__, time - op->multi_media_time,
-                    op->multi_media_time, time);
-        in = g_queue_pop_head(st->msgq);
-        spice_msg_in_unref(in);
-        st->num_drops_on_playback++;
-        if (g_queue_get_length(st->msgq) == 0)
+    if (!frame->late) {
+        if (time < frame->playout_time) {
+            d = frame->playout_time - time;
+            SPICE_DEBUG("scheduling next stream render in %u ms", d);
+            st->timeout = g_timeout_add(d, (GSourceFunc)display_stream_render, st);
             return TRUE;
+        }
+
+        SPICE_DEBUG("%s: rendering too late by %u ms (ts: %u, delay: %u, mmtime: %u), dropping ",
+                    __FUNCTION__, time - frame->playout_time,
+                    frame->mm_time, st->playout_delay, time);
+        frame->late = TRUE;
+        st->num_drops_on_playback++;
+        /* let the server know about it too */
+        if (st->report_is_active && st->report_num_frames > 0)
+            st->report_num_drops++;
     }
 
+    if (!frame->decoded && display_stream_has_inter_frames(st)) {
+        /* the next frames are predicted from it, display_stream_render()
+         * skips it once decoded */
+        st->render_pending = TRUE;
+        display_stream_decode_next(st);
+        return TRUE;
+    }
+
+    frame = g_queue_pop_head(st->msgq);
+    display_stream_drop_frame(st, frame);
+    if (g_queue_get_length(st->msgq) == 0)
+        return TRUE;
+
     return FALSE;
 }
 
-static SpiceRect *stream_get_dest(display_stream *st)
+static SpiceRect *stream_get_dest(display_stream *st, SpiceMsgIn *frame_msg)
 {
-    if (st->msg_data == NULL ||
-        spice_msg_in_type(st->msg_data) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
+    if (spice_msg_in_type(frame_msg) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
         SpiceMsgDisplayStreamCreate *info = spice_msg_in_parsed(st->msg_create);
 
         return &info->dest;
     } else {
-        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(frame_msg);
 
         return &op->dest;
    }
@@ -1100,22 +1448,16 @@ static uint32_t stream_get_flags(display_stream *st)
     return info->flags;
 }
 
-G_GNUC_INTERNAL
-uint32_t stream_get_current_frame(display_stream *st, uint8_t **data)
+static uint32_t stream_get_current_frame(SpiceMsgIn *frame_msg, uint8_t **data)
 {
-    if (st->msg_data == NULL) {
-        *data = NULL;
-        return 0;
-    }
-
-    switch (spice_msg_in_type(st->msg_data)) {
+    switch (spice_msg_in_type(frame_msg)) {
     case SPICE_MSG_DISPLAY_STREAM_DATA: {
-        SpiceMsgDisplayStreamData *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamData *op = spice_msg_in_parsed(frame_msg);
         *data = op->data;
         return op->data_size;
     }
     case SPICE_MSG_DISPLAY_STREAM_DATA_SIZED: {
-        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(frame_msg);
         *data = op->data;
         return op->data_size;
     }
@@ -1125,88 +1467,295 @@ uint32_t stream_get_current_frame(display_stream *st, uint8_t **data)
     }
 }
 
-G_GNUC_INTERNAL
-void stream_get_dimensions(display_stream *st, int *width, int *height)
+static void stream_get_dimensions(display_stream *st, SpiceMsgIn *frame_msg,
+                                  int *width, int *height)
 {
     g_return_if_fail(width != NULL);
     g_return_if_fail(height != NULL);
 
-    if (st->msg_data == NULL ||
-        spice_msg_in_type(st->msg_data) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
+    if (spice_msg_in_type(frame_msg) != SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
         SpiceMsgDisplayStreamCreate *info = spice_msg_in_parsed(st->msg_create);
 
         *width = info->stream_width;
         *height = info->stream_height;
     } else {
-        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(st->msg_data);
+        SpiceMsgDisplayStreamDataSized *op = spice_msg_in_parsed(frame_msg);
 
         *width = op->width;
         *height = op->height;
    }
 }
 
+/* coroutine context */
+static display_frame *display_frame_new(display_stream *st, SpiceMsgIn *in)
+{
+    SpiceStreamDataHeader *op = spice_msg_in_parsed(in);
+    display_frame *frame = g_new0(display_frame, 1);
+
+    frame->msg = in;
+    spice_msg_in_ref(in);
+    frame->mm_time = op->multi_media_time;
+    frame->playout_time = op->multi_media_time + st->playout_delay;
+    frame->dest = stream_get_dest(st, in);
+    stream_get_dimensions(st, in, &frame->width, &frame->height);
+    frame->data_size = stream_get_current_frame(in, &frame->data);
+
+    return frame;
+}
+
+/* decoder thread */
+static void display_stream_decode_func(gpointer data, gpointer user_data)
+{
+    display_stream *st = data;
+    gboolean direct = st->decoding->direct;
+    gboolean valid = FALSE;
+
+    if (direct)
+        STATIC_MUTEX_LOCK(st->direct_lock);
+
+    if (st->decoder != NULL && (!direct || !st->direct_cancelled))
+        valid = st->decoder->decode_frame(st->decoder, st->decoding);
+    st->decoding->out_valid = valid;
+
+    if (direct)
+        STATIC_MUTEX_UNLOCK(st->direct_lock);
+
+    g_idle_add_full(G_PRIORITY_DEFAULT, display_stream_decode_done, st, NULL);
+}
+
 /* main context */
-static gboolean display_stream_render(display_stream *st)
+static GThreadPool *display_stream_decode_pool(void)
 {
-    SpiceMsgIn *in;
+    static GThreadPool *pool = NULL;
 
-    st->timeout = 0;
-    do {
-        in = g_queue_pop_head(st->msgq);
+    if (pool == NULL) {
+        gint max_threads = 2;
+        GError *error = NULL;
 
-        g_return_val_if_fail(in != NULL, FALSE);
+#if GLIB_CHECK_VERSION(2,36,0)
+        max_threads = CLAMP(g_get_num_processors(), 1, STREAM_DECODE_MAX_THREADS);
+#endif
+        pool = g_thread_pool_new(display_stream_decode_func, NULL,
+                                 max_threads, FALSE, &error);
+        if (error != NULL) {
+            g_error("failed to create the stream decoder threads: %s", error->message);
+        }
+    }
 
-        st->msg_data = in;
-        switch (st->codec) {
-        case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-            stream_mjpeg_data(st);
-            break;
+    return pool;
+}
+
+/* main context */
+static void display_stream_push_decode(display_stream *st)
+{
+    if (st->decode_thread != NULL)
+        g_thread_pool_push(st->decode_thread, st, NULL);
+    else
+        g_thread_pool_push(display_stream_decode_pool(), st, NULL);
+}
+
+/* whether the frame can be decoded straight in the surface, that is
+ * when it is neither clipped, flipped nor scaled, and no draw is
+ * suspended halfway in the surfaces */
+static gboolean display_stream_frame_is_direct(display_stream *st, display_frame *frame)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
+    display_surface *surface = st->surface;
+    SpiceRect *dest = frame->dest;
+
+    return !c->in_draw && !frame->late &&
+        st->decoder != NULL && st->decoder->strided &&
+        !st->have_region &&
+        (stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN) &&
+        surface != NULL && surface->data != NULL && surface->stride > 0 &&
+        (surface->format == SPICE_SURFACE_FMT_32_xRGB ||
+         surface->format == SPICE_SURFACE_FMT_32_ARGB) &&
+        dest->right - dest->left == frame->width &&
+        dest->bottom - dest->top == frame->height &&
+        dest->left >= 0 && dest->top >= 0 &&
+        dest->right <= surface->width && dest->bottom <= surface->height;
+}
+
+/* main or coroutine context */
+static void display_direct_decode_done(SpiceDisplayChannelPrivate *c)
+{
+    g_return_if_fail(c->direct_decodes > 0);
+
+    if (--c->direct_decodes == 0)
+        g_coroutine_wait_queue_wake(c->direct_waiters, 0);
+}
+
+/* main context */
+static void display_stream_decode_direct(display_stream *st, display_frame *frame)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(st->channel)->priv;
+    display_surface *surface = st->surface;
+
+    g_return_if_fail(st->decoding == NULL);
+
+    frame->direct = TRUE;
+    frame->out = surface->data +
+        frame->dest->top * surface->stride + frame->dest->left * 4;
+    frame->out_stride = surface->stride;
+    /* the channel doesn't draw until it's done, see spice_display_handle_msg().
+     * The area is only invalidated once decoded, but the widgets may
+     * still paint it meanwhile for other reasons, and show the frame
+     * partly decoded: that tearing is accepted, the invalidation
+     * repaints the whole frame right after, as for a copied frame
+     * painted over the previous one. */
+    c->direct_decodes++;
+
+    st->decoding = frame;
+    display_stream_push_decode(st);
+}
+
+/* main context */
+static void display_stream_decode_next(display_stream *st)
+{
+    GList *l;
+    guint decoded = 0;
+
+    if (st->decoding != NULL || st->destroyed)
+        return;
+
+    /* frames are decoded one at a time, in order, and no further than
+     * STREAM_DECODE_AHEAD frames in advance of the rendering */
+    for (l = st->msgq->head; l != NULL; l = l->next) {
+        display_frame *frame = l->data;
+
+        if (!frame->decoded) {
+            if (display_stream_frame_is_direct(st, frame))
+                return; /* decoded in the surface when it is due */
+
+            frame->out = display_frame_pool_get(&st->frame_pool,
+                                                frame->width, frame->height);
+            frame->out_stride = frame->width * 4;
+            st->decoding = frame;
+            display_stream_push_decode(st);
+            return;
         }
+        if (++decoded >= STREAM_DECODE_AHEAD)
+            return;
+    }
+}
 
-        if (st->out_frame) {
-            int width;
-            int height;
-            SpiceRect *dest;
-            uint8_t *data;
-            int stride;
-
-            stream_get_dimensions(st, &width, &height);
-            dest = stream_get_dest(st);
-
-            data = st->out_frame;
-            stride = width * sizeof(uint32_t);
-            if (!(stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN)) {
-                data += stride * (height - 1);
-                stride = -stride;
-            }
+/* main context */
+static gboolean display_stream_decode_done(gpointer data)
+{
+    display_stream *st = data;
+    display_frame *frame = st->decoding;
 
-            st->surface->canvas->ops->put_image(
-                st->surface->canvas,
+    st->decoding = NULL;
+    if (frame->direct && !st->destroyed) {
+        display_direct_decode_done(SPICE_DISPLAY_CHANNEL(st->channel)->priv);
+        /* the surface has changed, even if the frame got dropped
+         * meanwhile, or failed to decode halfway */
+        display_stream_invalidate(st, frame->dest);
+    }
+
+    if (frame->dropped) {
+        display_frame_free(st, frame);
+    } else if (frame->direct) {
+        /* already rendered */
+        g_queue_remove(st->msgq, frame);
+        display_frame_free(st, frame);
+        st->render_pending = FALSE;
+        while (!display_stream_schedule(st)) {
+        }
+    } else {
+        frame->decoded = TRUE;
+    }
+
+    if (st->destroyed) {
+        display_stream_free(st);
+        return FALSE;
+    }
+
+    display_stream_decode_next(st);
+
+    frame = g_queue_peek_head(st->msgq);
+    if (st->render_pending && frame != NULL && frame->decoded) {
+        st->render_pending = FALSE;
+        display_stream_render(st);
+    }
+
+    return FALSE;
+}
+
+/* main context */
+static void display_stream_invalidate(display_stream *st, SpiceRect *dest)
+{
+    display_surface_damage(st->channel, st->surface, dest);
+}
+
+/* main context */
+static void display_stream_put_frame(display_stream *st, display_frame *frame)
+{
+    SpiceRect *dest = frame->dest;
+    uint8_t *data;
+    int stride;
+
+    if (!frame->out_valid)
+        return;
+
+    data = frame->out;
+    stride = frame->width * sizeof(uint32_t);
+    if (!(stream_get_flags(st) & SPICE_STREAM_FLAGS_TOP_DOWN)) {
+        data += stride * (frame->height - 1);
+        stride = -stride;
+    }
+
+    st->surface->canvas->ops->put_image(
+        st->surface->canvas,
 #ifdef G_OS_WIN32
-                SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
+        SPICE_DISPLAY_CHANNEL(st->channel)->priv->dc,
 #endif
-                dest, data,
-                width, height, stride,
-                st->have_region ? &st->region : NULL);
-
-            if (st->surface->primary)
-                g_signal_emit(st->channel, signals[SPICE_DISPLAY_INVALIDATE], 0,
-                    dest->left, dest->top,
-                    dest->right - dest->left,
-                    dest->bottom - dest->top);
+        dest, data,
+        frame->width, frame->height, stride,
+        st->have_region ? &st->region : NULL);
+
+    display_stream_invalidate(st, dest);
+}
+
+/* main context */
+static gboolean display_stream_render(display_stream *st)
+{
+    display_frame *frame;
+
+    st->timeout = 0;
+    do {
+        frame = g_queue_peek_head(st->msgq);
+
+        g_return_val_if_fail(frame != NULL, FALSE);
+
+        if (!frame->decoded) {
+            if (st->decoding == NULL && display_stream_frame_is_direct(st, frame)) {
+                /* no copy needed, the decoder renders it */
+                display_stream_decode_direct(st, frame);
+            } else {
+                /* the decoder is late, render it as soon as it is done */
+                SPICE_DEBUG("%s: frame not decoded yet (ts: %u)", __FUNCTION__, frame->mm_time);
+                display_stream_decode_next(st);
+            }
+            st->render_pending = TRUE;
+            return FALSE;
         }
 
-        st->msg_data = NULL;
-        spice_msg_in_unref(in);
+        g_queue_pop_head(st->msgq);
+        if (!frame->late)
+            display_stream_put_frame(st, frame);
+        display_frame_free(st, frame);
 
-        in = g_queue_peek_head(st->msgq);
-        if (in == NULL)
+        frame = g_queue_peek_head(st->msgq);
+        if (frame == NULL)
             break;
 
         if (display_stream_schedule(st))
-            return FALSE;
+            break;
     } while (1);
 
+    display_stream_decode_next(st);
+
     return FALSE;
 }
 /* after a sequence of 3 drops, push a report to the server, even
@@ -1214,7 +1763,8 @@ static gboolean display_stream_render(display_stream *st)
 #define STREAM_REPORT_DROP_SEQ_LEN_LIMIT 3
 
 static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t stream_id,
-                                         uint32_t frame_time, int32_t latency)
+                                         uint32_t frame_time, int32_t latency,
+                                         gboolean dropped)
 {
     display_stream *st = channel->priv->streams[stream_id];
     guint64 now;
@@ -1230,7 +1780,7 @@ static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t
     }
     st->report_num_frames++;
 
-    if (latency < 0) { // drop
+    if (dropped) {
         st->report_num_drops++;
         st->report_drops_seq_len++;
     } else {
@@ -1269,6 +1819,43 @@ static void display_update_stream_report(SpiceDisplayChannel *channel, uint32_t
     }
 }
 
+/* the jitter buffer playout delay, as a multiple of the jitter */
+#define STREAM_JITTER_DELAY_FACTOR 3
+#define STREAM_JITTER_MAX_DELAY 400
+
+/* main or coroutine context */
+static void display_stream_reset_jitter(display_stream *st)
+{
+    st->jitter_valid = FALSE;
+    st->jitter = 0;
+    st->playout_delay = 0;
+}
+
+/* coroutine context */
+static void display_stream_update_jitter(display_stream *st, int32_t latency)
+{
+    guint32 target;
+
+    /* the RFC 3550 interarrival jitter estimator, the frames latency
+     * (mm_time - arrival time) being the transit time */
+    if (st->jitter_valid) {
+        gint32 d = ABS(latency - st->jitter_last_latency);
+
+        st->jitter += (d - st->jitter) / 16.;
+    }
+    st->jitter_last_latency = latency;
+    st->jitter_valid = TRUE;
+
+    target = MIN(st->jitter * STREAM_JITTER_DELAY_FACTOR, STREAM_JITTER_MAX_DELAY);
+    if (target > st->playout_delay) {
+        /* grow right away, to avoid drops */
+        st->playout_delay = target;
+    } else if (target < st->playout_delay) {
+        /* shrink slowly, so that frames stay evenly paced */
+        st->playout_delay--;
+    }
+}
+
 static void display_stream_reset_rendering_timer(display_stream *st)
 {
     SPICE_DEBUG("%s", __FUNCTION__);
@@ -1276,6 +1863,7 @@ static void display_stream_reset_rendering_timer(display_stream *st)
         g_source_remove(st->timeout);
         st->timeout = 0;
     }
+    st->render_pending = FALSE;
     while (!display_stream_schedule(st)) {
     }
 }
@@ -1330,6 +1918,7 @@ static void display_session_mm_time_reset_cb(SpiceSession *session, gpointer dat
         }
         SPICE_DEBUG("%s: stream-id %d", __FUNCTION__, i);
         st = c->streams[i];
+        display_stream_reset_jitter(st);
         display_stream_reset_rendering_timer(st);
     }
 }
@@ -1339,26 +1928,31 @@ static void display_stream_test_frames_mm_time_reset(display_stream *st,
                                                      SpiceMsgIn *new_frame_msg,
                                                      guint32 mm_time)
 {
-    SpiceStreamDataHeader *tail_op, *new_op;
-    SpiceMsgIn *tail_msg;
+    SpiceStreamDataHeader *new_op;
+    display_frame *tail_frame;
 
     SPICE_DEBUG("%s", __FUNCTION__);
     g_return_if_fail(new_frame_msg != NULL);
-    tail_msg = g_queue_peek_tail(st->msgq);
-    if (!tail_msg) {
+    tail_frame = g_queue_peek_tail(st->msgq);
+    if (!tail_frame) {
         return;
     }
-    tail_op = spice_msg_in_parsed(tail_msg);
     new_op = spice_msg_in_parsed(new_frame_msg);
 
-    if (new_op->multi_media_time < tail_op->multi_media_time) {
+    if (new_op->multi_media_time < tail_frame->mm_time) {
         SPICE_DEBUG("new-frame-time < tail-frame-time (%u < %u):"
                     " reseting stream, id %d",
                     new_op->multi_media_time,
-                    tail_op->multi_media_time,
+                    tail_frame->mm_time,
                     new_op->id);
-        g_queue_foreach(st->msgq, _msg_in_unref_func, NULL);
-        g_queue_clear(st->msgq);
+        if (display_stream_has_inter_frames(st)) {
+            /* still decoded, for the next frames */
+            g_queue_foreach(st->msgq, _frame_skip_func, NULL);
+        } else {
+            g_queue_foreach(st->msgq, _frame_drop_func, st);
+            g_queue_clear(st->msgq);
+        }
+        display_stream_reset_jitter(st);
         display_stream_reset_rendering_timer(st);
     }
 }
@@ -1373,6 +1967,7 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
     display_stream *st;
     guint32 mmtime;
     int32_t latency;
+    gboolean dropped;
 
     g_return_if_fail(c != NULL);
     g_return_if_fail(c->streams != NULL);
@@ -1396,9 +1991,12 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
     st->num_input_frames++;
 
     latency = op->multi_media_time - mmtime;
-    if (latency < 0) {
-        CHANNEL_DEBUG(channel, "stream data too late by %u ms (ts: %u, mmtime: %u), dropping",
-                      mmtime - op->multi_media_time, op->multi_media_time, mmtime);
+    display_stream_update_jitter(st, latency);
+    dropped = latency + (int32_t)st->playout_delay < 0;
+    if (dropped) {
+        CHANNEL_DEBUG(channel, "stream data too late by %u ms (ts: %u, delay: %u, mmtime: %u), dropping",
+                      mmtime - op->multi_media_time - st->playout_delay,
+                      op->multi_media_time, st->playout_delay, mmtime);
         st->arrive_late_time += mmtime - op->multi_media_time;
         st->num_drops_on_receive++;
 
@@ -1407,13 +2005,26 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
         }
         st->cur_drops_seq_stats.len++;
         st->playback_sync_drops_seq_len++;
+
+        if (display_stream_has_inter_frames(st)) {
+            /* the next frames are predicted from it, decode it anyway */
+            display_frame *frame = display_frame_new(st, in);
+
+            frame->late = TRUE;
+            g_queue_push_tail(st->msgq, frame);
+            while (!display_stream_schedule(st)) {
+            }
+            display_stream_decode_next(st);
+        }
     } else {
-        CHANNEL_DEBUG(channel, "video latency: %d", latency);
-        spice_msg_in_ref(in);
+        CHANNEL_DEBUG(channel, "video latency: %d, jitter: %.1f, playout delay: %u",
+                      latency, st->jitter, st->playout_delay);
         display_stream_test_frames_mm_time_reset(st, in, mmtime);
-        g_queue_push_tail(st->msgq, in);
+        g_queue_push_tail(st->msgq, display_frame_new(st, in));
         while (!display_stream_schedule(st)) {
         }
+        /* decode ahead of the frame time, off the main loop */
+        display_stream_decode_next(st);
         if (st->cur_drops_seq_stats.len) {
             st->cur_drops_seq_stats.duration = op->multi_media_time -
                                                st->cur_drops_seq_stats.start_mm_time;
@@ -1424,8 +2035,10 @@ static void display_handle_stream_data(SpiceChannel *channel, SpiceMsgIn *in)
         st->playback_sync_drops_seq_len = 0;
     }
     if (c->enable_adaptive_streaming) {
+        /* the latency is against the frame mm_time, so that the
+         * server can make up for the playout delay */
         display_update_stream_report(SPICE_DISPLAY_CHANNEL(channel), op->id,
-                                     op->multi_media_time, latency);
+                                     op->multi_media_time, latency, dropped);
         if (st->playback_sync_drops_seq_len >= STREAM_PLAYBACK_SYNC_DROP_SEQ_LEN_LIMIT) {
             spice_session_sync_playback_latency(spice_channel_get_session(channel));
             st->playback_sync_drops_seq_len = 0;
@@ -1455,11 +2068,6 @@ static void display_handle_stream_clip(SpiceChannel *channel, SpiceMsgIn *in)
     display_update_stream_region(st);
 }
 
-static void _msg_in_unref_func(gpointer data, gpointer user_data)
-{
-    spice_msg_in_unref(data);
-}
-
 static void destroy_stream(SpiceChannel *channel, int id)
 {
     SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
@@ -1479,13 +2087,14 @@ static void destroy_stream(SpiceChannel *channel, int id)
     num_out_frames = st->num_input_frames - st->num_drops_on_receive - st->num_drops_on_playback;
     CHANNEL_DEBUG(channel, "%s: id=%d #in-frames=%d out/in=%.2f "
         "#drops-on-receive=%d avg-late-time(ms)=%.2f "
-        "#drops-on-playback=%d", __FUNCTION__,
+        "#drops-on-playback=%d jitter(ms)=%.2f playout-delay(ms)=%u", __FUNCTION__,
         id,
         st->num_input_frames,
         num_out_frames / (double)st->num_input_frames,
         st->num_drops_on_receive,
         st->num_drops_on_receive ? st->arrive_late_time / ((double)st->num_drops_on_receive): 0,
-        st->num_drops_on_playback);
+        st->num_drops_on_playback,
+        st->jitter, st->playout_delay);
     if (st->num_drops_seqs) {
         CHANNEL_DEBUG(channel, "%s: #drops-sequences=%u ==>", __FUNCTION__, st->num_drops_seqs);
     }
@@ -1505,22 +2114,32 @@ static void destroy_stream(SpiceChannel *channel, int id)
 
     g_array_free(st->drops_seqs_stats_arr, TRUE);
 
-    switch (st->codec) {
-    case SPICE_VIDEO_CODEC_TYPE_MJPEG:
-        stream_mjpeg_cleanup(st);
-        break;
-    }
-
     if (st->msg_clip)
         spice_msg_in_unref(st->msg_clip);
     spice_msg_in_unref(st->msg_create);
 
-    g_queue_foreach(st->msgq, _msg_in_unref_func, NULL);
+    if (st->decoding != NULL && st->decoding->direct) {
+        /* make sure the decoder is done with the surface, which may be
+         * destroyed next */
+        STATIC_MUTEX_LOCK(st->direct_lock);
+        st->direct_cancelled = TRUE;
+        STATIC_MUTEX_UNLOCK(st->direct_lock);
+        display_direct_decode_done(c);
+    }
+
+    g_queue_foreach(st->msgq, _frame_drop_func, st);
     g_queue_free(st->msgq);
+    st->msgq = NULL;
     if (st->timeout != 0)
         g_source_remove(st->timeout);
-    g_free(st);
     c->streams[id] = NULL;
+
+    if (st->decoding != NULL) {
+        /* the decoder thread still uses it, it is freed when done */
+        st->destroyed = TRUE;
+        return;
+    }
+    display_stream_free(st);
 }
 
 static void clear_streams(SpiceChannel *channel)
@@ -1782,6 +2401,43 @@ static void display_handle_monitors_config(SpiceChannel *channel, SpiceMsgIn *in
     g_coroutine_object_notify(G_OBJECT(channel), "monitors");
 }
 
+static gboolean wait_direct_decodes(gpointer data)
+{
+    SpiceDisplayChannelPrivate *c = data;
+
+    return c->direct_decodes == 0;
+}
+
+/* coroutine context */
+static void spice_display_handle_msg(SpiceChannel *channel, SpiceMsgIn *msg)
+{
+    SpiceDisplayChannelPrivate *c = SPICE_DISPLAY_CHANNEL(channel)->priv;
+    SpiceChannelClass *parent_class;
+    int type = spice_msg_in_type(msg);
+
+    parent_class = SPICE_CHANNEL_CLASS(spice_display_channel_parent_class);
+
+    /* stream data doesn't touch the surfaces, let it through */
+    if (type == SPICE_MSG_DISPLAY_STREAM_DATA ||
+        type == SPICE_MSG_DISPLAY_STREAM_DATA_SIZED) {
+        parent_class->handle_msg(channel, msg);
+        return;
+    }
+
+    /* stream frames may be decoded straight in the surfaces by the
+     * decoder threads, don't draw before they are done */
+    if (!g_coroutine_wait_queue_wait(c->direct_waiters, g_coroutine_self(), 0,
+                                     wait_direct_decodes, c)) {
+        CHANNEL_DEBUG(channel, "direct stream decoding wait cancelled");
+        return;
+    }
+
+    /* and don't start one while the draw waits for an image */
+    c->in_draw = TRUE;
+    parent_class->handle_msg(channel, msg);
+    c->in_draw = FALSE;
+}
+
 static void channel_set_handlers(SpiceChannelClass *klass)
 {
     static const spice_msg_handler handlers[] = {
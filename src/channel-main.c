@@ -151,6 +151,7 @@ struct _SpiceMainChannelPrivate  {
     } display[MAX_DISPLAY];
     gint                        timer_id;
     GQueue                      *agent_msg_queue;
+    GHashTable                  *agent_xfer_starts; /* queued first chunks of file data */
     GHashTable                  *file_xfer_tasks;
     GHashTable                  *flushing;
 
@@ -287,6 +288,7 @@ static void spice_main_channel_init(SpiceMainChannel *channel)
 
     c = channel->priv = SPICE_MAIN_CHANNEL_GET_PRIVATE(channel);
     c->agent_msg_queue = g_queue_new();
+    c->agent_xfer_starts = g_hash_table_new(g_direct_hash, g_direct_equal);
     c->file_xfer_tasks = g_hash_table_new_full(g_direct_hash, g_direct_equal,
                                                NULL, g_object_unref);
     c->flushing = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
@@ -409,6 +411,7 @@ static void spice_main_channel_dispose(GObject *obj)
 
     g_clear_pointer(&c->file_xfer_tasks, g_hash_table_unref);
     g_clear_pointer (&c->flushing, g_hash_table_unref);
+    g_clear_pointer(&c->agent_xfer_starts, g_hash_table_unref);
 
     g_cancellable_cancel(c->cancellable_volume_info);
     g_clear_object(&c->cancellable_volume_info);
@@ -915,6 +918,8 @@ static void agent_free_msg_queue(SpiceMainChannel *channel)
         out = g_queue_pop_head(c->agent_msg_queue);
         spice_msg_out_unref(out);
     }
+    if (c->agent_xfer_starts)
+        g_hash_table_remove_all(c->agent_xfer_starts);
 
     g_queue_free(c->agent_msg_queue);
     c->agent_msg_queue = NULL;
@@ -975,6 +980,24 @@ static gboolean file_xfer_flush_finish(SpiceMainChannel *channel, GAsyncResult *
     return g_simple_async_result_get_op_res_gboolean(simple);
 }
 
+/* coroutine context */
+static void agent_msg_written(SpiceMsgOut *out, gpointer user_data)
+{
+    SpiceMainChannelPrivate *c = SPICE_MAIN_CHANNEL(user_data)->priv;
+    GSimpleAsyncResult *simple;
+
+    /* the flush tasks are completed when the channel is reset */
+    if (c->flushing == NULL)
+        return;
+
+    simple = g_hash_table_lookup(c->flushing, out);
+    if (simple) {
+        g_simple_async_result_set_op_res_gboolean(simple, TRUE);
+        g_simple_async_result_complete_in_idle(simple);
+        g_hash_table_remove(c->flushing, out);
+    }
+}
+
 /* coroutine context */
 static void agent_send_msg_queue(SpiceMainChannel *channel)
 {
@@ -983,23 +1006,48 @@ static void agent_send_msg_queue(SpiceMainChannel *channel)
 
     while (c->agent_tokens > 0 &&
            !g_queue_is_empty(c->agent_msg_queue)) {
-        GSimpleAsyncResult *simple;
         c->agent_tokens--;
         out = g_queue_pop_head(c->agent_msg_queue);
-        spice_msg_out_send_internal(out);
+        g_hash_table_remove(c->agent_xfer_starts, out);
+        /* if there's a flush task waiting for this message, finish it
+           once written, rather than when queued */
+        if (g_hash_table_lookup(c->flushing, out) != NULL) {
+            out->written = agent_msg_written;
+            out->written_data = channel;
+        }
+        /* goes to the bulk lane, written by the parent iterate_write()
+           interleaved with the other main channel messages */
+        spice_msg_out_send(out);
+    }
+}
 
-        simple = g_hash_table_lookup(c->flushing, out);
-        if (simple) {
-            /* if there's a flush task waiting for this message, finish it */
-            g_simple_async_result_set_op_res_gboolean(simple, TRUE);
-            g_simple_async_result_complete_in_idle(simple);
-            g_hash_table_remove(c->flushing, out);
+/*
+ * A monitors config goes ahead of the queued file transfer data, for
+ * the guest to follow a resize without waiting for the transfer. The
+ * chunks of an agent message must stay together, so it is inserted
+ * where a file data message starts.
+ */
+static void agent_msg_queue_push(SpiceMainChannel *channel, int type, GQueue *msgs)
+{
+    SpiceMainChannelPrivate *c = channel->priv;
+    GList *sibling = NULL;
+    SpiceMsgOut *out;
+
+    if (type == VD_AGENT_MONITORS_CONFIG) {
+        for (sibling = c->agent_msg_queue->head; sibling != NULL; sibling = sibling->next) {
+            if (g_hash_table_lookup(c->agent_xfer_starts, sibling->data) != NULL)
+                break;
         }
+    } else if (type == VD_AGENT_FILE_XFER_DATA && !g_queue_is_empty(msgs)) {
+        out = g_queue_peek_head(msgs);
+        g_hash_table_insert(c->agent_xfer_starts, out, out);
     }
-    if (g_queue_is_empty(c->agent_msg_queue) &&
-        g_hash_table_size(c->flushing) != 0) {
-        g_warning("unexpected flush task in list, clearing");
-        file_xfer_flushed(channel, TRUE);
+
+    while ((out = g_queue_pop_head(msgs)) != NULL) {
+        if (sibling != NULL)
+            g_queue_insert_before(c->agent_msg_queue, sibling, out);
+        else
+            g_queue_push_tail(c->agent_msg_queue, out);
     }
 }
 
@@ -1015,7 +1063,7 @@ G_GNUC_NULL_TERMINATED
 static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void *data, ...)
 {
     va_list args;
-    SpiceMainChannelPrivate *c = channel->priv;
+    GQueue msgs = G_QUEUE_INIT;
     SpiceMsgOut *out;
     VDAgentMessage msg;
     guint8 *payload;
@@ -1042,7 +1090,7 @@ static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void
     payload += sizeof(VDAgentMessage);
     paysize -= sizeof(VDAgentMessage);
     if (paysize == 0) {
-        g_queue_push_tail(c->agent_msg_queue, out);
+        g_queue_push_tail(&msgs, out);
         out = NULL;
     }
 
@@ -1063,13 +1111,15 @@ static void agent_msg_queue_many(SpiceMainChannel *channel, int type, const void
             size -= mins;
             paysize -= mins;
             if (paysize == 0) {
-                g_queue_push_tail(c->agent_msg_queue, out);
+                g_queue_push_tail(&msgs, out);
                 out = NULL;
             }
         }
     }
     va_end(args);
     g_warn_if_fail(out == NULL);
+
+    agent_msg_queue_push(channel, type, &msgs);
 }
 
 static int monitors_cmp(const void *p1, const void *p2, gpointer user_data)
@@ -1697,31 +1747,11 @@ static void main_handle_mm_time(SpiceChannel *channel, SpiceMsgIn *in)
     spice_session_set_mm_time(session, msg->time);
 }
 
-typedef struct channel_new {
-    SpiceSession *session;
-    int type;
-    int id;
-} channel_new_t;
-
-/* main context */
-static gboolean _channel_new(channel_new_t *c)
-{
-    g_return_val_if_fail(c != NULL, FALSE);
-
-    spice_channel_new(c->session, c->type, c->id);
-
-    g_object_unref(c->session);
-    g_free(c);
-
-    return FALSE;
-}
-
 /* coroutine context */
 static void main_handle_channels_list(SpiceChannel *channel, SpiceMsgIn *in)
 {
     SpiceMsgChannels *msg = spice_msg_in_parsed(in);
     SpiceSession *session;
-    int i;
 
     session = spice_channel_get_session(channel);
 
@@ -1729,18 +1759,7 @@ static void main_handle_channels_list(SpiceChannel *channel, SpiceMsgIn *in)
      * the server is older and doesn't actually send the uuid */
     g_coroutine_object_notify(G_OBJECT(session), "uuid");
 
-    for (i = 0; i < msg->num_of_channels; i++) {
-        channel_new_t *c;
-
-        c = g_new(channel_new_t, 1);
-        c->session = g_object_ref(session);
-        c->type = msg->channels[i].type;
-        c->id = msg->channels[i].id;
-        /* no need to explicitely switch to main context, since
-           synchronous call is not needed. */
-        /* no need to track idle, session is refed */
-        g_idle_add((GSourceFunc)_channel_new, c);
-    }
+    spice_session_channels_new(session, msg->channels, msg->num_of_channels);
 }
 
 /* coroutine context */
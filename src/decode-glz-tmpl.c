@@ -168,6 +168,13 @@
 #define COPY_COMP_PIXEL(in, out) {out->pad = *(in++); out++;}
 #endif
 
+#if defined(LZ_RGB32) || defined(TO_RGB32)
+#define COPY_REF_PIXELS(ref, out, len) {                               \
+    glz_copy_pixels32((uint8_t *)(out), (const uint8_t *)(ref), len);  \
+    out += len;                                                        \
+}
+#endif
+
 // TODO: separate into routines that decode to dist,len. and to a routine that
 // actually copies the data.
 
@@ -257,7 +264,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
                 g_return_val_if_fail(ref >= out_pix_buf, 0);
             } else {
                 ref = glz_decoder_window_bits(window, image_id,
-                                              image_dist, pixel_ofs);
+                                              image_dist, pixel_ofs, len);
             }
 
             g_return_val_if_fail(ref != NULL, 0);
@@ -265,6 +272,9 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 
             /* copying the match*/
 
+#ifdef COPY_REF_PIXELS
+            COPY_REF_PIXELS(ref, op, len);
+#else
             if (ref == (op - 1)) { // run (this will never be called in PLT4/1_TO_RGB because the
                                   // number of pixel copied is larger then one...
                 /* optimize copy for a run */
@@ -279,6 +289,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
                     g_return_val_if_fail(op <= op_limit, 0);
                 }
             }
+#endif
         } else { // copy
             ctrl++; // copy count is biased by 1
 #if defined(TO_RGB32) && (defined(PLT4_BE) || defined(PLT4_LE) || defined(PLT1_BE) || \
@@ -331,6 +342,7 @@ static size_t FNAME(decode)(SpiceGlzDecoderWindow *window,
 #undef FNAME
 #undef COPY_PIXEL
 #undef COPY_REF_PIXEL
+#undef COPY_REF_PIXELS
 #undef COPY_COMP_PIXEL
 #undef COPY_PLT_ENTRY
 #undef CAST_PLT_DISTANCE
@@ -18,6 +18,7 @@
 #include "config.h"
 
 #include <stdio.h>
+#include <string.h>
 #include <stdbool.h>
 #include <inttypes.h>
 
@@ -42,93 +43,130 @@ struct glz_image_hdr {
 struct glz_image {
     struct glz_image_hdr    hdr;
     pixman_image_t          *surface;
-    uint8_t                 *data;
+    uint8_t                 *data;    /* the first pixel, top-down */
+    bool                    released;
 };
 
-static struct glz_image *glz_image_new(struct glz_image_hdr *hdr,
-                                       int type, void *opaque)
-{
-    struct glz_image *img;
+/* ------------------------------------------------------------------ */
 
-    g_return_val_if_fail(type == LZ_IMAGE_TYPE_RGB32 || type == LZ_IMAGE_TYPE_RGBA, NULL);
+#define INIT_RECORDS_CAPACITY 64
+#define INIT_SLOTS_CAPACITY 64
 
-    img = g_new0(struct glz_image, 1);
-    img->hdr = *hdr;
-    img->surface = alloc_lz_image_surface
-        (opaque, type == LZ_IMAGE_TYPE_RGBA ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
-         img->hdr.width, img->hdr.height, img->hdr.gross_pixels, img->hdr.top_down);
-    pixman_image_ref(img->surface);
-    img->data = (uint8_t *)pixman_image_get_data(img->surface);
-    if (!img->hdr.top_down) {
-        img->data = img->data - img->hdr.width * (img->hdr.height - 1) * 4;
-    }
-    return img;
+/*
+ * The window keeps a reference on the surface each image was decoded
+ * to, the one the canvas gets, so the pixels aren't copied. The image
+ * records are kept in a ring, in arrival order, and releasing the
+ * oldest images only moves the ring tail.
+ *
+ * Images can come in out of order, this can happen when a vm has
+ * multiple displays, since each display uses its own socket there is no
+ * guarantee that images originating from different displays are received
+ * in id order. The images are thus released in id order, but their
+ * records are only given back once all the images that came in before
+ * them are released too.
+ */
+struct SpiceGlzDecoderWindow {
+    /* image records, in arrival order: seq % nrecords */
+    struct glz_image        *records;
+    uint32_t                nrecords;
+    uint64_t                rec_tail;   /* oldest seq not given back */
+    uint64_t                rec_head;   /* next seq */
+
+    /* id % nslots -> seq + 1, or 0, for the ids from oldest on */
+    uint64_t                *slots;
+    uint32_t                nslots;
+
+    uint64_t                oldest;
+    uint64_t                tail_gap;
+    gsize                   bytes;      /* of the images not released */
+
+    /* decoders waiting for an image from another channel */
+    GCoroutineWaitQueue     *waiters;
+};
+
+static inline gsize glz_image_bytes(const struct glz_image_hdr *hdr)
+{
+    return (gsize)hdr->gross_pixels * 4;
 }
 
-static void glz_image_destroy(struct glz_image *img)
+static struct glz_image *glz_decoder_window_find(SpiceGlzDecoderWindow *w, uint64_t id)
 {
-    if (img == NULL)
-        return;
+    struct glz_image *img;
+    uint64_t seq;
 
-    pixman_image_unref(img->surface);
-    free(img);
-}
+    if (id < w->oldest || id - w->oldest >= w->nslots)
+        return NULL;
 
-/* ------------------------------------------------------------------ */
+    seq = w->slots[id % w->nslots];
+    if (seq == 0)
+        return NULL;
 
-#define INIT_IMAGES_CAPACITY 100
-#define WIN_OVERFLOW_FACTOR 1.5
-#define WIN_REALLOC_FACTOR 1.5
+    img = &w->records[(seq - 1) % w->nrecords];
+    g_return_val_if_fail(img->hdr.id == id, NULL);
 
-struct SpiceGlzDecoderWindow {
-    struct glz_image        **images;
-    uint32_t                nimages;
-    uint64_t                oldest;
-    uint64_t                tail_gap;
-};
+    return img;
+}
 
-static void glz_decoder_window_resize(SpiceGlzDecoderWindow *w)
+static void glz_decoder_window_resize_slots(SpiceGlzDecoderWindow *w, uint64_t span)
 {
-    struct glz_image  **new_images;
-    int i, new_slot;
-
-    SPICE_DEBUG("%s: array resize %d -> %d", __FUNCTION__,
-                w->nimages, w->nimages * 2);
-    new_images = g_new0(struct glz_image*, w->nimages * 2);
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i] == NULL) {
-            /*
-             * We can have empty slots when images come in out of order, this
-             * can happen when a vm has multiple displays, since each display
-             * uses its own socket there is no guarantee that images
-             * originating from different displays are received in id order.
-             */
-            continue;
-        }
-        new_slot = w->images[i]->hdr.id % (w->nimages * 2);
-        new_images[new_slot] = w->images[i];
-    }
-    free(w->images);
-    w->images = new_images;
-    w->nimages *= 2;
+    uint64_t *new_slots;
+    uint32_t new_nslots = w->nslots;
+    uint64_t id;
+
+    while (new_nslots < span)
+        new_nslots *= 2;
+
+    SPICE_DEBUG("%s: slots resize %u -> %u", __FUNCTION__, w->nslots, new_nslots);
+    new_slots = g_new0(uint64_t, new_nslots);
+    for (id = w->oldest; id < w->oldest + w->nslots; id++)
+        new_slots[id % new_nslots] = w->slots[id % w->nslots];
+    g_free(w->slots);
+    w->slots = new_slots;
+    w->nslots = new_nslots;
 }
 
-static void glz_decoder_window_add(SpiceGlzDecoderWindow *w,
-                                   struct glz_image *img)
+static void glz_decoder_window_resize_records(SpiceGlzDecoderWindow *w)
 {
-    int slot = img->hdr.id % w->nimages;
+    struct glz_image *new_records;
+    uint64_t seq;
+
+    SPICE_DEBUG("%s: records resize %u -> %u", __FUNCTION__,
+                w->nrecords, w->nrecords * 2);
+    new_records = g_new(struct glz_image, w->nrecords * 2);
+    for (seq = w->rec_tail; seq < w->rec_head; seq++)
+        new_records[seq % (w->nrecords * 2)] = w->records[seq % w->nrecords];
+    g_free(w->records);
+    w->records = new_records;
+    w->nrecords *= 2;
+}
 
-    if (w->images[slot]) {
-        /* need more space */
-        glz_decoder_window_resize(w);
-        slot = img->hdr.id % w->nimages;
-    }
+/* @data is the first pixel of @surface, top-down */
+static void glz_decoder_window_add(SpiceGlzDecoderWindow *w, struct glz_image_hdr *hdr,
+                                   pixman_image_t *surface, uint8_t *data)
+{
+    struct glz_image *img;
+
+    g_return_if_fail(hdr->id >= w->oldest);
+    g_return_if_fail(glz_decoder_window_find(w, hdr->id) == NULL);
 
-    w->images[slot] = img;
+    if (hdr->id - w->oldest >= w->nslots)
+        glz_decoder_window_resize_slots(w, hdr->id - w->oldest + 1);
+    if (w->rec_head - w->rec_tail == w->nrecords)
+        glz_decoder_window_resize_records(w);
+
+    img = &w->records[w->rec_head % w->nrecords];
+    img->hdr = *hdr;
+    img->surface = pixman_image_ref(surface);
+    img->data = data;
+    img->released = false;
+    w->bytes += glz_image_bytes(hdr);
+    w->slots[hdr->id % w->nslots] = ++w->rec_head;
 
     /* close the gap */
-    while (w->tail_gap <= img->hdr.id && w->images[w->tail_gap % w->nimages] != NULL)
+    while (w->tail_gap <= hdr->id && glz_decoder_window_find(w, w->tail_gap) != NULL)
         w->tail_gap++;
+
+    g_coroutine_wait_queue_wake(w->waiters, hdr->id);
 }
 
 struct wait_for_image_data {
@@ -139,44 +177,54 @@ struct wait_for_image_data {
 static gboolean wait_for_image(gpointer data)
 {
     struct wait_for_image_data *wait = data;
-    int slot = wait->id % wait->window->nimages;
-    struct glz_image *image = wait->window->images[slot];
-    gboolean ready = image && image->hdr.id == wait->id;
 
-    return ready;
+    return glz_decoder_window_find(wait->window, wait->id) != NULL;
 }
 
+/* the @len pixels from @offset of image @id - @dist, which the server
+ * tells, so they are checked to be within it */
 static void *glz_decoder_window_bits(SpiceGlzDecoderWindow *w, uint64_t id,
-                                     uint32_t dist, uint32_t offset)
+                                     uint32_t dist, uint32_t offset, uint32_t len)
 {
     struct wait_for_image_data data = {
         .window = w,
         .id = id - dist,
     };
+    struct glz_image *img;
 
-    if (!g_coroutine_condition_wait(g_coroutine_self(), wait_for_image, &data))
+    if (!g_coroutine_wait_queue_wait(w->waiters, g_coroutine_self(), id - dist,
+                                     wait_for_image, &data))
         SPICE_DEBUG("wait for image cancelled");
 
-    int slot = (id - dist) % w->nimages;
+    img = glz_decoder_window_find(w, id - dist);
 
-    g_return_val_if_fail(w->images[slot] != NULL, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.id == id - dist, NULL);
-    g_return_val_if_fail(w->images[slot]->hdr.gross_pixels >= offset, NULL);
+    g_return_val_if_fail(img != NULL, NULL);
+    g_return_val_if_fail(offset <= img->hdr.gross_pixels, NULL);
+    g_return_val_if_fail(len <= img->hdr.gross_pixels - offset, NULL);
 
-    return w->images[slot]->data + offset * 4;
+    return img->data + (gsize)offset * 4;
 }
 
 static void glz_decoder_window_release(SpiceGlzDecoderWindow *w,
                                        uint64_t oldest)
 {
-    int slot;
+    struct glz_image *img;
 
     while (w->oldest < oldest) {
-        slot = w->oldest % w->nimages;
-        glz_image_destroy(w->images[slot]);
-        w->images[slot] = NULL;
+        img = glz_decoder_window_find(w, w->oldest);
+        if (img != NULL) {
+            img->released = true;
+            pixman_image_unref(img->surface);
+            img->surface = NULL;
+            w->bytes -= glz_image_bytes(&img->hdr);
+            w->slots[w->oldest % w->nslots] = 0;
+        }
         w->oldest++;
     }
+
+    /* give the records back, in arrival order */
+    while (w->rec_tail < w->rec_head && w->records[w->rec_tail % w->nrecords].released)
+        w->rec_tail++;
 }
 
 /* ------------------------------------------------------------------ */
@@ -238,6 +286,88 @@ typedef uint16_t rgb16_pixel_t;
 
 #undef ATTR_PACKED
 
+/*
+ * Match copies for the 32 bits output formats, which take most of the
+ * decoding time on desktop content: runs of a single pixel, short
+ * repeating patterns, and long copies from the rows above or from
+ * previous images. The library memcpy() is already vectorized for the
+ * latter, only the fills need SSE2/NEON.
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+/* in pixels, below which a plain loop beats a memcpy() call */
+#define GLZ_COPY_SHORT 8
+
+static inline void glz_fill_pixels32(uint8_t *op, const uint8_t *ref, uint32_t len)
+{
+    uint32_t pixel;
+
+    memcpy(&pixel, ref, 4);
+#if defined(__SSE2__)
+    if (len >= 16) {
+        __m128i v = _mm_set1_epi32(pixel);
+
+        /* a cache line at a time */
+        for (; len >= 16; len -= 16, op += 64) {
+            _mm_storeu_si128((__m128i *)op, v);
+            _mm_storeu_si128((__m128i *)(op + 16), v);
+            _mm_storeu_si128((__m128i *)(op + 32), v);
+            _mm_storeu_si128((__m128i *)(op + 48), v);
+        }
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    if (len >= 16) {
+        uint8x16_t v = vreinterpretq_u8_u32(vdupq_n_u32(pixel));
+
+        for (; len >= 16; len -= 16, op += 64) {
+            vst1q_u8(op, v);
+            vst1q_u8(op + 16, v);
+            vst1q_u8(op + 32, v);
+            vst1q_u8(op + 48, v);
+        }
+    }
+#endif
+    for (; len; len--, op += 4)
+        memcpy(op, &pixel, 4);
+}
+
+static inline void glz_copy_pixels32(uint8_t *op, const uint8_t *ref, uint32_t len)
+{
+    size_t size = (size_t)len * 4;
+    size_t dist;
+
+    /* from another image, or far enough behind */
+    if (ref + size <= op || ref >= op + size) {
+        if (len < GLZ_COPY_SHORT) {
+            for (; len; len--, op += 4, ref += 4)
+                memcpy(op, ref, 4);
+        } else {
+            memcpy(op, ref, size);
+        }
+        return;
+    }
+
+    dist = op - ref;
+    if (dist == 4) {
+        glz_fill_pixels32(op, ref, len);
+        return;
+    }
+
+    /* a pattern of dist bytes, copy it over and over, doubling the
+     * copied size each time */
+    while (size > dist) {
+        memcpy(op, ref, dist);
+        op += dist;
+        size -= dist;
+        dist *= 2;
+    }
+    memcpy(op, ref, size);
+}
+
 #define LZ_PLT
 #include "decode-glz-tmpl.c"
 
@@ -379,8 +509,8 @@ static void decode(SpiceGlzDecoder *decoder,
                    void *usr_data)
 {
     GlibGlzDecoder *d = SPICE_CONTAINEROF(decoder, GlibGlzDecoder, base);
-    LzImageType decoded_type;
-    struct glz_image *decoded_image;
+    pixman_image_t *surface;
+    uint8_t *out;
     size_t n_in_bytes_decoded;
 
     d->in_start = data;
@@ -388,31 +518,36 @@ static void decode(SpiceGlzDecoder *decoder,
 
     decode_header(d);
 
-    if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
-        decoded_type = LZ_IMAGE_TYPE_RGBA;
-    } else {
-        decoded_type = LZ_IMAGE_TYPE_RGB32;
+    /* the canvas and the window share the surface */
+    surface = alloc_lz_image_surface
+        (usr_data, d->image.type == LZ_IMAGE_TYPE_RGBA ? PIXMAN_a8r8g8b8 : PIXMAN_x8r8g8b8,
+         d->image.width, d->image.height, d->image.gross_pixels, d->image.top_down);
+    out = (uint8_t *)pixman_image_get_data(surface);
+    if (!d->image.top_down) {
+        out = out - d->image.width * (d->image.height - 1) * 4;
     }
 
-    decoded_image = glz_image_new(&d->image, decoded_type, usr_data);
-
     n_in_bytes_decoded = DECODE_TO_RGB32[d->image.type]
-        (d->window, d->in_now, decoded_image->data,
+        (d->window, d->in_now, out,
          d->image.gross_pixels, d->image.id, palette);
 
     d->in_now += n_in_bytes_decoded;
 
     if (d->image.type == LZ_IMAGE_TYPE_RGBA) {
-        glz_rgb_alpha_decode(d->window, d->in_now, decoded_image->data,
+        glz_rgb_alpha_decode(d->window, d->in_now, out,
                              d->image.gross_pixels, d->image.id, palette);
     }
 
-    glz_decoder_window_add(d->window, decoded_image);
+    glz_decoder_window_add(d->window, &d->image, surface, out);
 
     { /* release old images from last tail_gap, only if the gap is closed  */
         uint64_t oldest;
-        struct glz_image *image = d->window->images[(d->window->tail_gap - 1) % d->window->nimages];
+        struct glz_image *image;
+
+        if (d->window->tail_gap == 0)
+            return;
 
+        image = glz_decoder_window_find(d->window, d->window->tail_gap - 1);
         g_return_if_fail(image != NULL);
 
         oldest = image->hdr.id - image->hdr.win_head_dist;
@@ -428,25 +563,41 @@ static SpiceGlzDecoderOps glz_decoder_ops = {
 
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w)
 {
-    int i;
+    uint64_t seq;
 
-    g_return_if_fail(w->nimages == 0 || w->images != NULL);
+    for (seq = w->rec_tail; seq < w->rec_head; seq++) {
+        struct glz_image *img = &w->records[seq % w->nrecords];
 
-    for (i = 0; i < w->nimages; i++) {
-        if (w->images[i]) {
-            glz_image_destroy(w->images[i]);
-        }
+        if (!img->released)
+            pixman_image_unref(img->surface);
     }
+    w->bytes = 0;
+
+    w->nrecords = INIT_RECORDS_CAPACITY;
+    g_free(w->records);
+    w->records = g_new(struct glz_image, w->nrecords);
+    w->rec_tail = 0;
+    w->rec_head = 0;
 
-    w->nimages = 16;
-    g_free(w->images);
-    w->images = g_new0(struct glz_image*, w->nimages);
+    w->nslots = INIT_SLOTS_CAPACITY;
+    g_free(w->slots);
+    w->slots = g_new0(uint64_t, w->nslots);
+
+    w->oldest = 0;
     w->tail_gap = 0;
 }
 
+/* the bytes of the images the window holds, the canvas may hold some
+ * of them too */
+gsize glz_decoder_window_get_bytes(SpiceGlzDecoderWindow *w)
+{
+    return w->bytes;
+}
+
 SpiceGlzDecoderWindow *glz_decoder_window_new(void)
 {
     SpiceGlzDecoderWindow *w = g_new0(SpiceGlzDecoderWindow, 1);
+    w->waiters = g_coroutine_wait_queue_new();
     glz_decoder_window_clear(w);
     return w;
 }
@@ -457,7 +608,9 @@ void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w)
         return;
 
     glz_decoder_window_clear(w);
-    free(w->images);
+    g_free(w->records);
+    g_free(w->slots);
+    g_coroutine_wait_queue_free(w->waiters);
     free(w);
 }
 
@@ -44,6 +44,10 @@ typedef struct GlibJpegDecoder
     int      _data_size;
     int      _width;
     int      _height;
+
+    /* for the RGB to BGR(X) conversion, when libjpeg can't do it */
+    uint8_t* _scan_lines;
+    gsize    _scan_lines_size;
 } GlibJpegDecoder;
 
 static void begin_decode(SpiceJpegDecoder *decoder,
@@ -66,7 +70,6 @@ static void begin_decode(SpiceJpegDecoder *decoder,
 
     jpeg_read_header(&d->_cinfo, TRUE);
 
-    d->_cinfo.out_color_space = JCS_RGB;
     d->_width = d->_cinfo.image_width;
     d->_height = d->_cinfo.image_height;
 
@@ -74,9 +77,6 @@ static void begin_decode(SpiceJpegDecoder *decoder,
     *out_height = d->_height;
 }
 
-/* TODO: move it elsewhere and reuse it in get_pixbuf(), optimize? */
-typedef void (*converter_rgb_t)(uint8_t* src, uint8_t* dest, int width);
-
 static void convert_rgb_to_bgr(uint8_t* src, uint8_t* dest, int width)
 {
     int x;
@@ -102,34 +102,195 @@ static void convert_rgb_to_bgrx(uint8_t* src, uint8_t* dest, int width)
     }
 }
 
-static void decode(SpiceJpegDecoder *decoder,
-                   uint8_t* dest, int stride, int format)
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_CONVERTERS
+#include <immintrin.h>
+
+/* SSE2 has no byte shuffle, so the baseline x86 version needs SSSE3 */
+__attribute__((target("ssse3")))
+static void convert_rgb_to_bgrx_ssse3(uint8_t* src, uint8_t* dest, int width)
 {
-    GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
-    uint8_t* scan_line = g_alloca(d->_width * 3);
-    converter_rgb_t converter = NULL;
-    int row;
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                       8, 7, 6, -1, 11, 10, 9, -1);
+    int x;
+
+    /* 4 pixels at a time, each load reads 4 bytes past them */
+    for (x = 0; x + 6 <= width; x += 4) {
+        __m128i rgb = _mm_loadu_si128((const __m128i *)src);
+        _mm_storeu_si128((__m128i *)dest, _mm_shuffle_epi8(rgb, mask));
+        src += 12;
+        dest += 16;
+    }
+    convert_rgb_to_bgrx(src, dest, width - x);
+}
+
+__attribute__((target("avx2")))
+static void convert_rgb_to_bgrx_avx2(uint8_t* src, uint8_t* dest, int width)
+{
+    const __m256i mask = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1,
+                                          8, 7, 6, -1, 11, 10, 9, -1,
+                                          2, 1, 0, -1, 5, 4, 3, -1,
+                                          8, 7, 6, -1, 11, 10, 9, -1);
+    int x;
+
+    /* 8 pixels at a time, 4 in each lane, the second load reads 4
+     * bytes past them */
+    for (x = 0; x + 10 <= width; x += 8) {
+        __m256i rgb = _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)src));
+        rgb = _mm256_inserti128_si256(rgb, _mm_loadu_si128((const __m128i *)(src + 12)), 1);
+        _mm256_storeu_si256((__m256i *)dest, _mm256_shuffle_epi8(rgb, mask));
+        src += 24;
+        dest += 32;
+    }
+    convert_rgb_to_bgrx(src, dest, width - x);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_CONVERTERS
+#include <arm_neon.h>
+
+static void convert_rgb_to_bgrx_neon(uint8_t* src, uint8_t* dest, int width)
+{
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        uint8x16x3_t rgb = vld3q_u8(src);
+        uint8x16x4_t bgrx;
+
+        bgrx.val[0] = rgb.val[2];
+        bgrx.val[1] = rgb.val[1];
+        bgrx.val[2] = rgb.val[0];
+        bgrx.val[3] = vdupq_n_u8(0);
+        vst4q_u8(dest, bgrx);
+        src += 48;
+        dest += 64;
+    }
+    convert_rgb_to_bgrx(src, dest, width - x);
+}
+
+static void convert_rgb_to_bgr_neon(uint8_t* src, uint8_t* dest, int width)
+{
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        uint8x16x3_t rgb = vld3q_u8(src);
+        uint8x16x3_t bgr;
+
+        bgr.val[0] = rgb.val[2];
+        bgr.val[1] = rgb.val[1];
+        bgr.val[2] = rgb.val[0];
+        vst3q_u8(dest, bgr);
+        src += 48;
+        dest += 48;
+    }
+    convert_rgb_to_bgr(src, dest, width - x);
+}
+#endif
+
+static SpiceRgbConverter get_bgrx_converter(void)
+{
+#ifdef HAVE_X86_CONVERTERS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return convert_rgb_to_bgrx_avx2;
+    if (__builtin_cpu_supports("ssse3"))
+        return convert_rgb_to_bgrx_ssse3;
+#endif
+#ifdef HAVE_NEON_CONVERTERS
+    return convert_rgb_to_bgrx_neon;
+#endif
+    return convert_rgb_to_bgrx;
+}
+
+SpiceRgbConverter jpeg_get_converter(int format)
+{
+    /* the cpu doesn't change, probe it once */
+    static gsize bgrx_converter = 0;
 
     switch (format) {
     case SPICE_BITMAP_FMT_24BIT:
-        converter = convert_rgb_to_bgr;
-        break;
+#ifdef HAVE_NEON_CONVERTERS
+        return convert_rgb_to_bgr_neon;
+#endif
+        return convert_rgb_to_bgr;
     case SPICE_BITMAP_FMT_32BIT:
-        converter = convert_rgb_to_bgrx;
-        break;
+        if (g_once_init_enter(&bgrx_converter))
+            g_once_init_leave(&bgrx_converter, (gsize)get_bgrx_converter());
+        return (SpiceRgbConverter)bgrx_converter;
     default:
+        return NULL;
+    }
+}
+
+/* libjpeg-turbo can output BGR(X) itself, skipping the conversion */
+static J_COLOR_SPACE get_color_space(int format)
+{
+#ifdef JCS_EXTENSIONS
+    switch (format) {
+    case SPICE_BITMAP_FMT_24BIT:
+        return JCS_EXT_BGR;
+    case SPICE_BITMAP_FMT_32BIT:
+        return JCS_EXT_BGRX;
+    }
+#endif
+    return JCS_RGB;
+}
+
+static void decode(SpiceJpegDecoder *decoder,
+                   uint8_t* dest, int stride, int format)
+{
+    GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
+    SpiceRgbConverter converter = NULL;
+    JSAMPROW *rows;
+    int lines, i;
+
+    if (format != SPICE_BITMAP_FMT_24BIT && format != SPICE_BITMAP_FMT_32BIT) {
         g_warning("bad bitmap format, %d", format);
         return;
     }
 
-    g_return_if_fail(converter != NULL);
+    d->_cinfo.out_color_space = get_color_space(format);
+    if (d->_cinfo.out_color_space == JCS_RGB) {
+        converter = jpeg_get_converter(format);
+        g_return_if_fail(converter != NULL);
+    }
 
     jpeg_start_decompress(&d->_cinfo);
 
-    for (row = 0; row < d->_height; row++) {
-        jpeg_read_scanlines(&d->_cinfo, &scan_line, 1);
-        converter(scan_line, dest, d->_width);
-        dest += stride;
+    /* read as many rows at once as the decoder produces per iMCU row */
+    lines = MAX(d->_cinfo.rec_outbuf_height, 1);
+    rows = g_alloca(lines * sizeof(JSAMPROW));
+    if (converter != NULL) {
+        gsize size = (gsize)d->_width * 3 * lines;
+
+        if (d->_scan_lines_size < size) {
+            g_free(d->_scan_lines);
+            d->_scan_lines = g_malloc(size);
+            d->_scan_lines_size = size;
+        }
+        for (i = 0; i < lines; i++)
+            rows[i] = d->_scan_lines + i * d->_width * 3;
+    }
+
+    while (d->_cinfo.output_scanline < d->_cinfo.output_height) {
+        int n;
+
+        if (converter == NULL) {
+            for (i = 0; i < lines; i++)
+                rows[i] = dest + i * stride;
+        }
+
+        n = jpeg_read_scanlines(&d->_cinfo, rows,
+                                MIN(lines, d->_cinfo.output_height - d->_cinfo.output_scanline));
+        if (n == 0)
+            break;
+
+        if (converter != NULL) {
+            for (i = 0; i < n; i++)
+                converter(rows[i], dest + i * stride, d->_width);
+        }
+        dest += n * stride;
     }
 
     jpeg_finish_decompress(&d->_cinfo);
@@ -187,5 +348,6 @@ void jpeg_decoder_destroy(SpiceJpegDecoder *decoder)
     GlibJpegDecoder *d = SPICE_CONTAINEROF(decoder, GlibJpegDecoder, base);
 
     jpeg_destroy_decompress(&d->_cinfo);
+    g_free(d->_scan_lines);
     free(d);
 }
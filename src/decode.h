@@ -29,6 +29,7 @@ typedef struct SpiceGlzDecoderWindow SpiceGlzDecoderWindow;
 SpiceGlzDecoderWindow *glz_decoder_window_new(void);
 void glz_decoder_window_clear(SpiceGlzDecoderWindow *w);
 void glz_decoder_window_destroy(SpiceGlzDecoderWindow *w);
+gsize glz_decoder_window_get_bytes(SpiceGlzDecoderWindow *w);
 
 SpiceGlzDecoder *glz_decoder_new(SpiceGlzDecoderWindow *w);
 void glz_decoder_destroy(SpiceGlzDecoder *d);
@@ -39,6 +40,11 @@ void zlib_decoder_destroy(SpiceZlibDecoder *d);
 SpiceJpegDecoder *jpeg_decoder_new(void);
 void jpeg_decoder_destroy(SpiceJpegDecoder *d);
 
+/* RGB to BGR or BGRX, for the given SPICE_BITMAP_FMT, using the
+ * fastest implementation the CPU supports */
+typedef void (*SpiceRgbConverter)(uint8_t *src, uint8_t *dest, int width);
+SpiceRgbConverter jpeg_get_converter(int format);
+
 G_END_DECLS
 
 #endif // SPICEGTK_DECODE_H_
@@ -71,10 +71,30 @@ GIOCondition g_coroutine_socket_wait(GCoroutine *self,
     return val;
 }
 
+struct _GCoroutineWaiter
+{
+    GCoroutineWaitQueue *queue;
+    GCoroutine *self;
+    guint64 key;
+};
+
+struct _GCoroutineWaitQueue
+{
+    /* GCoroutineWaiter, on the stack of the waiting coroutines */
+    GList *waiters;
+};
+
 void g_coroutine_condition_cancel(GCoroutine *coroutine)
 {
     g_return_if_fail(coroutine != NULL);
 
+    if (coroutine->waiter != NULL) {
+        GCoroutineWaitQueue *queue = coroutine->waiter->queue;
+
+        queue->waiters = g_list_remove(queue->waiters, coroutine->waiter);
+        coroutine->waiter = NULL;
+    }
+
     if (coroutine->condition_id == 0)
         return;
 
@@ -124,6 +144,12 @@ GSourceFuncs waitFuncs = {
     .dispatch = g_condition_wait_dispatch,
 };
 
+static void g_coroutine_before_wait(GCoroutine *self)
+{
+    if (self->before_wait != NULL)
+        self->before_wait(self->before_wait_data);
+}
+
 static gboolean g_condition_wait_helper(gpointer data)
 {
     GCoroutine *self = (GCoroutine *)data;
@@ -169,6 +195,7 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     vsrc->data = data;
     vsrc->self = self;
 
+    g_coroutine_before_wait(self);
     self->condition_id = g_source_attach(src, NULL);
     g_source_set_callback(src, g_condition_wait_helper, self, NULL);
     coroutine_yield(NULL);
@@ -182,6 +209,112 @@ gboolean g_coroutine_condition_wait(GCoroutine *self, GConditionWaitFunc func, g
     return TRUE;
 }
 
+GCoroutineWaitQueue *g_coroutine_wait_queue_new(void)
+{
+    return g_new0(GCoroutineWaitQueue, 1);
+}
+
+void g_coroutine_wait_queue_free(GCoroutineWaitQueue *queue)
+{
+    GList *l;
+
+    if (queue == NULL)
+        return;
+
+    /* the waiters are left blocked, as with a cancelled condition */
+    for (l = queue->waiters; l != NULL; l = l->next) {
+        GCoroutineWaiter *waiter = l->data;
+        waiter->self->waiter = NULL;
+    }
+    g_list_free(queue->waiters);
+    g_free(queue);
+}
+
+/*
+ * g_coroutine_wait_queue_wait:
+ * @queue: the wait queue
+ * @coroutine: the coroutine to wait on
+ * @key: what to wait for
+ * @func: the condition callback
+ * @data: the user data passed to @func callback
+ *
+ * This function will wait on caller coroutine until @func returns %TRUE.
+ *
+ * @func is called once, and then each time @key is woken up with
+ * g_coroutine_wait_queue_wake().
+ *
+ * The wait can be cancelled by calling g_coroutine_condition_cancel()
+ *
+ * Returns: %TRUE if condition reached, %FALSE if not and cancelled
+ */
+gboolean g_coroutine_wait_queue_wait(GCoroutineWaitQueue *queue, GCoroutine *self,
+                                     guint64 key, GConditionWaitFunc func, gpointer data)
+{
+    GCoroutineWaiter waiter = {
+        .queue = queue,
+        .self = self,
+        .key = key,
+    };
+
+    g_return_val_if_fail(queue != NULL, FALSE);
+    g_return_val_if_fail(self != NULL, FALSE);
+    g_return_val_if_fail(self->condition_id == 0, FALSE);
+    g_return_val_if_fail(self->waiter == NULL, FALSE);
+    g_return_val_if_fail(func != NULL, FALSE);
+
+    if (func(data))
+        return TRUE;
+
+    g_coroutine_before_wait(self);
+    do {
+        queue->waiters = g_list_prepend(queue->waiters, &waiter);
+        self->waiter = &waiter;
+        coroutine_yield(NULL);
+
+        /* it got woked up / cancelled? */
+        if (self->condition_id == 0)
+            return func(data);
+
+        self->condition_id = 0;
+    } while (!func(data));
+
+    return TRUE;
+}
+
+/*
+ * g_coroutine_wait_queue_wake:
+ * @queue: the wait queue
+ * @key: what happened
+ *
+ * Resume the coroutines waiting for @key from the main loop, so that
+ * they check their condition again.
+ *
+ * Returns: the number of coroutines woken up
+ */
+guint g_coroutine_wait_queue_wake(GCoroutineWaitQueue *queue, guint64 key)
+{
+    GList *l, *next;
+    guint n = 0;
+
+    g_return_val_if_fail(queue != NULL, 0);
+
+    for (l = queue->waiters; l != NULL; l = next) {
+        GCoroutineWaiter *waiter = l->data;
+
+        next = l->next;
+        if (waiter->key != key)
+            continue;
+
+        queue->waiters = g_list_delete_link(queue->waiters, l);
+        waiter->self->waiter = NULL;
+        waiter->self->condition_id =
+            g_idle_add_full(G_PRIORITY_DEFAULT, g_condition_wait_helper, waiter->self, NULL);
+        n++;
+    }
+
+    return n;
+}
+
 struct signal_data
 {
     gpointer instance;
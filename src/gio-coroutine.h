@@ -27,12 +27,18 @@
 G_BEGIN_DECLS
 
 typedef struct _GCoroutine GCoroutine;
+typedef struct _GCoroutineWaiter GCoroutineWaiter;
+typedef struct _GCoroutineWaitQueue GCoroutineWaitQueue;
 
 struct _GCoroutine
 {
     struct coroutine coroutine;
     guint wait_id;
     guint condition_id;
+    GCoroutineWaiter *waiter;
+    /* called before yielding to wait for a condition, optional */
+    void (*before_wait)(gpointer data);
+    gpointer before_wait_data;
 };
 
 /*
@@ -56,6 +62,18 @@ gboolean     g_coroutine_condition_wait (GCoroutine *coroutine,
                                          GConditionWaitFunc func, gpointer data);
 void         g_coroutine_condition_cancel(GCoroutine *coroutine);
 
+/*
+ * A set of coroutines waiting for some keyed event, such as an image
+ * being added to a cache. Unlike g_coroutine_condition_wait(), the
+ * condition is only checked again once the key is woken up.
+ */
+GCoroutineWaitQueue* g_coroutine_wait_queue_new (void);
+void         g_coroutine_wait_queue_free (GCoroutineWaitQueue *queue);
+gboolean     g_coroutine_wait_queue_wait (GCoroutineWaitQueue *queue,
+                                          GCoroutine *coroutine, guint64 key,
+                                          GConditionWaitFunc func, gpointer data);
+guint        g_coroutine_wait_queue_wake (GCoroutineWaitQueue *queue, guint64 key);
+
 void         g_coroutine_signal_emit (gpointer instance, guint signal_id,
                                       GQuark detail, ...);
 
@@ -49,6 +49,7 @@ static inline gboolean gtk_widget_get_realized(GtkWidget *widget)
 #define cairo_region_create_rectangle gdk_region_rectangle
 #define cairo_region_subtract_rectangle(_dest,_rect) { GdkRegion *_region = gdk_region_rectangle (_rect); gdk_region_subtract (_dest, _region); gdk_region_destroy (_region); }
 #define cairo_region_destroy gdk_region_destroy
+#define cairo_region_union_rectangle gdk_region_union_with_rect
 
 #define gdk_window_get_display(W) gdk_drawable_get_display(GDK_DRAWABLE(W))
 #endif
@@ -0,0 +1,300 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include "config.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib/gstdio.h>
+#ifdef G_OS_WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-capture.h"
+
+#define CAPTURE_MAGIC "SPICECAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE (8 + 4)
+#define RECORD_HEADER_SIZE 22
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+struct SpiceCapture {
+    FILE *file;
+    gint64 start;
+};
+
+struct SpiceCaptureReader {
+    GMappedFile *file;
+    const guint8 *pos;
+    const guint8 *end;
+};
+
+static guint8 *put_16(guint8 *p, guint16 word)
+{
+    word = GUINT16_TO_LE(word);
+    memcpy(p, &word, sizeof(word));
+    return p + sizeof(word);
+}
+
+static guint8 *put_32(guint8 *p, guint32 word)
+{
+    word = GUINT32_TO_LE(word);
+    memcpy(p, &word, sizeof(word));
+    return p + sizeof(word);
+}
+
+static guint8 *put_64(guint8 *p, guint64 word)
+{
+    word = GUINT64_TO_LE(word);
+    memcpy(p, &word, sizeof(word));
+    return p + sizeof(word);
+}
+
+static guint16 get_16(const guint8 *p)
+{
+    guint16 word;
+
+    memcpy(&word, p, sizeof(word));
+    return GUINT16_FROM_LE(word);
+}
+
+static guint32 get_32(const guint8 *p)
+{
+    guint32 word;
+
+    memcpy(&word, p, sizeof(word));
+    return GUINT32_FROM_LE(word);
+}
+
+static guint64 get_64(const guint8 *p)
+{
+    guint64 word;
+
+    memcpy(&word, p, sizeof(word));
+    return GUINT64_FROM_LE(word);
+}
+
+static SpiceCapture *capture_exit_capture;
+
+/* the records still buffered would be lost on exit */
+static void capture_exit(void)
+{
+    SpiceCapture *capture = capture_exit_capture;
+
+    if (capture->file != NULL) {
+        fclose(capture->file);
+        capture->file = NULL;
+    }
+}
+
+static gpointer capture_open(gpointer data)
+{
+    const gchar *filename = g_getenv("SPICE_CAPTURE");
+    guint8 header[CAPTURE_HEADER_SIZE];
+    SpiceCapture *capture;
+    FILE *file;
+    int fd;
+
+    if (filename == NULL || *filename == '\0')
+        return NULL;
+
+    /* only readable by the user, it holds what the password and keys
+     * protect on the wire */
+    fd = g_open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_BINARY, 0600);
+    if (fd < 0) {
+        g_warning("failed to open capture file %s: %s", filename, g_strerror(errno));
+        return NULL;
+    }
+    file = fdopen(fd, "wb");
+    if (file == NULL) {
+        g_warning("failed to open capture file %s: %s", filename, g_strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    /* the records are small, don't write them one by one */
+    setvbuf(file, NULL, _IOFBF, 256 * 1024);
+
+    memcpy(header, CAPTURE_MAGIC, 8);
+    put_32(header + 8, CAPTURE_VERSION);
+    fwrite(header, 1, sizeof(header), file);
+
+    capture = g_new0(SpiceCapture, 1);
+    capture->file = file;
+    capture->start = g_get_monotonic_time();
+    capture_exit_capture = capture;
+    atexit(capture_exit);
+    g_message("capturing the channels traffic in %s, including keystrokes, "
+              "clipboard and file transfers", filename);
+
+    return capture;
+}
+
+/**
+ * spice_capture_get:
+ *
+ * Returns: the process wide capture, or %NULL if SPICE_CAPTURE isn't set
+ **/
+G_GNUC_INTERNAL
+SpiceCapture *spice_capture_get(void)
+{
+    static GOnce capture_once = G_ONCE_INIT;
+
+    return g_once(&capture_once, capture_open, NULL);
+}
+
+/**
+ * spice_capture_write:
+ * @capture: a #SpiceCapture
+ * @record: the record header, its time is set by the capture
+ * @vectors: the message
+ * @n_vectors: the number of @vectors
+ * @skip: how many bytes of @vectors to skip, the message header
+ *
+ * Writes a record for a message of @record->size bytes.
+ **/
+/* coroutine context */
+G_GNUC_INTERNAL
+void spice_capture_write(SpiceCapture *capture, const SpiceCaptureRecord *record,
+                         const GOutputVector *vectors, guint n_vectors, gsize skip)
+{
+    guint8 header[RECORD_HEADER_SIZE], *p = header;
+    guint i;
+
+    if (capture->file == NULL)
+        return;
+
+    p = put_64(p, g_get_monotonic_time() - capture->start);
+    *p++ = record->channel_type;
+    *p++ = record->channel_id;
+    *p++ = record->direction;
+    p = put_16(p, record->msg_type);
+    p = put_32(p, record->sub_list);
+    p = put_32(p, record->size);
+    *p = 0; /* reserved */
+    fwrite(header, 1, sizeof(header), capture->file);
+
+    for (i = 0; i < n_vectors; i++) {
+        const guint8 *data = vectors[i].buffer;
+        gsize size = vectors[i].size;
+
+        if (skip >= size) {
+            skip -= size;
+            continue;
+        }
+        fwrite(data + skip, 1, size - skip, capture->file);
+        skip = 0;
+    }
+
+    if (ferror(capture->file)) {
+        g_warning("failed to write the capture, stopping it");
+        fclose(capture->file);
+        capture->file = NULL;
+    }
+}
+
+G_GNUC_INTERNAL
+void spice_capture_flush(SpiceCapture *capture)
+{
+    if (capture->file != NULL)
+        fflush(capture->file);
+}
+
+G_GNUC_INTERNAL
+SpiceCaptureReader *spice_capture_reader_new(const gchar *filename, GError **error)
+{
+    SpiceCaptureReader *reader;
+    GMappedFile *file;
+    const guint8 *data;
+    gsize size;
+
+    file = g_mapped_file_new(filename, FALSE, error);
+    if (file == NULL)
+        return NULL;
+
+    data = (const guint8 *)g_mapped_file_get_contents(file);
+    size = g_mapped_file_get_length(file);
+    if (size < CAPTURE_HEADER_SIZE ||
+        memcmp(data, CAPTURE_MAGIC, 8) != 0 ||
+        get_32(data + 8) != CAPTURE_VERSION) {
+        g_set_error(error, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
+                    "%s is not a spice capture", filename);
+        g_mapped_file_unref(file);
+        return NULL;
+    }
+
+    reader = g_new0(SpiceCaptureReader, 1);
+    reader->file = file;
+    reader->pos = data + CAPTURE_HEADER_SIZE;
+    reader->end = data + size;
+
+    return reader;
+}
+
+/**
+ * spice_capture_reader_next:
+ * @reader: a #SpiceCaptureReader
+ * @record: the next record, its data points in the capture
+ *
+ * Returns: %FALSE at the end of the capture
+ **/
+G_GNUC_INTERNAL
+gboolean spice_capture_reader_next(SpiceCaptureReader *reader, SpiceCaptureRecord *record)
+{
+    const guint8 *p = reader->pos;
+
+    if (reader->end - p < RECORD_HEADER_SIZE)
+        return FALSE;
+
+    record->time = get_64(p);
+    record->channel_type = p[8];
+    record->channel_id = p[9];
+    record->direction = p[10];
+    record->msg_type = get_16(p + 11);
+    record->sub_list = get_32(p + 13);
+    record->size = get_32(p + 17);
+    record->data = p + RECORD_HEADER_SIZE;
+
+    /* a capture cut short, by a crash for instance */
+    if (record->size > reader->end - record->data) {
+        g_warning("truncated capture record");
+        reader->pos = reader->end;
+        return FALSE;
+    }
+
+    reader->pos = record->data + record->size;
+    return TRUE;
+}
+
+G_GNUC_INTERNAL
+void spice_capture_reader_free(SpiceCaptureReader *reader)
+{
+    g_mapped_file_unref(reader->file);
+    g_free(reader);
+}
@@ -0,0 +1,71 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2015 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef __SPICE_CAPTURE_H__
+#define __SPICE_CAPTURE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+/*
+ * Wire capture, enabled by setting SPICE_CAPTURE to a file name: the
+ * messages of all the channels, as they are received and sent.
+ *
+ * The file starts with the "SPICECAP" magic and a 32 bits version,
+ * then has a record per message: a 22 bytes header (time, channel
+ * type and id, direction, message type, sub-message list offset and
+ * size, all little endian) followed by the message body.
+ *
+ * The capture holds everything the session carries in clear once the
+ * channels are linked: keystrokes, clipboard contents, transferred
+ * files, the display. It is created only readable by the user, and
+ * should be handled as a secret.
+ */
+
+typedef enum {
+    SPICE_CAPTURE_RECV, /* a message from the server */
+    SPICE_CAPTURE_SEND, /* a message to the server */
+    SPICE_CAPTURE_LINK, /* the link reply: minor version, common caps, caps */
+} SpiceCaptureDirection;
+
+typedef struct {
+    gint64 time; /* us since the capture started */
+    guint8 channel_type;
+    guint8 channel_id;
+    guint8 direction;
+    guint16 msg_type;
+    guint32 sub_list;
+    guint32 size;
+    const guint8 *data;
+} SpiceCaptureRecord;
+
+typedef struct SpiceCapture SpiceCapture;
+typedef struct SpiceCaptureReader SpiceCaptureReader;
+
+SpiceCapture *spice_capture_get(void);
+void spice_capture_write(SpiceCapture *capture, const SpiceCaptureRecord *record,
+                         const GOutputVector *vectors, guint n_vectors, gsize skip);
+void spice_capture_flush(SpiceCapture *capture);
+
+SpiceCaptureReader *spice_capture_reader_new(const gchar *filename, GError **error);
+gboolean spice_capture_reader_next(SpiceCaptureReader *reader, SpiceCaptureRecord *record);
+void spice_capture_reader_free(SpiceCaptureReader *reader);
+
+G_END_DECLS
+
+#endif /* __SPICE_CAPTURE_H__ */
@@ -19,86 +19,304 @@
 # define SPICE_CHANNEL_CACHE_H_
 
 #include <inttypes.h> /* For PRIx64 */
+#include <string.h>
 #include "common/mem.h"
 #include "common/ring.h"
 
 G_BEGIN_DECLS
 
+/* An open addressing hash table with linear probing, the items being
+ * stored inline. The used items are also linked in least recently
+ * used order, by index, so that the oldest can be evicted when the
+ * values size exceeds max_bytes.
+ *
+ * Evicted items are kept as tombstones until the server removes them,
+ * since it still believes the client has them. */
+
+enum {
+    CACHE_SLOT_EMPTY,
+    CACHE_SLOT_USED,
+    CACHE_SLOT_DELETED,
+    CACHE_SLOT_EVICTED,
+};
+
+#define CACHE_NONE ((guint32)-1)
+#define CACHE_MIN_CAPACITY 64
+
+typedef gsize (*display_cache_size_func)(gpointer value);
+
 typedef struct display_cache_item {
     guint64                     id;
-    gboolean                    lossy;
+    gpointer                    value;
+    gsize                       size;
     guint32                     ref_count;
+    guint32                     lru_prev, lru_next; /* towards head, tail */
+    guint8                      state;
+    gboolean                    lossy;
 } display_cache_item;
 
+typedef struct display_cache_stats {
+    guint64                     hits;
+    guint64                     misses;
+    guint64                     evictions;
+    gsize                       bytes;
+    guint                       items;
+} display_cache_stats;
+
 typedef struct display_cache {
-    GHashTable  *table;
-    gboolean    ref_counted;
-}display_cache;
+    display_cache_item          *items;
+    guint32                     capacity; /* a power of 2 */
+    guint32                     filled; /* not empty slots */
+    guint32                     evicted;
+    guint32                     lru_head, lru_tail; /* most, least recent */
+    gboolean                    ref_counted;
+    GDestroyNotify              value_destroy;
+    display_cache_size_func     value_size;
+    gsize                       max_bytes; /* 0 for no limit */
+    display_cache_stats         stats;
+} display_cache;
 
-static inline display_cache_item* cache_item_new(guint64 id, gboolean lossy)
+static inline guint32 cache_hash(display_cache *cache, guint64 id)
 {
-    display_cache_item *self = g_slice_new(display_cache_item);
-    self->id = id;
-    self->lossy = lossy;
-    self->ref_count = 1;
-    return self;
+    id *= G_GUINT64_CONSTANT(0x9e3779b97f4a7c15);
+    return (guint32)(id >> 32) & (cache->capacity - 1);
+}
+
+/* returns the slot of the used or evicted item with this id */
+static inline guint32 cache_lookup(display_cache *cache, guint64 id)
+{
+    guint32 i = cache_hash(cache, id);
+
+    for (;;) {
+        display_cache_item *item = &cache->items[i];
+
+        if (item->state == CACHE_SLOT_EMPTY)
+            return CACHE_NONE;
+        if (item->id == id &&
+            (item->state == CACHE_SLOT_USED || item->state == CACHE_SLOT_EVICTED))
+            return i;
+        i = (i + 1) & (cache->capacity - 1);
+    }
 }
 
-static inline void cache_item_free(display_cache_item *self)
+static inline void cache_lru_unlink(display_cache *cache, guint32 i)
 {
-    g_slice_free(display_cache_item, self);
+    display_cache_item *item = &cache->items[i];
+
+    if (item->lru_prev != CACHE_NONE)
+        cache->items[item->lru_prev].lru_next = item->lru_next;
+    else
+        cache->lru_head = item->lru_next;
+    if (item->lru_next != CACHE_NONE)
+        cache->items[item->lru_next].lru_prev = item->lru_prev;
+    else
+        cache->lru_tail = item->lru_prev;
+}
+
+static inline void cache_lru_push(display_cache *cache, guint32 i)
+{
+    display_cache_item *item = &cache->items[i];
+
+    item->lru_prev = CACHE_NONE;
+    item->lru_next = cache->lru_head;
+    if (cache->lru_head != CACHE_NONE)
+        cache->items[cache->lru_head].lru_prev = i;
+    else
+        cache->lru_tail = i;
+    cache->lru_head = i;
+}
+
+/* returns the slot for a new item, which must not be in the table */
+static inline guint32 cache_find_free_slot(display_cache *cache, guint64 id)
+{
+    guint32 i = cache_hash(cache, id);
+
+    while (cache->items[i].state == CACHE_SLOT_USED ||
+           cache->items[i].state == CACHE_SLOT_EVICTED)
+        i = (i + 1) & (cache->capacity - 1);
+
+    return i;
+}
+
+static inline void cache_resize(display_cache *cache, guint32 capacity)
+{
+    display_cache_item *old = cache->items;
+    guint32 old_capacity = cache->capacity;
+    guint32 old_lru_tail = cache->lru_tail;
+    guint32 i, j;
+
+    cache->items = g_new0(display_cache_item, capacity);
+    cache->capacity = capacity;
+    cache->filled = 0;
+    cache->lru_head = cache->lru_tail = CACHE_NONE;
+    if (old == NULL)
+        return;
+
+    /* from the least recently used, to keep the order */
+    for (i = old_lru_tail; i != CACHE_NONE; i = old[i].lru_prev) {
+        j = cache_find_free_slot(cache, old[i].id);
+        cache->items[j] = old[i];
+        cache->filled++;
+        cache_lru_push(cache, j);
+    }
+    for (i = 0; i < old_capacity; i++) {
+        if (old[i].state == CACHE_SLOT_EVICTED) {
+            j = cache_find_free_slot(cache, old[i].id);
+            cache->items[j] = old[i];
+            cache->filled++;
+        }
+    }
+    g_free(old);
+}
+
+static inline void cache_maybe_grow(display_cache *cache)
+{
+    /* keep the load under 3/4, deleted slots included */
+    if ((cache->filled + 1) * 4 <= cache->capacity * 3)
+        return;
+
+    if ((cache->stats.items + cache->evicted + 1) * 2 > cache->capacity)
+        cache_resize(cache, cache->capacity * 2);
+    else
+        cache_resize(cache, cache->capacity); /* drop the deleted slots */
+}
+
+static inline void cache_drop_value(display_cache *cache, guint32 i, guint8 state)
+{
+    display_cache_item *item = &cache->items[i];
+
+    cache_lru_unlink(cache, i);
+    cache->stats.bytes -= item->size;
+    cache->stats.items--;
+    if (cache->value_destroy)
+        cache->value_destroy(item->value);
+    item->value = NULL;
+    item->size = 0;
+    item->state = state;
+}
+
+static inline void cache_evict(display_cache *cache, guint32 keep)
+{
+    while (cache->max_bytes != 0 && cache->stats.bytes > cache->max_bytes &&
+           cache->lru_tail != CACHE_NONE && cache->lru_tail != keep) {
+        SPICE_DEBUG("cache %p: evicting %" PRIx64 ", over %" G_GSIZE_FORMAT " bytes",
+                    cache, cache->items[cache->lru_tail].id, cache->max_bytes);
+        cache_drop_value(cache, cache->lru_tail, CACHE_SLOT_EVICTED);
+        cache->stats.evictions++;
+        cache->evicted++;
+    }
 }
 
 static inline display_cache* cache_new(GDestroyNotify value_destroy)
 {
-    display_cache * self = g_slice_new(display_cache);
-    self->table = g_hash_table_new_full(g_int64_hash, g_int64_equal,
-                                       (GDestroyNotify) cache_item_free,
-                                       value_destroy);
+    display_cache * self = g_slice_new0(display_cache);
+    self->value_destroy = value_destroy;
+    cache_resize(self, CACHE_MIN_CAPACITY);
     self->ref_counted = FALSE;
     return self;
 }
 
-static inline display_cache * cache_image_new(GDestroyNotify value_destroy)
+static inline display_cache * cache_image_new(GDestroyNotify value_destroy,
+                                              display_cache_size_func value_size)
 {
     display_cache * self = cache_new(value_destroy);
     self->ref_counted = TRUE;
+    self->value_size = value_size;
     return self;
 };
 
-static inline gpointer cache_find(display_cache *cache, uint64_t id)
+static inline void cache_set_max_bytes(display_cache *cache, gsize max_bytes)
+{
+    cache->max_bytes = max_bytes;
+    cache_evict(cache, CACHE_NONE);
+}
+
+static inline void cache_get_stats(display_cache *cache, display_cache_stats *stats)
 {
-    return g_hash_table_lookup(cache->table, &id);
+    *stats = cache->stats;
+}
+
+/* whether the value was dropped to stay under max_bytes, and is still
+ * expected to be in the cache by the server */
+static inline gboolean cache_is_evicted(display_cache *cache, uint64_t id)
+{
+    guint32 i = cache_lookup(cache, id);
+
+    return i != CACHE_NONE && cache->items[i].state == CACHE_SLOT_EVICTED;
+}
+
+/* a lookup that isn't a use of the value, for polling */
+static inline gpointer cache_peek_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
+{
+    guint32 i = cache_lookup(cache, id);
+
+    if (i == CACHE_NONE || cache->items[i].state != CACHE_SLOT_USED)
+        return NULL;
+
+    *lossy = cache->items[i].lossy;
+
+    return cache->items[i].value;
 }
 
 static inline gpointer cache_find_lossy(display_cache *cache, uint64_t id, gboolean *lossy)
 {
-    gpointer value;
-    display_cache_item *item;
+    guint32 i = cache_lookup(cache, id);
 
-    if (!g_hash_table_lookup_extended(cache->table, &id, (gpointer*)&item, &value))
+    if (i == CACHE_NONE || cache->items[i].state != CACHE_SLOT_USED) {
+        cache->stats.misses++;
         return NULL;
+    }
+
+    cache->stats.hits++;
+    cache_lru_unlink(cache, i);
+    cache_lru_push(cache, i);
+    *lossy = cache->items[i].lossy;
 
-    *lossy = item->lossy;
+    return cache->items[i].value;
+}
 
-    return value;
+static inline gpointer cache_find(display_cache *cache, uint64_t id)
+{
+    gboolean lossy;
+
+    return cache_find_lossy(cache, id, &lossy);
 }
 
 static inline void cache_add_lossy(display_cache *cache, uint64_t id,
                                    gpointer value, gboolean lossy)
 {
-    display_cache_item *item = cache_item_new(id, lossy);
-    display_cache_item *current_item;
-    gpointer            current_image;
+    display_cache_item *item;
+    guint32 ref_count = 1;
+    guint32 i;
 
-    //If image is currently in the table add its reference count before replacing it
-    if(cache->ref_counted) {
-        if(g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &current_item,
-                                        (gpointer*) &current_image)) {
-            item->ref_count = current_item->ref_count + 1;
-        }
+    i = cache_lookup(cache, id);
+    if (i != CACHE_NONE && cache->items[i].state == CACHE_SLOT_USED) {
+        //If image is currently in the table add its reference count before replacing it
+        if (cache->ref_counted)
+            ref_count = cache->items[i].ref_count + 1;
+        cache_drop_value(cache, i, CACHE_SLOT_DELETED);
+    } else if (i != CACHE_NONE) {
+        /* sent again after it was evicted */
+        cache->evicted--;
+    } else {
+        cache_maybe_grow(cache);
+        i = cache_find_free_slot(cache, id);
+        if (cache->items[i].state == CACHE_SLOT_EMPTY)
+            cache->filled++;
     }
-    g_hash_table_replace(cache->table, item, value);
+
+    item = &cache->items[i];
+    item->id = id;
+    item->value = value;
+    item->size = cache->value_size ? cache->value_size(value) : 0;
+    item->ref_count = ref_count;
+    item->lossy = lossy;
+    item->state = CACHE_SLOT_USED;
+    cache_lru_push(cache, i);
+    cache->stats.bytes += item->size;
+    cache->stats.items++;
+
+    cache_evict(cache, i);
 }
 
 static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
@@ -108,29 +326,39 @@ static inline void cache_add(display_cache *cache, uint64_t id, gpointer value)
 
 static inline gboolean cache_remove(display_cache *cache, uint64_t id)
 {
-    display_cache_item * item;
-    gpointer value;
+    guint32 i = cache_lookup(cache, id);
+    display_cache_item *item;
 
-    if( g_hash_table_lookup_extended(cache->table, &id, (gpointer*) &item, &value)) {
-        --item->ref_count;
-        if(!cache->ref_counted || item->ref_count == 0 ) {
-            return g_hash_table_remove(cache->table, &id);
-        }
-    }
-    else {
+    if (i == CACHE_NONE)
         return FALSE;
+
+    item = &cache->items[i];
+    if (item->state == CACHE_SLOT_EVICTED) {
+        item->state = CACHE_SLOT_DELETED;
+        cache->evicted--;
+        return TRUE;
     }
+
+    --item->ref_count;
+    if (!cache->ref_counted || item->ref_count == 0)
+        cache_drop_value(cache, i, CACHE_SLOT_DELETED);
+
     return TRUE;
 }
 
 static inline void cache_clear(display_cache *cache)
 {
-    g_hash_table_remove_all(cache->table);
+    while (cache->lru_head != CACHE_NONE)
+        cache_drop_value(cache, cache->lru_head, CACHE_SLOT_DELETED);
+    memset(cache->items, 0, cache->capacity * sizeof(display_cache_item));
+    cache->filled = 0;
+    cache->evicted = 0;
 }
 
 static inline void cache_free(display_cache *cache)
 {
-    g_hash_table_unref(cache->table);
+    cache_clear(cache);
+    g_free(cache->items);
     g_slice_free(display_cache, cache);
 }
 
@@ -31,6 +31,7 @@
 #include "spice-util-priv.h"
 #include "coroutine.h"
 #include "gio-coroutine.h"
+#include "spice-capture.h"
 
 #include "common/client_marshallers.h"
 #include "common/client_demarshallers.h"
@@ -40,9 +41,23 @@ G_BEGIN_DECLS
 
 #define MAX_SPICE_DATA_HEADER_SIZE sizeof(SpiceDataHeader)
 
+/* size of the per-channel buffer the socket is drained into */
+#define SPICE_CHANNEL_RECV_BUF_SIZE (64 * 1024)
+/* small writes are packed up to one TLS record before being sent */
+#define SPICE_CHANNEL_XMIT_BUF_SIZE (16 * 1024)
+
 #define CHANNEL_DEBUG(channel, fmt, ...) \
     SPICE_DEBUG("%s: " fmt, SPICE_CHANNEL(channel)->priv->name, ## __VA_ARGS__)
 
+/* outgoing messages are sent from the highest priority lane first */
+typedef enum {
+    SPICE_MSG_OUT_PRIORITY_HIGH = 0,    /* inputs, acks, pongs... */
+    SPICE_MSG_OUT_PRIORITY_NORMAL,
+    SPICE_MSG_OUT_PRIORITY_BULK,        /* agent data, usbredir, webdav */
+
+    SPICE_MSG_OUT_N_PRIORITIES
+} SpiceMsgOutPriority;
+
 struct _SpiceMsgOut {
     int                   refcount;
     SpiceChannel          *channel;
@@ -50,8 +65,27 @@ struct _SpiceMsgOut {
     SpiceMarshaller       *marshaller;
     uint8_t               *header;
     gboolean              ro_check;
+    SpiceMsgOutPriority   priority;
+    gint64                queued; /* monotonic, when given to spice_msg_out_send() */
+    /* called once written to the socket, in coroutine context */
+    void                  (*written)(SpiceMsgOut *out, gpointer user_data);
+    gpointer              written_data;
+#ifdef G_OS_WIN32
+    uint8_t               *linear;
+#endif
 };
 
+typedef struct _SpiceMsgInPool SpiceMsgInPool;
+
+/* the traffic of a message type, see spice_channel_get_stats() */
+typedef struct {
+    guint64 messages;
+    guint64 bytes;
+    guint64 parse_time; /* us, received messages */
+    guint64 handler_time; /* us, received messages */
+    guint64 queue_wait; /* us, sent messages */
+} SpiceMsgStats;
+
 struct _SpiceMsgIn {
     int                   refcount;
     SpiceChannel          *channel;
@@ -62,8 +96,28 @@ struct _SpiceMsgIn {
     size_t                psize;
     message_destructor_t  pfree;
     SpiceMsgIn            *parent;
+    SpiceMsgInPool        *pool;
+    int                   pool_class;
 };
 
+typedef struct _SpiceXmitQueue {
+    GQueue                lanes[SPICE_MSG_OUT_N_PRIORITIES];
+    guint64               sizes[SPICE_MSG_OUT_N_PRIORITIES];
+} SpiceXmitQueue;
+
+/* connection phases, in order */
+typedef enum {
+    SPICE_CHANNEL_TIME_START = 0,
+    SPICE_CHANNEL_TIME_RESOLVED,
+    SPICE_CHANNEL_TIME_CONNECTED,
+    SPICE_CHANNEL_TIME_TLS,
+    SPICE_CHANNEL_TIME_LINKED,
+    SPICE_CHANNEL_TIME_AUTHENTICATED,
+    SPICE_CHANNEL_TIME_FIRST_MESSAGE,
+
+    SPICE_CHANNEL_TIME_LAST
+} SpiceChannelTime;
+
 enum spice_channel_state {
     SPICE_CHANNEL_STATE_UNCONNECTED = 0,
     SPICE_CHANNEL_STATE_RECONNECTING,
@@ -88,6 +142,9 @@ struct _SpiceChannelPrivate {
     GSocketConnection           *conn;
     GInputStream                *in;
     GOutputStream               *out;
+    guint8                      *recv_buf;
+    gsize                       recv_buf_pos;
+    gsize                       recv_buf_len;
 
 #if HAVE_SASL
     sasl_conn_t                 *sasl_conn;
@@ -107,11 +164,12 @@ struct _SpiceChannelPrivate {
     gboolean                    has_error;
     guint                       connect_delayed_id;
 
-    GQueue                      xmit_queue;
+    SpiceXmitQueue              xmit_queue;
     gboolean                    xmit_queue_blocked;
     STATIC_MUTEX                xmit_queue_lock;
     guint                       xmit_queue_wakeup_id;
-    guint64                     xmit_queue_size;
+    GArray                      *xmit_vecs;
+    guint8                      *xmit_buf;
 
     char                        name[16];
     enum spice_channel_state    state;
@@ -121,6 +179,8 @@ struct _SpiceChannelPrivate {
     SpiceMessageMarshallers     *marshallers;
     guint                       channel_watch;
     int                         tls;
+    gint64                      tls_handshake_time; /* in us */
+    gint64                      connect_times[SPICE_CHANNEL_TIME_LAST]; /* monotonic */
 
     int                         channel_id;
     int                         channel_type;
@@ -132,6 +192,17 @@ struct _SpiceChannelPrivate {
 
     int                         message_ack_window;
     int                         message_ack_count;
+    guint64                     ack_msgs; /* received since the window was set */
+    guint64                     acks_sent; /* since the window was set */
+    guint                       acks_pending; /* due, held back to be sent together */
+    guint64                     acks_coalesced;
+    gboolean                    acks_early; /* sent as soon as due, the server waits for them */
+    guint                       window_limited; /* 0 to 256, how much the server waited lately */
+    guint64                     rtt_msg; /* the message that can't leave before the timed ack */
+    gint64                      rtt_ack_time;
+    gboolean                    read_waited; /* since the previous message header */
+    gint64                      burst_start; /* first read since the socket was drained */
+    guint64                     burst_bytes;
 
     GArray                      *caps;
     GArray                      *common_caps;
@@ -139,8 +210,19 @@ struct _SpiceChannelPrivate {
     GArray                      *remote_common_caps;
 
     gsize                       total_read_bytes;
+    guint64                     total_read_calls;
+    guint64                     total_read_msgs;
+    guint64                     total_xmit_bytes;
+    guint64                     total_xmit_msgs;
+    GArray                      *recv_stats; /* SpiceMsgStats, by message type */
+    GArray                      *xmit_stats;
+    guint                       stats_interval; /* ms */
+    gboolean                    stats_timed; /* time the messages, once stats are asked for */
+    guint                       stats_timeout_id;
     uint64_t                    last_message_serial;
     GSList                      *flushing;
+    SpiceMsgInPool              *msg_pool;
+    SpiceCapture                *capture; /* NULL unless capturing */
 
     gboolean                    disable_channel_msg;
     gboolean                    auth_needs_username;
@@ -163,6 +245,7 @@ void spice_msg_out_ref(SpiceMsgOut *out);
 void spice_msg_out_unref(SpiceMsgOut *out);
 void spice_msg_out_send(SpiceMsgOut *out);
 void spice_msg_out_send_internal(SpiceMsgOut *out);
+void spice_msg_out_set_priority(SpiceMsgOut *out, SpiceMsgOutPriority priority);
 void spice_msg_out_hexdump(SpiceMsgOut *out, unsigned char *data, int len);
 
 uint16_t spice_header_get_msg_type(uint8_t *header, gboolean is_mini_header);
@@ -172,8 +255,11 @@ void spice_channel_up(SpiceChannel *channel);
 void spice_channel_wakeup(SpiceChannel *channel, gboolean cancel);
 
 SpiceSession* spice_channel_get_session(SpiceChannel *channel);
+void spice_channel_set_connect_time(SpiceChannel *channel, SpiceChannelTime phase);
 enum spice_channel_state spice_channel_get_state(SpiceChannel *channel);
 guint64 spice_channel_get_queue_size (SpiceChannel *channel);
+guint64 spice_channel_get_lane_queue_size(SpiceChannel *channel, SpiceMsgOutPriority priority);
+guint spice_channel_get_lane_queue_length(SpiceChannel *channel, SpiceMsgOutPriority priority);
 
 /* coroutine context */
 typedef void (*handler_msg_in)(SpiceChannel *channel, SpiceMsgIn *msg, gpointer data);
@@ -189,6 +275,7 @@ gint spice_channel_get_channel_type(SpiceChannel *channel);
 void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap_msgs);
 gboolean spice_channel_get_read_only(SpiceChannel *channel);
 void spice_channel_reset(SpiceChannel *channel, gboolean migrating);
+void spice_channel_reset_acks(SpiceChannel *channel);
 
 void spice_caps_set(GArray *caps, guint32 cap, const gchar *desc);
 #define spice_channel_set_common_capability(channel, cap)               \
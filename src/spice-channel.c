@@ -44,6 +44,9 @@
 #ifdef HAVE_ARPA_INET_H
 #include <arpa/inet.h>
 #endif
+#ifndef G_OS_WIN32
+#include <sys/uio.h>
+#endif
 #include <ctype.h>
 
 #include "gio-coroutine.h"
@@ -55,6 +58,9 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating);
 static void spice_channel_reset_capabilities(SpiceChannel *channel);
 static void spice_channel_send_migration_handshake(SpiceChannel *channel);
 static gboolean channel_connect(SpiceChannel *channel, gboolean tls);
+static SpiceMsgInPool *msg_in_pool_new(void);
+static void msg_in_pool_unref(SpiceMsgInPool *pool);
+static void spice_channel_before_wait(gpointer data);
 
 /**
  * SECTION:spice-channel
@@ -86,24 +92,30 @@ enum {
     PROP_CHANNEL_TYPE,
     PROP_CHANNEL_ID,
     PROP_TOTAL_READ_BYTES,
+    PROP_STATS_INTERVAL,
 };
 
 /* Signals */
 enum {
     SPICE_CHANNEL_EVENT,
     SPICE_CHANNEL_OPEN_FD,
+    SPICE_CHANNEL_STATS,
 
     SPICE_CHANNEL_LAST_SIGNAL,
 };
 
 static guint signals[SPICE_CHANNEL_LAST_SIGNAL];
 
+/* SSL ex data slot pointing back to the channel */
+static int ssl_channel_index = -1;
+
 static void spice_channel_iterate_write(SpiceChannel *channel);
 static void spice_channel_iterate_read(SpiceChannel *channel);
 
 static void spice_channel_init(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c;
+    int i;
 
     c = channel->priv = SPICE_CHANNEL_GET_PRIVATE(channel);
 
@@ -122,8 +134,19 @@ static void spice_channel_init(SpiceChannel *channel)
 #if HAVE_SASL
     spice_channel_set_common_capability(channel, SPICE_COMMON_CAP_AUTH_SASL);
 #endif
-    g_queue_init(&c->xmit_queue);
+    for (i = 0; i < SPICE_MSG_OUT_N_PRIORITIES; i++)
+        g_queue_init(&c->xmit_queue.lanes[i]);
     STATIC_MUTEX_INIT(c->xmit_queue_lock);
+    c->xmit_vecs = g_array_new(FALSE, FALSE, sizeof(GOutputVector));
+    c->msg_pool = msg_in_pool_new();
+    c->capture = spice_capture_get();
+    c->recv_stats = g_array_new(FALSE, TRUE, sizeof(SpiceMsgStats));
+    c->xmit_stats = g_array_new(FALSE, TRUE, sizeof(SpiceMsgStats));
+    /* acks are sent as soon as due until the link is known */
+    c->acks_early = TRUE;
+    c->window_limited = 256;
+    c->coroutine.before_wait = spice_channel_before_wait;
+    c->coroutine.before_wait_data = channel;
 }
 
 static void spice_channel_constructed(GObject *gobject)
@@ -156,6 +179,11 @@ static void spice_channel_dispose(GObject *gobject)
 
     spice_channel_disconnect(channel, SPICE_CHANNEL_CLOSED);
 
+    if (c->stats_timeout_id) {
+        g_source_remove(c->stats_timeout_id);
+        c->stats_timeout_id = 0;
+    }
+
     if (c->session) {
          g_object_unref(c->session);
          c->session = NULL;
@@ -179,6 +207,16 @@ static void spice_channel_finalize(GObject *gobject)
 
     STATIC_MUTEX_CLEAR(c->xmit_queue_lock);
 
+    g_free(c->recv_buf);
+    g_free(c->xmit_buf);
+    g_array_free(c->xmit_vecs, TRUE);
+    g_array_free(c->recv_stats, TRUE);
+    g_array_free(c->xmit_stats, TRUE);
+
+    CHANNEL_DEBUG(channel, "message pool: %" G_GUINT64_FORMAT " hits, %"
+                  G_GUINT64_FORMAT " misses", c->msg_pool->hits, c->msg_pool->misses);
+    msg_in_pool_unref(c->msg_pool);
+
     if (c->caps)
         g_array_free(c->caps, TRUE);
 
@@ -217,6 +255,9 @@ static void spice_channel_get_property(GObject    *gobject,
     case PROP_TOTAL_READ_BYTES:
         g_value_set_ulong(value, c->total_read_bytes);
         break;
+    case PROP_STATS_INTERVAL:
+        g_value_set_uint(value, c->stats_interval);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -241,6 +282,33 @@ gint spice_channel_get_channel_type(SpiceChannel *channel)
     return c->channel_type;
 }
 
+/* main context */
+static gboolean stats_timeout(gpointer user_data)
+{
+    SpiceChannel *channel = user_data;
+    GVariant *stats = g_variant_ref_sink(spice_channel_get_stats(channel));
+
+    g_signal_emit(channel, signals[SPICE_CHANNEL_STATS], 0, stats);
+    g_variant_unref(stats);
+
+    return TRUE;
+}
+
+static void spice_channel_set_stats_interval(SpiceChannel *channel, guint interval)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->stats_timeout_id) {
+        g_source_remove(c->stats_timeout_id);
+        c->stats_timeout_id = 0;
+    }
+    c->stats_interval = interval;
+    if (interval > 0) {
+        c->stats_timed = TRUE;
+        c->stats_timeout_id = g_timeout_add(interval, stats_timeout, channel);
+    }
+}
+
 static void spice_channel_set_property(GObject      *gobject,
                                        guint         prop_id,
                                        const GValue *value,
@@ -259,6 +327,9 @@ static void spice_channel_set_property(GObject      *gobject,
     case PROP_CHANNEL_ID:
         c->channel_id = g_value_get_int(value);
         break;
+    case PROP_STATS_INTERVAL:
+        spice_channel_set_stats_interval(channel, g_value_get_uint(value));
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -319,6 +390,23 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
                             G_PARAM_READABLE |
                             G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceChannel:stats-interval:
+     *
+     * How often, in milliseconds, #SpiceChannel::channel-stats is
+     * emitted. 0, the default, disables it.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_STATS_INTERVAL,
+         g_param_spec_uint("stats-interval",
+                           "Stats interval",
+                           "Interval of the channel-stats signal, in ms",
+                           0, G_MAXUINT, 0,
+                           G_PARAM_READWRITE |
+                           G_PARAM_STATIC_STRINGS));
+
     /**
      * SpiceChannel::channel-event:
      * @channel: the channel that emitted the signal
@@ -360,10 +448,32 @@ static void spice_channel_class_init(SpiceChannelClass *klass)
                      1,
                      G_TYPE_INT);
 
+    /**
+     * SpiceChannel::channel-stats:
+     * @channel: the channel that emitted the signal
+     * @stats: the statistics of @channel
+     *
+     * The #SpiceChannel::channel-stats signal is emitted every
+     * #SpiceChannel:stats-interval milliseconds. @stats is the same
+     * dictionary as returned by spice_channel_get_stats().
+     *
+     * Since: 0.31
+     **/
+    signals[SPICE_CHANNEL_STATS] =
+        g_signal_new("channel-stats",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0, NULL, NULL,
+                     g_cclosure_marshal_VOID__VARIANT,
+                     G_TYPE_NONE,
+                     1,
+                     G_TYPE_VARIANT);
+
     g_type_class_add_private(klass, sizeof(SpiceChannelPrivate));
 
     SSL_library_init();
     SSL_load_error_strings();
+    ssl_channel_index = SSL_get_ex_new_index(0, (void *)"spice channel", NULL, NULL, NULL);
 }
 
 /* ---------------------------------------------------------------- */
@@ -461,6 +571,122 @@ static inline uint32_t spice_header_get_msg_sub_list(uint8_t *header, gboolean i
     }
 }
 
+/* ---------------------------------------------------------------- */
+/* incoming message buffer pool                                     */
+
+/*
+ * Message bodies are borrowed from power-of-two size classes and
+ * handed back when the last reference to the SpiceMsgIn goes away.
+ * The pool is refcounted by every message holding one of its buffers,
+ * so queued messages (stream frames...) may outlive their channel.
+ */
+#define MSG_IN_POOL_MIN_SHIFT   8       /* 256 bytes */
+#define MSG_IN_POOL_MAX_SHIFT   22      /* 4 MiB */
+#define MSG_IN_POOL_N_CLASSES   (MSG_IN_POOL_MAX_SHIFT - MSG_IN_POOL_MIN_SHIFT + 1)
+#define MSG_IN_POOL_CLASS_BYTES (1024 * 1024)
+
+struct _SpiceMsgInPool {
+    gint                  refcount;
+    STATIC_MUTEX          lock;
+    GSList                *free[MSG_IN_POOL_N_CLASSES];
+    guint                 nfree[MSG_IN_POOL_N_CLASSES];
+    guint64               hits;
+    guint64               misses;
+};
+
+static SpiceMsgInPool *msg_in_pool_new(void)
+{
+    SpiceMsgInPool *pool = g_new0(SpiceMsgInPool, 1);
+
+    pool->refcount = 1;
+    STATIC_MUTEX_INIT(pool->lock);
+
+    return pool;
+}
+
+static SpiceMsgInPool *msg_in_pool_ref(SpiceMsgInPool *pool)
+{
+    g_atomic_int_inc(&pool->refcount);
+
+    return pool;
+}
+
+static void msg_in_pool_unref(SpiceMsgInPool *pool)
+{
+    int i;
+
+    if (!g_atomic_int_dec_and_test(&pool->refcount))
+        return;
+
+    for (i = 0; i < MSG_IN_POOL_N_CLASSES; i++)
+        g_slist_free_full(pool->free[i], g_free);
+    STATIC_MUTEX_CLEAR(pool->lock);
+    g_free(pool);
+}
+
+/* returns the size class for @size, or -1 if too big to be pooled */
+static int msg_in_pool_class(size_t size)
+{
+    int shift = MSG_IN_POOL_MIN_SHIFT;
+
+    while (((size_t)1 << shift) < size) {
+        if (++shift > MSG_IN_POOL_MAX_SHIFT)
+            return -1;
+    }
+
+    return shift - MSG_IN_POOL_MIN_SHIFT;
+}
+
+/* any context */
+static uint8_t *msg_in_pool_alloc(SpiceMsgInPool *pool, size_t size, int *klass)
+{
+    uint8_t *data = NULL;
+    int k = msg_in_pool_class(size);
+
+    *klass = k;
+    if (k < 0)
+        return g_malloc(size);
+
+    STATIC_MUTEX_LOCK(pool->lock);
+    if (pool->free[k] != NULL) {
+        data = pool->free[k]->data;
+        pool->free[k] = g_slist_delete_link(pool->free[k], pool->free[k]);
+        pool->nfree[k]--;
+        pool->hits++;
+    } else {
+        pool->misses++;
+    }
+    STATIC_MUTEX_UNLOCK(pool->lock);
+
+    if (data == NULL)
+        data = g_malloc((size_t)1 << (k + MSG_IN_POOL_MIN_SHIFT));
+
+    return data;
+}
+
+/* any context */
+static void msg_in_pool_release(SpiceMsgInPool *pool, uint8_t *data, int klass)
+{
+    guint max_free;
+
+    if (klass < 0) {
+        g_free(data);
+        return;
+    }
+
+    max_free = MAX(2, MSG_IN_POOL_CLASS_BYTES >> (klass + MSG_IN_POOL_MIN_SHIFT));
+
+    STATIC_MUTEX_LOCK(pool->lock);
+    if (pool->nfree[klass] < max_free) {
+        pool->free[klass] = g_slist_prepend(pool->free[klass], data);
+        pool->nfree[klass]++;
+        data = NULL;
+    }
+    STATIC_MUTEX_UNLOCK(pool->lock);
+
+    g_free(data);
+}
+
 /* ---------------------------------------------------------------- */
 /* private msg api                                                  */
 
@@ -516,6 +742,9 @@ void spice_msg_in_unref(SpiceMsgIn *in)
         in->pfree(in->parsed);
     if (in->parent) {
         spice_msg_in_unref(in->parent);
+    } else if (in->pool) {
+        msg_in_pool_release(in->pool, in->data, in->pool_class);
+        msg_in_pool_unref(in->pool);
     } else {
         g_free(in->data);
     }
@@ -616,6 +845,29 @@ static gboolean msg_check_read_only (int channel_type, int msg_type)
     return TRUE;
 }
 
+static SpiceMsgOutPriority msg_out_default_priority(int channel_type, int msg_type)
+{
+    if (msg_type < 100) // acks, pongs and other common messages
+        return SPICE_MSG_OUT_PRIORITY_HIGH;
+
+    switch (channel_type) {
+    case SPICE_CHANNEL_INPUTS:
+        return SPICE_MSG_OUT_PRIORITY_HIGH;
+    case SPICE_CHANNEL_MAIN:
+        if (msg_type == SPICE_MSGC_MAIN_AGENT_DATA)
+            return SPICE_MSG_OUT_PRIORITY_BULK;
+        break;
+    case SPICE_CHANNEL_USBREDIR:
+    case SPICE_CHANNEL_WEBDAV:
+        /* not the port channel: its data must stay ordered with its events */
+        if (msg_type == SPICE_MSGC_SPICEVMC_DATA)
+            return SPICE_MSG_OUT_PRIORITY_BULK;
+        break;
+    }
+
+    return SPICE_MSG_OUT_PRIORITY_NORMAL;
+}
+
 G_GNUC_INTERNAL
 SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type)
 {
@@ -628,6 +880,7 @@ SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type)
     out->refcount = 1;
     out->channel  = channel;
     out->ro_check = msg_check_read_only(c->channel_type, type);
+    out->priority = msg_out_default_priority(c->channel_type, type);
 
     out->marshallers = c->marshallers;
     out->marshaller = spice_marshaller_new();
@@ -643,6 +896,19 @@ SpiceMsgOut *spice_msg_out_new(SpiceChannel *channel, int type)
     return out;
 }
 
+/*
+ * Messages of the same priority are always sent in order, but there is
+ * no ordering guarantee between messages of different priorities.
+ */
+G_GNUC_INTERNAL
+void spice_msg_out_set_priority(SpiceMsgOut *out, SpiceMsgOutPriority priority)
+{
+    g_return_if_fail(out != NULL);
+    g_return_if_fail(priority < SPICE_MSG_OUT_N_PRIORITIES);
+
+    out->priority = priority;
+}
+
 G_GNUC_INTERNAL
 void spice_msg_out_ref(SpiceMsgOut *out)
 {
@@ -660,6 +926,9 @@ void spice_msg_out_unref(SpiceMsgOut *out)
     if (out->refcount > 0)
         return;
     spice_marshaller_destroy(out->marshaller);
+#ifdef G_OS_WIN32
+    g_free(out->linear);
+#endif
     g_slice_free(SpiceMsgOut, out);
 }
 
@@ -692,6 +961,31 @@ static gboolean spice_channel_idle_wakeup(gpointer user_data)
     return FALSE;
 }
 
+/* xmit_queue_lock must be held */
+static gboolean xmit_queue_is_empty(SpiceXmitQueue *q)
+{
+    int i;
+
+    for (i = 0; i < SPICE_MSG_OUT_N_PRIORITIES; i++) {
+        if (!g_queue_is_empty(&q->lanes[i]))
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* xmit_queue_lock must be held */
+static void xmit_queue_clear(SpiceXmitQueue *q)
+{
+    int i;
+
+    for (i = 0; i < SPICE_MSG_OUT_N_PRIORITIES; i++) {
+        g_queue_foreach(&q->lanes[i], (GFunc)spice_msg_out_unref, NULL);
+        g_queue_clear(&q->lanes[i]);
+        q->sizes[i] = 0;
+    }
+}
+
 /* any context (system/co-routine/usb-event-thread) */
 G_GNUC_INTERNAL
 void spice_msg_out_send(SpiceMsgOut *out)
@@ -711,9 +1005,11 @@ void spice_msg_out_send(SpiceMsgOut *out)
         goto end;
     }
 
-    was_empty = g_queue_is_empty(&c->xmit_queue);
-    g_queue_push_tail(&c->xmit_queue, out);
-    c->xmit_queue_size = (was_empty) ? size : c->xmit_queue_size + size;
+    if (c->stats_timed)
+        out->queued = g_get_monotonic_time();
+    was_empty = xmit_queue_is_empty(&c->xmit_queue);
+    g_queue_push_tail(&c->xmit_queue.lanes[out->priority], out);
+    c->xmit_queue.sizes[out->priority] += size;
 
     /* One wakeup is enough to empty the entire queue -> only do a wakeup
        if the queue was empty, and there isn't one pending already. */
@@ -840,37 +1136,336 @@ static void spice_channel_write(SpiceChannel *channel, const void *data, size_t
         spice_channel_flush_wire(channel, data, len);
 }
 
+/* the most vectors sendmsg() takes, IOV_MAX on Linux */
+#define XMIT_MAX_VECTORS 1024
+
+/*
+ * Write all the vectors out to the socket with as few sendmsg() as
+ * possible. Only usable on a plain socket connection.
+ */
 /* coroutine context */
-static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
+static void spice_channel_flush_wire_vectors(SpiceChannel *channel,
+                                             GOutputVector *vecs, guint n)
 {
-    uint8_t *data;
-    int free_data;
+    SpiceChannelPrivate *c = channel->priv;
+
+    while (n > 0) {
+        gssize ret;
+        GError *error = NULL;
+
+        if (c->has_error) return;
+
+        ret = g_socket_send_message(c->sock, NULL, vecs, MIN(n, XMIT_MAX_VECTORS),
+                                    NULL, 0, 0, NULL, &error);
+        if (ret < 0) {
+            if (g_error_matches(error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+                g_clear_error(&error);
+                g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_OUT);
+                continue;
+            }
+            CHANNEL_DEBUG(channel, "Send error %s", error->message);
+            g_clear_error(&error);
+            c->has_error = TRUE;
+            return;
+        }
+
+        /* skip what was written, and resume in the middle of a partial vector */
+        while (n > 0 && ret >= vecs->size) {
+            ret -= vecs->size;
+            vecs++;
+            n--;
+        }
+        if (n > 0) {
+            vecs->buffer = (const guint8 *)vecs->buffer + ret;
+            vecs->size -= ret;
+        }
+    }
+}
+
+/*
+ * Pack the vectors in SPICE_CHANNEL_XMIT_BUF_SIZE chunks, so that
+ * TLS and SASL get full records instead of one per marshaller item.
+ * Vectors that are large enough on their own are written directly.
+ */
+/* coroutine context */
+static void spice_channel_write_coalesced(SpiceChannel *channel,
+                                          const GOutputVector *vecs, guint n)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gsize fill = 0;
+    guint i;
+
+    if (c->xmit_buf == NULL)
+        c->xmit_buf = g_malloc(SPICE_CHANNEL_XMIT_BUF_SIZE);
+
+    for (i = 0; i < n && !c->has_error; i++) {
+        const guint8 *data = vecs[i].buffer;
+        gsize size = vecs[i].size;
+
+        if (size >= SPICE_CHANNEL_XMIT_BUF_SIZE) {
+            if (fill > 0) {
+                spice_channel_write(channel, c->xmit_buf, fill);
+                fill = 0;
+            }
+            spice_channel_write(channel, data, size);
+            continue;
+        }
+
+        while (size > 0) {
+            gsize len = MIN(size, SPICE_CHANNEL_XMIT_BUF_SIZE - fill);
+
+            memcpy(c->xmit_buf + fill, data, len);
+            fill += len;
+            data += len;
+            size -= len;
+            if (fill == SPICE_CHANNEL_XMIT_BUF_SIZE) {
+                spice_channel_write(channel, c->xmit_buf, fill);
+                fill = 0;
+            }
+        }
+    }
+
+    if (fill > 0 && !c->has_error)
+        spice_channel_write(channel, c->xmit_buf, fill);
+}
+
+/* coroutine context */
+static void spice_channel_writev(SpiceChannel *channel, GOutputVector *vecs, guint n)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+#if HAVE_SASL
+    if (c->sasl_conn) {
+        spice_channel_write_coalesced(channel, vecs, n);
+        return;
+    }
+#endif
+    /* proxied connections must go through their stream */
+    if (c->tls || G_IS_TCP_WRAPPER_CONNECTION(c->conn))
+        spice_channel_write_coalesced(channel, vecs, n);
+    else
+        spice_channel_flush_wire_vectors(channel, vecs, n);
+}
+
+/* coroutine context */
+static void spice_channel_msg_out_add_vectors(SpiceMsgOut *out, GArray *vecs)
+{
+#ifndef G_OS_WIN32
+    struct iovec iov[64];
+    size_t total, skip = 0;
+    int i, n;
+
+    total = spice_marshaller_get_total_size(out->marshaller);
+    while (skip < total) {
+        n = spice_marshaller_fill_iovec(out->marshaller, iov, G_N_ELEMENTS(iov), skip);
+        g_return_if_fail(n > 0);
+        for (i = 0; i < n; i++) {
+            GOutputVector vec = { iov[i].iov_base, iov[i].iov_len };
+            g_array_append_val(vecs, vec);
+            skip += iov[i].iov_len;
+        }
+    }
+#else
+    GOutputVector vec;
     size_t len;
-    uint32_t msg_size;
+    int free_data;
+
+    vec.buffer = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
+    vec.size = len;
+    if (free_data)
+        out->linear = (uint8_t *)vec.buffer;
+    g_array_append_val(vecs, vec);
+#endif
+}
+
+/* no channel has message types beyond this, the others share one entry */
+#define MSG_STATS_MAX_TYPE 512
+
+/* the entry of @msg_type in @stats, which grows as needed */
+static SpiceMsgStats *msg_stats_get(GArray *stats, guint16 msg_type)
+{
+    msg_type = MIN(msg_type, MSG_STATS_MAX_TYPE);
+    if (msg_type >= stats->len)
+        g_array_set_size(stats, msg_type + 1);
+
+    return &g_array_index(stats, SpiceMsgStats, msg_type);
+}
+
+/*
+ * Send all the messages of @msgs, gathering them in as few writes as
+ * possible. The queue is emptied and the messages are unref'd.
+ */
+/* coroutine context */
+static void spice_channel_write_msgs(SpiceChannel *channel, GQueue *msgs)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    GQueue pending = G_QUEUE_INIT;
+    SpiceMsgOut *out, *written;
+    gint64 now = c->stats_timed ? g_get_monotonic_time() : 0;
+
+    while ((out = g_queue_pop_head(msgs)) != NULL) {
+        SpiceMsgStats *stats;
+        uint32_t msg_size;
+        guint first_vec;
+
+        g_warn_if_fail(channel == out->channel);
+
+        if (out->ro_check &&
+            spice_channel_get_read_only(channel)) {
+            g_warning("Try to send message while read-only. Please report a bug.");
+            spice_msg_out_unref(out);
+            continue;
+        }
+
+        msg_size = spice_marshaller_get_total_size(out->marshaller) -
+                   spice_header_get_header_size(c->use_mini_header);
+        spice_header_set_msg_size(out->header, c->use_mini_header, msg_size);
+        first_vec = c->xmit_vecs->len;
+        spice_channel_msg_out_add_vectors(out, c->xmit_vecs);
+
+        stats = msg_stats_get(c->xmit_stats,
+                              spice_header_get_msg_type(out->header, c->use_mini_header));
+        stats->messages++;
+        stats->bytes += spice_header_get_header_size(c->use_mini_header) + msg_size;
+        if (now && out->queued)
+            stats->queue_wait += now - out->queued;
+        c->total_xmit_msgs++;
+        c->total_xmit_bytes += spice_header_get_header_size(c->use_mini_header) + msg_size;
+
+        if (c->capture) {
+            SpiceCaptureRecord record = {
+                .channel_type = c->channel_type,
+                .channel_id = c->channel_id,
+                .direction = SPICE_CAPTURE_SEND,
+                .msg_type = spice_header_get_msg_type(out->header, c->use_mini_header),
+                .size = msg_size,
+            };
+
+            spice_capture_write(c->capture, &record,
+                                &g_array_index(c->xmit_vecs, GOutputVector, first_vec),
+                                c->xmit_vecs->len - first_vec,
+                                spice_header_get_header_size(c->use_mini_header));
+        }
+        g_queue_push_tail(&pending, out);
+
+        if (c->xmit_vecs->len >= XMIT_MAX_VECTORS || g_queue_is_empty(msgs)) {
+            spice_channel_writev(channel, (GOutputVector *)c->xmit_vecs->data,
+                                 c->xmit_vecs->len);
+            g_array_set_size(c->xmit_vecs, 0);
+            /* the vectors point into the marshallers, release them only now */
+            while ((written = g_queue_pop_head(&pending)) != NULL) {
+                if (written->written != NULL && !c->has_error)
+                    written->written(written, written->written_data);
+                spice_msg_out_unref(written);
+            }
+        }
+    }
+}
+
+/* coroutine context */
+static void spice_channel_write_msg(SpiceChannel *channel, SpiceMsgOut *out)
+{
+    GQueue msgs = G_QUEUE_INIT;
 
     g_return_if_fail(channel != NULL);
     g_return_if_fail(out != NULL);
     g_return_if_fail(channel == out->channel);
 
-    if (out->ro_check &&
-        spice_channel_get_read_only(channel)) {
-        g_warning("Try to send message while read-only. Please report a bug.");
+    g_queue_push_tail(&msgs, out);
+    spice_channel_write_msgs(channel, &msgs);
+}
+
+/* below this round trip, the server waiting for acks costs less than
+ * sending them one by one */
+#define ACK_EARLY_MIN_RTT 1000 /* us */
+
+/* coroutine context */
+G_GNUC_INTERNAL
+void spice_channel_reset_acks(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    c->ack_msgs = 0;
+    c->acks_sent = 0;
+    c->acks_pending = 0;
+    c->rtt_msg = 0;
+}
+
+/*
+ * Sends the acks due. An ack acknowledges a whole window and the server
+ * counts them off the messages it sent, so an ack can't be sent before
+ * the server started sending the last message it covers, but it can be
+ * held back and sent along with the next one.
+ */
+/* coroutine context */
+static void spice_channel_send_acks(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    GQueue acks = G_QUEUE_INIT;
+
+    if (c->acks_pending == 0)
         return;
+
+    if (c->acks_pending > 1)
+        c->acks_coalesced += c->acks_pending;
+    for (; c->acks_pending > 0; c->acks_pending--) {
+        g_queue_push_tail(&acks, spice_msg_out_new(channel, SPICE_MSGC_ACK));
+        c->acks_sent++;
+        /*
+         * With a window of W, the server sends at most 2W + 1 messages
+         * beyond the acks it got: message (k + 1)W + 2 can't leave it
+         * before the k-th ack gets there. The time from the ack to that
+         * message is the round trip when the server was waiting for the
+         * ack, and more otherwise.
+         */
+        if (c->rtt_msg == 0) {
+            c->rtt_msg = (c->acks_sent + 1) * c->message_ack_window + 2;
+            c->rtt_ack_time = g_get_monotonic_time();
+        }
     }
+    spice_channel_write_msgs(channel, &acks);
+}
 
-    msg_size = spice_marshaller_get_total_size(out->marshaller) -
-               spice_header_get_header_size(channel->priv->use_mini_header);
-    spice_header_set_msg_size(out->header, channel->priv->use_mini_header, msg_size);
-    data = spice_marshaller_linearize(out->marshaller, 0, &len, &free_data);
-    /* spice_msg_out_hexdump(out, data, len); */
-    spice_channel_write(channel, data, len);
+/* a handler waiting on other channels mustn't hold the server back */
+/* coroutine context */
+static void spice_channel_before_wait(gpointer data)
+{
+    SpiceChannel *channel = data;
+    SpiceChannelPrivate *c = channel->priv;
 
-    if (free_data)
-        g_free(data);
+    if (c->state == SPICE_CHANNEL_STATE_MIGRATING || c->has_error)
+        return;
 
-    spice_msg_out_unref(out);
+    spice_channel_send_acks(channel);
 }
 
+/* the message that waited for the timed ack started arriving */
+/* coroutine context */
+static void spice_channel_ack_timed(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    gint64 sample = g_get_monotonic_time() - c->rtt_ack_time;
+    guint64 rtt = spice_session_rtt_sample(c->session, sample);
+    gboolean limited;
+
+    c->rtt_msg = 0;
+
+    /* it came a round trip after the ack, with nothing to read
+     * meanwhile: the server was waiting for the ack */
+    limited = c->read_waited && rtt >= ACK_EARLY_MIN_RTT && sample < 2 * rtt;
+    c->window_limited = (7 * c->window_limited + (limited ? 256 : 0)) / 8;
+    if (!c->acks_early && c->window_limited > 128) {
+        CHANNEL_DEBUG(channel, "the server waits for acks, sending them early");
+        c->acks_early = TRUE;
+    } else if (c->acks_early && c->window_limited < 64) {
+        CHANNEL_DEBUG(channel, "the server doesn't wait for acks, coalescing them");
+        c->acks_early = FALSE;
+    }
+}
+
+/* shorter bursts are mostly timer and scheduling noise */
+#define BANDWIDTH_MIN_BURST (64 * 1024)
+
 /*
  * Read at least 1 more byte of data straight off the wire
  * into the requested buffer.
@@ -887,6 +1482,7 @@ reread:
     if (c->has_error) return 0; /* has_error is set by disconnect(), return no error */
 
     cond = 0;
+    c->total_read_calls++;
     if (c->tls) {
         ret = SSL_read(c->ssl, data, len);
         if (ret < 0) {
@@ -914,6 +1510,16 @@ reread:
 
     if (ret == -1) {
         if (cond != 0) {
+            /* the end of a burst, the reads since its first one tell
+             * how fast the data came in */
+            if (c->burst_bytes >= BANDWIDTH_MIN_BURST)
+                spice_session_bandwidth_sample(c->session, c->burst_bytes,
+                                               g_get_monotonic_time() - c->burst_start);
+            c->burst_start = 0;
+            c->burst_bytes = 0;
+            /* the server may be waiting for them */
+            spice_channel_send_acks(channel);
+            c->read_waited = TRUE;
             // TODO: should use g_pollable_input/output_stream_create_source() ?
             g_coroutine_socket_wait(&c->coroutine, c->sock, cond);
             goto reread;
@@ -928,9 +1534,62 @@ reread:
         return 0;
     }
 
+    /* what the first read gets was queued while waiting, don't time it */
+    if (c->burst_start == 0)
+        c->burst_start = g_get_monotonic_time();
+    else
+        c->burst_bytes += ret;
+
     return ret;
 }
 
+/*
+ * Read at least 1 more byte of data out of the channel receive
+ * buffer, refilling it from the wire with a single large read when it
+ * is empty. Requests bigger than the buffer bypass it entirely.
+ */
+/* coroutine context */
+static int spice_channel_read_buffered(SpiceChannel *channel, void *data, size_t len)
+{
+    SpiceChannelPrivate *c = channel->priv;
+    int ret;
+
+    if (c->recv_buf_pos == c->recv_buf_len) {
+        c->recv_buf_pos = c->recv_buf_len = 0;
+
+        if (len >= SPICE_CHANNEL_RECV_BUF_SIZE)
+            return spice_channel_read_wire(channel, data, len);
+
+        if (c->recv_buf == NULL)
+            c->recv_buf = g_malloc(SPICE_CHANNEL_RECV_BUF_SIZE);
+
+        ret = spice_channel_read_wire(channel, c->recv_buf, SPICE_CHANNEL_RECV_BUF_SIZE);
+        if (ret <= 0)
+            return ret;
+        c->recv_buf_len = ret;
+    }
+
+    len = MIN(c->recv_buf_len - c->recv_buf_pos, len);
+    memcpy(data, c->recv_buf + c->recv_buf_pos, len);
+    c->recv_buf_pos += len;
+
+    return len;
+}
+
+/* coroutine context */
+static gboolean spice_channel_has_buffered_data(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c = channel->priv;
+
+    if (c->recv_buf_pos != c->recv_buf_len)
+        return TRUE;
+#if HAVE_SASL
+    if (c->sasl_decoded != NULL)
+        return TRUE;
+#endif
+    return FALSE;
+}
+
 #if HAVE_SASL
 /*
  * Read at least 1 more byte of data out of the SASL decrypted
@@ -949,7 +1608,7 @@ static int spice_channel_read_sasl(SpiceChannel *channel, void *data, size_t len
 
         g_warn_if_fail(c->sasl_decoded_offset == 0);
 
-        ret = spice_channel_read_wire(channel, encoded, sizeof(encoded));
+        ret = spice_channel_read_buffered(channel, encoded, sizeof(encoded));
         if (ret < 0)
             return ret;
 
@@ -998,7 +1657,7 @@ static int spice_channel_read(SpiceChannel *channel, void *data, size_t length)
             ret = spice_channel_read_sasl(channel, data, len);
         else
 #endif
-            ret = spice_channel_read_wire(channel, data, len);
+            ret = spice_channel_read_buffered(channel, data, len);
         if (ret < 0)
             return ret;
         g_assert(ret <= len);
@@ -1124,6 +1783,7 @@ static gboolean spice_channel_recv_auth(SpiceChannel *channel)
     }
 
     c->state = SPICE_CHANNEL_STATE_READY;
+    spice_channel_set_connect_time(channel, SPICE_CHANNEL_TIME_AUTHENTICATED);
 
     g_coroutine_signal_emit(channel, signals[SPICE_CHANNEL_EVENT], 0, SPICE_CHANNEL_OPENED);
 
@@ -1803,6 +2463,27 @@ static gboolean spice_channel_recv_link_msg(SpiceChannel *channel)
     c->use_mini_header = spice_channel_test_common_capability(channel,
                                                               SPICE_COMMON_CAP_MINI_HEADER);
     CHANNEL_DEBUG(channel, "use mini header: %d", c->use_mini_header);
+
+    if (c->capture) {
+        /* what the replay needs to parse and handle the messages alike */
+        guint32 link[3] = {
+            GUINT32_TO_LE(c->peer_hdr.minor_version),
+            GUINT32_TO_LE(c->peer_msg->num_common_caps),
+            GUINT32_TO_LE(c->peer_msg->num_channel_caps),
+        };
+        SpiceCaptureRecord record = {
+            .channel_type = c->channel_type,
+            .channel_id = c->channel_id,
+            .direction = SPICE_CAPTURE_LINK,
+            .size = sizeof(link) + num_caps * sizeof(uint32_t),
+        };
+        GOutputVector vecs[2] = {
+            { link, sizeof(link) },
+            { (uint8_t *)c->peer_msg + c->peer_msg->caps_offset, num_caps * sizeof(uint32_t) },
+        };
+
+        spice_capture_write(c->capture, &record, vecs, 2, 0);
+    }
     return TRUE;
 
 error:
@@ -1835,12 +2516,15 @@ void spice_channel_recv_msg(SpiceChannel *channel,
                             handler_msg_in msg_handler, gpointer data)
 {
     SpiceChannelPrivate *c = channel->priv;
+    SpiceMsgStats *stats;
     SpiceMsgIn *in;
     int msg_size;
     int msg_type;
     int sub_list_offset = 0;
+    gint64 start = 0, parsed = 0;
 
     in = spice_msg_in_new(channel);
+    c->total_read_msgs++;
 
     /* receive message */
     spice_channel_read(channel, in->header,
@@ -1848,19 +2532,53 @@ void spice_channel_recv_msg(SpiceChannel *channel,
     if (c->has_error)
         goto end;
 
+    /* once the server started sending it, the message can be acked */
+    if (c->message_ack_count) {
+        c->ack_msgs++;
+        if (c->ack_msgs == c->rtt_msg)
+            spice_channel_ack_timed(channel);
+        c->message_ack_count--;
+        if (!c->message_ack_count) {
+            c->message_ack_count = c->message_ack_window;
+            c->acks_pending++;
+            /* one ack held back still leaves the server a window */
+            if (c->acks_early || c->acks_pending > 1)
+                spice_channel_send_acks(channel);
+        }
+    }
+    c->read_waited = FALSE;
+
     msg_size = spice_header_get_msg_size(in->header, c->use_mini_header);
-    /* FIXME: do not allow others to take ref on in, and use realloc here?
-     * this would avoid malloc/free on each message?
-     */
-    in->data = g_malloc0(msg_size);
+    /* the body is fully overwritten by the read below, no need to clear it */
+    in->data = msg_in_pool_alloc(c->msg_pool, msg_size, &in->pool_class);
+    in->pool = msg_in_pool_ref(c->msg_pool);
     spice_channel_read(channel, in->data, msg_size);
     if (c->has_error)
         goto end;
     in->dpos = msg_size;
 
+    if (c->connect_times[SPICE_CHANNEL_TIME_FIRST_MESSAGE] == 0) {
+        spice_channel_set_connect_time(channel, SPICE_CHANNEL_TIME_FIRST_MESSAGE);
+        spice_session_channel_timeline(c->session, channel);
+    }
+
     msg_type = spice_header_get_msg_type(in->header, c->use_mini_header);
     sub_list_offset = spice_header_get_msg_sub_list(in->header, c->use_mini_header);
 
+    if (c->capture) {
+        SpiceCaptureRecord record = {
+            .channel_type = c->channel_type,
+            .channel_id = c->channel_id,
+            .direction = SPICE_CAPTURE_RECV,
+            .msg_type = msg_type,
+            .sub_list = sub_list_offset,
+            .size = msg_size,
+        };
+        GOutputVector vec = { in->data, msg_size };
+
+        spice_capture_write(c->capture, &record, &vec, 1, 0);
+    }
+
     if (msg_type == SPICE_MSG_LIST || sub_list_offset) {
         SpiceSubMessageList *sub_list;
         SpiceSubMessage *sub;
@@ -1871,6 +2589,8 @@ void spice_channel_recv_msg(SpiceChannel *channel,
         for (i = 0; i < sub_list->size; i++) {
             sub = (SpiceSubMessage *)(in->data + sub_list->sub_messages[i]);
             sub_in = spice_msg_in_sub_new(channel, in, sub);
+            if (c->stats_timed)
+                start = g_get_monotonic_time();
             sub_in->parsed = c->parser(sub_in->data, sub_in->data + sub_in->dpos,
                                        spice_header_get_msg_type(sub_in->header,
                                                                  c->use_mini_header),
@@ -1881,26 +2601,27 @@ void spice_channel_recv_msg(SpiceChannel *channel,
                            c->name, spice_header_get_msg_type(sub_in->header, c->use_mini_header));
                 goto end;
             }
+            if (c->stats_timed)
+                parsed = g_get_monotonic_time();
             msg_handler(channel, sub_in, data);
+            stats = msg_stats_get(c->recv_stats, sub->type);
+            stats->messages++;
+            stats->bytes += sub->size;
+            if (start) {
+                stats->parse_time += parsed - start;
+                stats->handler_time += g_get_monotonic_time() - parsed;
+            }
             spice_msg_in_unref(sub_in);
         }
     }
 
-    /* ack message */
-    if (c->message_ack_count) {
-        c->message_ack_count--;
-        if (!c->message_ack_count) {
-            SpiceMsgOut *out = spice_msg_out_new(channel, SPICE_MSGC_ACK);
-            spice_msg_out_send_internal(out);
-            c->message_ack_count = c->message_ack_window;
-        }
-    }
-
     if (msg_type == SPICE_MSG_LIST) {
         goto end;
     }
 
     /* parse message */
+    if (c->stats_timed)
+        start = g_get_monotonic_time();
     in->parsed = c->parser(in->data, in->data + msg_size, msg_type,
                            c->peer_hdr.minor_version, &in->psize, &in->pfree);
     if (in->parsed == NULL) {
@@ -1911,7 +2632,16 @@ void spice_channel_recv_msg(SpiceChannel *channel,
 
     /* process message */
     /* spice_msg_in_hexdump(in); */
+    if (c->stats_timed)
+        parsed = g_get_monotonic_time();
     msg_handler(channel, in, data);
+    stats = msg_stats_get(c->recv_stats, msg_type);
+    stats->messages++;
+    stats->bytes += spice_header_get_header_size(c->use_mini_header) + msg_size;
+    if (start) {
+        stats->parse_time += parsed - start;
+        stats->handler_time += g_get_monotonic_time() - parsed;
+    }
 
 end:
     /* If the server uses full header, the serial is not necessarily equal
@@ -2119,22 +2849,54 @@ static void spice_channel_flushed(SpiceChannel *channel, gboolean success)
     c->flushing = NULL;
 }
 
+/* bytes taken from each lane per scheduling round, at least one message */
+static const guint64 xmit_lane_quantum[SPICE_MSG_OUT_N_PRIORITIES] = {
+    [SPICE_MSG_OUT_PRIORITY_HIGH]   = G_MAXUINT64,
+    [SPICE_MSG_OUT_PRIORITY_NORMAL] = 64 * 1024,
+    [SPICE_MSG_OUT_PRIORITY_BULK]   = 16 * 1024,
+};
+
+/*
+ * Move the next batch of messages to send to @batch: the whole high
+ * priority lane, then up to a quantum of bytes from each lower lane.
+ */
+/* xmit_queue_lock must be held */
+static void xmit_queue_schedule(SpiceXmitQueue *q, GQueue *batch)
+{
+    int i;
+
+    for (i = 0; i < SPICE_MSG_OUT_N_PRIORITIES; i++) {
+        guint64 taken = 0;
+        SpiceMsgOut *out;
+
+        while (taken < xmit_lane_quantum[i] &&
+               (out = g_queue_pop_head(&q->lanes[i])) != NULL) {
+            guint32 size = spice_marshaller_get_total_size(out->marshaller);
+
+            q->sizes[i] = (q->sizes[i] < size) ? 0 : q->sizes[i] - size;
+            taken += size;
+            g_queue_push_tail(batch, out);
+        }
+    }
+}
+
 /* coroutine context */
 static void spice_channel_iterate_write(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
-    SpiceMsgOut *out;
+    GQueue msgs = G_QUEUE_INIT;
 
-    do {
+    /* a new round is scheduled after each batch is written, so that
+       messages queued meanwhile in a higher lane don't wait for the
+       lower lanes to be emptied */
+    for (;;) {
         STATIC_MUTEX_LOCK(c->xmit_queue_lock);
-        out = g_queue_pop_head(&c->xmit_queue);
+        xmit_queue_schedule(&c->xmit_queue, &msgs);
         STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
-        if (out) {
-            guint32 size = spice_marshaller_get_total_size(out->marshaller);
-            c->xmit_queue_size = (c->xmit_queue_size < size) ? 0 : c->xmit_queue_size - size;
-            spice_channel_write_msg(channel, out);
-        }
-    } while (out);
+        if (g_queue_is_empty(&msgs))
+            break;
+        spice_channel_write_msgs(channel, &msgs);
+    }
 
     spice_channel_flushed(channel, TRUE);
 }
@@ -2144,21 +2906,21 @@ static void spice_channel_iterate_read(SpiceChannel *channel)
 {
     SpiceChannelPrivate *c = channel->priv;
 
-    g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
+    /* messages left over in the receive buffer don't need the socket */
+    if (!spice_channel_has_buffered_data(channel)) {
+        spice_channel_send_acks(channel);
+        c->read_waited = TRUE;
+        g_coroutine_socket_wait(&c->coroutine, c->sock, G_IO_IN);
+    }
 
     /* treat all incoming data (block on message completion) */
     while (!c->has_error &&
            c->state != SPICE_CHANNEL_STATE_MIGRATING &&
-           g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in))
-    ) { do
-            spice_channel_recv_msg(channel,
-                                   (handler_msg_in)SPICE_CHANNEL_GET_CLASS(channel)->handle_msg, NULL);
-#if HAVE_SASL
-            /* flush the sasl buffer too */
-        while (c->sasl_decoded != NULL);
-#else
-        while (FALSE);
-#endif
+           (spice_channel_has_buffered_data(channel) ||
+            g_pollable_input_stream_is_readable(G_POLLABLE_INPUT_STREAM(c->in)))
+    ) {
+        spice_channel_recv_msg(channel,
+                               (handler_msg_in)SPICE_CHANNEL_GET_CLASS(channel)->handle_msg, NULL);
     }
 
 }
@@ -2330,6 +3092,154 @@ const GError* spice_channel_get_error(SpiceChannel *self)
     return c->error;
 }
 
+/* coroutine context: called by OpenSSL when the server hands out a
+ * resumable session */
+static int spice_channel_new_tls_session(SSL *ssl, SSL_SESSION *tls_session)
+{
+    SpiceChannel *channel = SSL_get_ex_data(ssl, ssl_channel_index);
+
+    g_return_val_if_fail(channel != NULL, 0);
+
+    if (channel->priv->session == NULL)
+        return 0;
+
+    CHANNEL_DEBUG(channel, "new TLS session, sharing it with the other channels");
+    spice_session_set_tls_session(channel->priv->session, tls_session);
+
+    return 1; /* the session keeps the reference */
+}
+
+/* any context */
+G_GNUC_INTERNAL
+void spice_channel_set_connect_time(SpiceChannel *channel, SpiceChannelTime phase)
+{
+    g_return_if_fail(phase < SPICE_CHANNEL_TIME_LAST);
+
+    channel->priv->connect_times[phase] = g_get_monotonic_time();
+}
+
+/**
+ * spice_channel_get_connect_timeline:
+ * @channel: a #SpiceChannel
+ *
+ * Retrieves how long each phase of the last connection of @channel
+ * took. The result is a dictionary (type "a{sx}"), where "start" is
+ * the monotonic time (see g_get_monotonic_time()) at which the
+ * connection started, and the "resolve", "connect", "tls", "link",
+ * "auth" and "first-message" entries are the times in microseconds,
+ * relative to "start", at which the corresponding phase completed.
+ * Phases that were not reached, or don't apply, are omitted.
+ *
+ * Returns: (transfer full): a floating #GVariant, or %NULL if the
+ * channel never started connecting
+ * Since: 0.31
+ **/
+GVariant* spice_channel_get_connect_timeline(SpiceChannel *channel)
+{
+    static const char *names[SPICE_CHANNEL_TIME_LAST] = {
+        [SPICE_CHANNEL_TIME_START] = "start",
+        [SPICE_CHANNEL_TIME_RESOLVED] = "resolve",
+        [SPICE_CHANNEL_TIME_CONNECTED] = "connect",
+        [SPICE_CHANNEL_TIME_TLS] = "tls",
+        [SPICE_CHANNEL_TIME_LINKED] = "link",
+        [SPICE_CHANNEL_TIME_AUTHENTICATED] = "auth",
+        [SPICE_CHANNEL_TIME_FIRST_MESSAGE] = "first-message",
+    };
+    SpiceChannelPrivate *c;
+    GVariantBuilder builder;
+    gint64 start;
+    int i;
+
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), NULL);
+    c = channel->priv;
+
+    start = c->connect_times[SPICE_CHANNEL_TIME_START];
+    if (start == 0)
+        return NULL;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sx}"));
+    g_variant_builder_add(&builder, "{sx}", names[SPICE_CHANNEL_TIME_START], start);
+    for (i = SPICE_CHANNEL_TIME_START + 1; i < SPICE_CHANNEL_TIME_LAST; i++) {
+        if (c->connect_times[i] != 0)
+            g_variant_builder_add(&builder, "{sx}", names[i], c->connect_times[i] - start);
+    }
+
+    return g_variant_builder_end(&builder);
+}
+
+/**
+ * spice_channel_get_stats:
+ * @channel: a #SpiceChannel
+ *
+ * Retrieves the traffic statistics of @channel, counted since it was
+ * created. The result is a dictionary (type "a{sv}") with:
+ *
+ * "time": the monotonic time of the snapshot (x),
+ * "read-bytes" and "read-messages": everything received (t),
+ * "xmit-bytes" and "xmit-messages": everything sent (t),
+ * "acks-coalesced": the acks held back and sent with others (t),
+ * "received": for each message type received, its type, count, size in
+ * bytes, and microseconds spent parsing and handling it (a(qtttt)),
+ * "sent": for each message type sent, its type, count, size in bytes,
+ * and microseconds spent in the send queue (a(qttt)).
+ *
+ * The handler time is wall clock time, and includes the time a handler
+ * waits for other channels, for instance for an image to be cached.
+ * The times are only measured once the stats have been asked for,
+ * either with this function or with #SpiceChannel:stats-interval.
+ * Sub-messages are counted with their own type, and types beyond 512
+ * are counted together as type 512.
+ *
+ * Returns: (transfer full): a floating #GVariant
+ * Since: 0.31
+ **/
+GVariant* spice_channel_get_stats(SpiceChannel *channel)
+{
+    SpiceChannelPrivate *c;
+    GVariantBuilder builder, types;
+    guint i;
+
+    g_return_val_if_fail(SPICE_IS_CHANNEL(channel), NULL);
+    c = channel->priv;
+    c->stats_timed = TRUE;
+
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&builder, "{sv}", "time",
+                          g_variant_new_int64(g_get_monotonic_time()));
+    g_variant_builder_add(&builder, "{sv}", "read-bytes",
+                          g_variant_new_uint64(c->total_read_bytes));
+    g_variant_builder_add(&builder, "{sv}", "read-messages",
+                          g_variant_new_uint64(c->total_read_msgs));
+    g_variant_builder_add(&builder, "{sv}", "xmit-bytes",
+                          g_variant_new_uint64(c->total_xmit_bytes));
+    g_variant_builder_add(&builder, "{sv}", "xmit-messages",
+                          g_variant_new_uint64(c->total_xmit_msgs));
+    g_variant_builder_add(&builder, "{sv}", "acks-coalesced",
+                          g_variant_new_uint64(c->acks_coalesced));
+
+    g_variant_builder_init(&types, G_VARIANT_TYPE("a(qtttt)"));
+    for (i = 0; i < c->recv_stats->len; i++) {
+        SpiceMsgStats *stats = &g_array_index(c->recv_stats, SpiceMsgStats, i);
+
+        if (stats->messages)
+            g_variant_builder_add(&types, "(qtttt)", i, stats->messages, stats->bytes,
+                                  stats->parse_time, stats->handler_time);
+    }
+    g_variant_builder_add(&builder, "{sv}", "received", g_variant_builder_end(&types));
+
+    g_variant_builder_init(&types, G_VARIANT_TYPE("a(qttt)"));
+    for (i = 0; i < c->xmit_stats->len; i++) {
+        SpiceMsgStats *stats = &g_array_index(c->xmit_stats, SpiceMsgStats, i);
+
+        if (stats->messages)
+            g_variant_builder_add(&types, "(qttt)", i, stats->messages, stats->bytes,
+                                  stats->queue_wait);
+    }
+    g_variant_builder_add(&builder, "{sv}", "sent", g_variant_builder_end(&types));
+
+    return g_variant_builder_end(&builder);
+}
+
 /* coroutine context */
 static void *spice_channel_coroutine(void *data)
 {
@@ -2337,12 +3247,16 @@ static void *spice_channel_coroutine(void *data)
     SpiceChannelPrivate *c = channel->priv;
     guint verify;
     int rc, delay_val = 1;
+    gint64 handshake_start;
     /* When some other SSL/TLS version becomes obsolete, add it to this
      * variable. */
     long ssl_options = SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3;
 
     CHANNEL_DEBUG(channel, "Started background coroutine %p", &c->coroutine);
 
+    memset(c->connect_times, 0, sizeof(c->connect_times));
+    spice_channel_set_connect_time(channel, SPICE_CHANNEL_TIME_START);
+
     if (spice_session_get_client_provided_socket(c->session)) {
         if (c->fd < 0) {
             g_critical("fd not provided!");
@@ -2365,6 +3279,8 @@ static void *spice_channel_coroutine(void *data)
 
 reconnect:
     c->conn = spice_session_channel_open_host(c->session, channel, &c->tls, &c->error);
+    if (c->conn != NULL)
+        spice_channel_set_connect_time(channel, SPICE_CHANNEL_TIME_CONNECTED);
     if (c->conn == NULL) {
         if (!c->error && !c->tls) {
             CHANNEL_DEBUG(channel, "trying with TLS port");
@@ -2387,6 +3303,9 @@ reconnect:
         }
 
         SSL_CTX_set_options(c->ctx, ssl_options);
+        SSL_CTX_set_session_cache_mode(c->ctx, SSL_SESS_CACHE_CLIENT |
+                                       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        SSL_CTX_sess_set_new_cb(c->ctx, spice_channel_new_tls_session);
 
         verify = spice_session_get_verify(c->session);
         if (verify &
@@ -2423,6 +3342,14 @@ reconnect:
 
         BIO *bio = bio_new_giostream(G_IO_STREAM(c->conn));
         SSL_set_bio(c->ssl, bio, bio);
+        SSL_set_ex_data(c->ssl, ssl_channel_index, channel);
+
+        {
+            /* resume the session of a previously connected channel */
+            SSL_SESSION *tls_session = spice_session_get_tls_session(c->session);
+            if (tls_session != NULL)
+                SSL_set_session(c->ssl, tls_session);
+        }
 
         {
             guint8 *pubkey;
@@ -2435,6 +3362,7 @@ reconnect:
                 spice_session_get_cert_subject(c->session));
         }
 
+        handshake_start = g_get_monotonic_time();
 ssl_reconnect:
         rc = SSL_connect(c->ssl);
         if (rc <= 0) {
@@ -2449,6 +3377,11 @@ ssl_reconnect:
                 goto cleanup;
             }
         }
+        c->tls_handshake_time = g_get_monotonic_time() - handshake_start;
+        spice_channel_set_connect_time(channel, SPICE_CHANNEL_TIME_TLS);
+        CHANNEL_DEBUG(channel, "TLS handshake done in %.3f ms%s",
+                      c->tls_handshake_time / 1000.0,
+                      SSL_session_reused(c->ssl) ? " (resumed)" : "");
     }
 
 connected:
@@ -2469,8 +3402,10 @@ connected:
 
     spice_channel_send_link(channel);
     if (!spice_channel_recv_link_hdr(channel) ||
-        !spice_channel_recv_link_msg(channel) ||
-        !spice_channel_recv_auth(channel))
+        !spice_channel_recv_link_msg(channel))
+        goto cleanup;
+    spice_channel_set_connect_time(channel, SPICE_CHANNEL_TIME_LINKED);
+    if (!spice_channel_recv_auth(channel))
         goto cleanup;
 
     while (spice_channel_iterate(channel))
@@ -2646,6 +3581,19 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
 
     g_clear_object(&c->sock);
 
+    c->recv_buf_pos = c->recv_buf_len = 0;
+    spice_channel_reset_acks(channel);
+    c->acks_early = TRUE;
+    c->window_limited = 256;
+    c->burst_start = 0;
+    c->burst_bytes = 0;
+    if (c->capture)
+        spice_capture_flush(c->capture);
+    if (c->total_read_msgs)
+        CHANNEL_DEBUG(channel, "%" G_GUINT64_FORMAT " reads for %" G_GUINT64_FORMAT
+                      " messages (%.2f reads/message)", c->total_read_calls,
+                      c->total_read_msgs, (double)c->total_read_calls / c->total_read_msgs);
+
     c->fd = -1;
 
     c->auth_needs_username = FALSE;
@@ -2657,9 +3605,8 @@ static void channel_reset(SpiceChannel *channel, gboolean migrating)
 
     STATIC_MUTEX_LOCK(c->xmit_queue_lock);
     c->xmit_queue_blocked = TRUE; /* Disallow queuing new messages */
-    gboolean was_empty = g_queue_is_empty(&c->xmit_queue);
-    g_queue_foreach(&c->xmit_queue, (GFunc)spice_msg_out_unref, NULL);
-    g_queue_clear(&c->xmit_queue);
+    gboolean was_empty = xmit_queue_is_empty(&c->xmit_queue);
+    xmit_queue_clear(&c->xmit_queue);
     if (c->xmit_queue_wakeup_id) {
         g_source_remove(c->xmit_queue_wakeup_id);
         c->xmit_queue_wakeup_id = 0;
@@ -2844,15 +3791,46 @@ enum spice_channel_state spice_channel_get_state(SpiceChannel *channel)
 
 G_GNUC_INTERNAL
 guint64 spice_channel_get_queue_size (SpiceChannel *channel)
+{
+    guint64 size = 0;
+    SpiceChannelPrivate *c = channel->priv;
+    int i;
+
+    STATIC_MUTEX_LOCK(c->xmit_queue_lock);
+    for (i = 0; i < SPICE_MSG_OUT_N_PRIORITIES; i++)
+        size += c->xmit_queue.sizes[i];
+    STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
+    return size;
+}
+
+G_GNUC_INTERNAL
+guint64 spice_channel_get_lane_queue_size(SpiceChannel *channel, SpiceMsgOutPriority priority)
 {
     guint64 size;
     SpiceChannelPrivate *c = channel->priv;
+
+    g_return_val_if_fail(priority < SPICE_MSG_OUT_N_PRIORITIES, 0);
+
     STATIC_MUTEX_LOCK(c->xmit_queue_lock);
-    size = c->xmit_queue_size;
+    size = c->xmit_queue.sizes[priority];
     STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
     return size;
 }
 
+G_GNUC_INTERNAL
+guint spice_channel_get_lane_queue_length(SpiceChannel *channel, SpiceMsgOutPriority priority)
+{
+    guint length;
+    SpiceChannelPrivate *c = channel->priv;
+
+    g_return_val_if_fail(priority < SPICE_MSG_OUT_N_PRIORITIES, 0);
+
+    STATIC_MUTEX_LOCK(c->xmit_queue_lock);
+    length = g_queue_get_length(&c->xmit_queue.lanes[priority]);
+    STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
+    return length;
+}
+
 G_GNUC_INTERNAL
 void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap_msgs)
 {
@@ -2877,6 +3855,9 @@ void spice_channel_swap(SpiceChannel *channel, SpiceChannel *swap, gboolean swap
     SWAP(conn);
     SWAP(in);
     SWAP(out);
+    SWAP(recv_buf);
+    SWAP(recv_buf_pos);
+    SWAP(recv_buf_len);
     SWAP(ctx);
     SWAP(ssl);
     SWAP(sslverify);
@@ -2974,7 +3955,7 @@ void spice_channel_flush_async(SpiceChannel *self, GCancellable *cancellable,
                                        spice_channel_flush_async);
 
     STATIC_MUTEX_LOCK(c->xmit_queue_lock);
-    was_empty = g_queue_is_empty(&c->xmit_queue);
+    was_empty = xmit_queue_is_empty(&c->xmit_queue);
     STATIC_MUTEX_UNLOCK(c->xmit_queue_lock);
     if (was_empty) {
         g_simple_async_result_set_op_res_gboolean(simple, TRUE);
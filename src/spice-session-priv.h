@@ -22,6 +22,7 @@
 
 #include <glib.h>
 #include <gio/gio.h>
+#include <openssl/ssl.h>
 
 #ifdef USE_PHODAV
 #include <libphodav/phodav.h>
@@ -29,11 +30,13 @@
 typedef struct _PhodavServer PhodavServer;
 #endif
 
+#include "common/messages.h"
 #include "desktop-integration.h"
 #include "spice-session.h"
 #include "spice-gtk-session.h"
 #include "spice-channel-cache.h"
 #include "decode.h"
+#include "gio-coroutine.h"
 
 G_BEGIN_DECLS
 
@@ -49,6 +52,11 @@ GSocketConnection* spice_session_channel_open_host(SpiceSession *session, SpiceC
                                                    gboolean *use_tls, GError **error);
 void spice_session_channel_new(SpiceSession *session, SpiceChannel *channel);
 void spice_session_channel_migrate(SpiceSession *session, SpiceChannel *channel);
+void spice_session_channels_new(SpiceSession *session,
+                                const SpiceChannelId *channels, guint n_channels);
+void spice_session_channel_timeline(SpiceSession *session, SpiceChannel *channel);
+guint64 spice_session_rtt_sample(SpiceSession *session, gint64 rtt);
+void spice_session_bandwidth_sample(SpiceSession *session, guint64 bytes, gint64 duration);
 
 void spice_session_set_mm_time(SpiceSession *session, guint32 time);
 guint32 spice_session_get_mm_time(SpiceSession *session);
@@ -69,12 +77,15 @@ const gchar* spice_session_get_cert_subject(SpiceSession *session);
 const gchar* spice_session_get_ciphers(SpiceSession *session);
 const gchar* spice_session_get_ca_file(SpiceSession *session);
 void spice_session_get_ca(SpiceSession *session, guint8 **ca, guint *size);
+SSL_SESSION* spice_session_get_tls_session(SpiceSession *session);
+void spice_session_set_tls_session(SpiceSession *session, SSL_SESSION *tls_session);
 
 void spice_session_set_caches_hints(SpiceSession *session,
                                     uint32_t pci_ram_size,
                                     uint32_t n_display_channels);
 void spice_session_get_caches(SpiceSession *session,
                               display_cache **images,
+                              GCoroutineWaitQueue **images_waiters,
                               SpiceGlzDecoderWindow **glz_window);
 void spice_session_palettes_clear(SpiceSession *session);
 void spice_session_images_clear(SpiceSession *session);
@@ -34,7 +34,9 @@
 #include "wocky-http-proxy.h"
 #include "spice-uri-priv.h"
 #include "channel-playback-priv.h"
+#include "channel-display-priv.h"
 #include "spice-audio.h"
+#include "spice-marshal.h"
 
 struct channel {
     SpiceChannel      *channel;
@@ -44,6 +46,19 @@ struct channel {
 #define IMAGES_CACHE_SIZE_DEFAULT (1024 * 1024 * 80)
 #define MIN_GLZ_WINDOW_SIZE_DEFAULT (1024 * 1024 * 12)
 #define MAX_GLZ_WINDOW_SIZE_DEFAULT MIN((LZ_MAX_WINDOW_SIZE * 4), 1024 * 1024 * 64)
+/* the images cache grows by this for each additional display */
+#define IMAGES_CACHE_SIZE_PER_DISPLAY (1024 * 1024 * 20)
+#define MIN_IMAGES_CACHE_SIZE (1024 * 1024 * 16)
+
+/* memory pressure, as the share of time tasks were stalled on memory
+ * over the last 10 seconds, in percents */
+#define MEMORY_PRESSURE_MODERATE 10.0
+#define MEMORY_PRESSURE_CRITICAL 40.0
+#define MEMORY_CHECK_INTERVAL 5 /* seconds */
+
+/* the round trip is the smallest of the last samples, which are all
+ * upper bounds of it */
+#define RTT_SAMPLES 16
 
 struct _SpiceSessionPrivate {
     char              *host;
@@ -57,6 +72,9 @@ struct _SpiceSessionPrivate {
     GByteArray        *pubkey;
     GByteArray        *ca;
     char              *cert_subject;
+    SSL_SESSION       *tls_session; /* shared by all channels for resumption */
+    char              *tls_session_peer;
+    GInetAddress      *host_address; /* resolved by the main channel */
     guint             verify;
     gboolean          read_only;
     SpiceURI          *proxy;
@@ -109,16 +127,31 @@ struct _SpiceSessionPrivate {
     gboolean          for_migration;
 
     display_cache     *images;
+    GCoroutineWaitQueue *images_waiters;
     display_cache     *palettes;
     SpiceGlzDecoderWindow *glz_window;
     int               images_cache_size;
     int               glz_window_size;
+    gboolean          images_cache_size_set; /* by the user */
+    gboolean          glz_window_size_set; /* by the user */
+    guint64           image_cache_limit; /* as set by the user */
+    guint64           memory_budget;
+    SpiceSessionMemoryPressure memory_pressure;
+    guint             memory_check_id;
     uint32_t          pci_ram_size;
     uint32_t          n_display_channels;
     guint8            uuid[16];
     gchar             *name;
     SpiceImageCompression preferred_compression;
 
+    /* link estimations, in us and bytes/s, smoothed */
+    gint64            rtt_samples[RTT_SAMPLES];
+    guint             rtt_sample;
+    guint64           rtt;
+    guint64           rtt_notified;
+    guint64           bandwidth;
+    guint64           bandwidth_notified;
+
     /* associated objects */
     SpiceAudio        *audio_manager;
     SpiceUsbDeviceManager *usb_manager;
@@ -205,6 +238,15 @@ enum {
     PROP_USERNAME,
     PROP_UNIX_PATH,
     PROP_PREF_COMPRESSION,
+    PROP_IMAGE_CACHE_LIMIT,
+    PROP_IMAGE_CACHE_STATS,
+    PROP_MEMORY_BUDGET,
+    PROP_MEMORY_PRESSURE,
+    PROP_IMAGE_CACHE_BYTES,
+    PROP_GLZ_WINDOW_BYTES,
+    PROP_SURFACES_BYTES,
+    PROP_RTT,
+    PROP_BANDWIDTH,
 };
 
 /* signals */
@@ -212,6 +254,7 @@ enum {
     SPICE_SESSION_CHANNEL_NEW,
     SPICE_SESSION_CHANNEL_DESTROY,
     SPICE_SESSION_MM_TIME_RESET,
+    SPICE_SESSION_CHANNEL_TIMELINE,
     SPICE_SESSION_LAST_SIGNAL,
 };
 
@@ -250,6 +293,7 @@ spice_image_compress_get_type (void)
 static guint signals[SPICE_SESSION_LAST_SIGNAL];
 
 static void spice_session_channel_destroy(SpiceSession *session, SpiceChannel *channel);
+static void memory_check_stop(SpiceSession *session);
 
 static void update_proxy(SpiceSession *self, const gchar *str)
 {
@@ -278,6 +322,11 @@ static void update_proxy(SpiceSession *self, const gchar *str)
     }
 }
 
+static gsize image_size(pixman_image_t *image)
+{
+    return (gsize)pixman_image_get_stride(image) * pixman_image_get_height(image);
+}
+
 static void spice_session_init(SpiceSession *session)
 {
     SpiceSessionPrivate *s;
@@ -291,7 +340,9 @@ static void spice_session_init(SpiceSession *session)
     g_free(channels);
 
     ring_init(&s->channels);
-    s->images = cache_image_new((GDestroyNotify)pixman_image_unref);
+    s->images = cache_image_new((GDestroyNotify)pixman_image_unref,
+                                (display_cache_size_func)image_size);
+    s->images_waiters = g_coroutine_wait_queue_new();
     s->glz_window = glz_decoder_window_new();
     update_proxy(session, NULL);
 }
@@ -318,6 +369,9 @@ session_disconnect(SpiceSession *self, gboolean keep_main)
 
     s->connection_id = 0;
 
+    spice_session_set_tls_session(self, NULL);
+    g_clear_object(&s->host_address);
+
     g_free(s->name);
     s->name = NULL;
     memset(s->uuid, 0, sizeof(s->uuid));
@@ -330,10 +384,14 @@ spice_session_dispose(GObject *gobject)
 {
     SpiceSession *session = SPICE_SESSION(gobject);
     SpiceSessionPrivate *s = session->priv;
+    SpiceCapture *capture = spice_capture_get();
 
     SPICE_DEBUG("session dispose");
 
     session_disconnect(session, FALSE);
+    memory_check_stop(session);
+    if (capture != NULL)
+        spice_capture_flush(capture);
 
     g_warn_if_fail(s->migration == NULL);
     g_warn_if_fail(s->migration_left == NULL);
@@ -373,10 +431,12 @@ spice_session_finalize(GObject *gobject)
     g_free(s->shared_dir);
 
     g_clear_pointer(&s->images, cache_free);
+    g_clear_pointer(&s->images_waiters, g_coroutine_wait_queue_free);
     glz_decoder_window_destroy(s->glz_window);
 
     g_clear_pointer(&s->pubkey, g_byte_array_unref);
     g_clear_pointer(&s->ca, g_byte_array_unref);
+    spice_session_set_tls_session(session, NULL);
 
     /* Chain up to the parent class */
     if (G_OBJECT_CLASS(spice_session_parent_class)->finalize)
@@ -584,6 +644,218 @@ fail:
     return -1;
 }
 
+/* ------------------------------------------------------------------ */
+/* memory governor                                                    */
+
+#ifdef __linux__
+/* the cgroup v2 directory of this process, if any */
+static gchar *get_cgroup_dir(void)
+{
+    gchar *contents, *dir = NULL;
+    gchar **lines, **line;
+
+    if (!g_file_get_contents("/proc/self/cgroup", &contents, NULL, NULL))
+        return NULL;
+
+    lines = g_strsplit(contents, "\n", -1);
+    for (line = lines; *line != NULL; line++) {
+        if (g_str_has_prefix(*line, "0::")) {
+            dir = g_build_filename("/sys/fs/cgroup", *line + 3, NULL);
+            break;
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    return dir;
+}
+
+static guint64 read_cgroup_value(const gchar *dir, const gchar *name)
+{
+    gchar *path = g_build_filename(dir, name, NULL);
+    gchar *contents;
+    guint64 value = 0;
+
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        /* "max" when there is no limit */
+        value = g_ascii_strtoull(contents, NULL, 10);
+        g_free(contents);
+    }
+    g_free(path);
+
+    return value;
+}
+
+static guint64 read_meminfo_value(const gchar *contents, const gchar *name)
+{
+    const gchar *p = strstr(contents, name);
+
+    if (p == NULL)
+        return 0;
+
+    /* in kB */
+    return g_ascii_strtoull(p + strlen(name), NULL, 10) * 1024;
+}
+#endif
+
+/* the memory the client could still use, 0 if unknown */
+static guint64 get_available_memory(void)
+{
+    guint64 available = 0;
+#ifdef __linux__
+    gchar *contents, *dir;
+
+    if (g_file_get_contents("/proc/meminfo", &contents, NULL, NULL)) {
+        available = read_meminfo_value(contents, "MemAvailable:");
+        g_free(contents);
+    }
+
+    dir = get_cgroup_dir();
+    if (dir != NULL) {
+        guint64 max = read_cgroup_value(dir, "memory.max");
+        guint64 current = read_cgroup_value(dir, "memory.current");
+
+        if (max != 0 && max > current)
+            available = available ? MIN(available, max - current) : max - current;
+        g_free(dir);
+    }
+#endif
+    return available;
+}
+
+/* the "some" avg10 pressure in percents, or -1 if unknown */
+static gdouble get_memory_pressure(void)
+{
+    gdouble pressure = -1;
+#ifdef __linux__
+    gchar *contents = NULL, *dir, *path;
+    const gchar *p;
+
+    /* prefer the cgroup pressure, which accounts for its limit */
+    dir = get_cgroup_dir();
+    if (dir != NULL) {
+        path = g_build_filename(dir, "memory.pressure", NULL);
+        g_file_get_contents(path, &contents, NULL, NULL);
+        g_free(path);
+        g_free(dir);
+    }
+    if (contents == NULL)
+        g_file_get_contents("/proc/pressure/memory", &contents, NULL, NULL);
+    if (contents == NULL)
+        return -1;
+
+    p = strstr(contents, "some avg10=");
+    if (p != NULL)
+        pressure = g_ascii_strtod(p + strlen("some avg10="), NULL);
+    g_free(contents);
+#endif
+    return pressure;
+}
+
+static guint64 get_surfaces_bytes(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+    struct channel *item;
+    RingItem *ring;
+    guint64 bytes = 0;
+
+    for (ring = ring_get_head(&s->channels); ring != NULL;
+         ring = ring_next(&s->channels, ring)) {
+        item = SPICE_CONTAINEROF(ring, struct channel, link);
+        if (SPICE_IS_DISPLAY_CHANNEL(item->channel))
+            bytes += spice_display_channel_get_surfaces_size(SPICE_DISPLAY_CHANNEL(item->channel));
+    }
+
+    return bytes;
+}
+
+/* The server counts on every image it sent within the cache size
+ * advertised in the display init, dropping one behind its back breaks
+ * the draws referencing it. So only the user sets a lower limit, and
+ * under memory pressure the images it sent beyond the advertised size
+ * are no longer kept. */
+static void update_image_cache_limit(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+    guint64 limit = s->image_cache_limit;
+
+    if (s->memory_pressure != SPICE_SESSION_MEMORY_PRESSURE_NONE &&
+        s->images_cache_size > 0)
+        limit = limit ? MIN(limit, (guint64)s->images_cache_size) : (guint64)s->images_cache_size;
+
+    SPICE_DEBUG("image cache limit: %" G_GUINT64_FORMAT " bytes", limit);
+    cache_set_max_bytes(s->images, limit);
+}
+
+/* what is left of the budget for the surfaces, once the caches got
+ * their share */
+static guint64 get_surfaces_allowance(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+    guint64 caches = (guint64)MAX(s->images_cache_size, 0) + MAX(s->glz_window_size, 0);
+
+    return s->memory_budget > caches ? s->memory_budget - caches : 0;
+}
+
+static gboolean memory_check(gpointer data)
+{
+    SpiceSession *session = data;
+    SpiceSessionPrivate *s = session->priv;
+    SpiceSessionMemoryPressure level = SPICE_SESSION_MEMORY_PRESSURE_NONE;
+    gdouble pressure = get_memory_pressure();
+
+    if (pressure < 0) {
+        SPICE_DEBUG("memory pressure is not available");
+        s->memory_check_id = 0;
+        return FALSE;
+    }
+
+    if (pressure >= MEMORY_PRESSURE_CRITICAL)
+        level = SPICE_SESSION_MEMORY_PRESSURE_CRITICAL;
+    else if (pressure >= MEMORY_PRESSURE_MODERATE)
+        level = SPICE_SESSION_MEMORY_PRESSURE_MODERATE;
+
+    if (level != s->memory_pressure) {
+        SPICE_DEBUG("memory pressure %.2f%%, level %d -> %d",
+                    pressure, s->memory_pressure, level);
+        s->memory_pressure = level;
+        update_image_cache_limit(session);
+        g_object_notify(G_OBJECT(session), "memory-pressure");
+    }
+
+    /* the surfaces can't be refused, only reported */
+    if (level != SPICE_SESSION_MEMORY_PRESSURE_NONE && s->memory_budget != 0) {
+        guint64 surfaces = get_surfaces_bytes(session);
+        guint64 allowance = get_surfaces_allowance(session);
+
+        if (surfaces > allowance)
+            SPICE_DEBUG("surfaces use %" G_GUINT64_FORMAT " bytes, over the %"
+                        G_GUINT64_FORMAT " bytes allowance", surfaces, allowance);
+    }
+
+    return TRUE;
+}
+
+static void memory_check_stop(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+
+    if (s->memory_check_id != 0) {
+        g_source_remove(s->memory_check_id);
+        s->memory_check_id = 0;
+    }
+}
+
+static void memory_check_start(SpiceSession *session)
+{
+    SpiceSessionPrivate *s = session->priv;
+
+    if (s->memory_check_id != 0)
+        return;
+
+    s->memory_check_id = g_timeout_add_seconds(MEMORY_CHECK_INTERVAL, memory_check, session);
+}
+
 static void spice_session_get_property(GObject    *gobject,
                                        guint       prop_id,
                                        GValue     *value,
@@ -695,6 +967,44 @@ static void spice_session_get_property(GObject    *gobject,
     case PROP_PREF_COMPRESSION:
         g_value_set_enum(value, s->preferred_compression);
         break;
+    case PROP_IMAGE_CACHE_LIMIT:
+        g_value_set_uint64(value, s->image_cache_limit);
+        break;
+    case PROP_MEMORY_BUDGET:
+        g_value_set_uint64(value, s->memory_budget);
+        break;
+    case PROP_MEMORY_PRESSURE:
+        g_value_set_enum(value, s->memory_pressure);
+        break;
+    case PROP_IMAGE_CACHE_BYTES:
+        g_value_set_uint64(value, s->images->stats.bytes);
+        break;
+    case PROP_GLZ_WINDOW_BYTES:
+        g_value_set_uint64(value, glz_decoder_window_get_bytes(s->glz_window));
+        break;
+    case PROP_SURFACES_BYTES:
+        g_value_set_uint64(value, get_surfaces_bytes(session));
+        break;
+    case PROP_RTT:
+        g_value_set_uint64(value, s->rtt);
+        break;
+    case PROP_BANDWIDTH:
+        g_value_set_uint64(value, s->bandwidth);
+        break;
+    case PROP_IMAGE_CACHE_STATS: {
+        display_cache_stats stats;
+        GVariantBuilder builder;
+
+        cache_get_stats(s->images, &stats);
+        g_variant_builder_init(&builder, G_VARIANT_TYPE("a{st}"));
+        g_variant_builder_add(&builder, "{st}", "hits", stats.hits);
+        g_variant_builder_add(&builder, "{st}", "misses", stats.misses);
+        g_variant_builder_add(&builder, "{st}", "evictions", stats.evictions);
+        g_variant_builder_add(&builder, "{st}", "bytes", (guint64)stats.bytes);
+        g_variant_builder_add(&builder, "{st}", "items", (guint64)stats.items);
+        g_value_set_variant(value, g_variant_builder_end(&builder));
+        break;
+    }
     default:
 	G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
 	break;
@@ -814,9 +1124,11 @@ static void spice_session_set_property(GObject      *gobject,
         break;
     case PROP_CACHE_SIZE:
         s->images_cache_size = g_value_get_int(value);
+        s->images_cache_size_set = s->images_cache_size != 0;
         break;
     case PROP_GLZ_WINDOW_SIZE:
         s->glz_window_size = g_value_get_int(value);
+        s->glz_window_size_set = s->glz_window_size != 0;
         break;
     case PROP_CA:
         g_clear_pointer(&s->ca, g_byte_array_unref);
@@ -834,6 +1146,10 @@ static void spice_session_set_property(GObject      *gobject,
     case PROP_PREF_COMPRESSION:
         s->preferred_compression = g_value_get_enum(value);
         break;
+    case PROP_IMAGE_CACHE_LIMIT:
+        s->image_cache_limit = g_value_get_uint64(value);
+        update_image_cache_limit(session);
+        break;
     default:
         G_OBJECT_WARN_INVALID_PROPERTY_ID(gobject, prop_id, pspec);
         break;
@@ -1313,6 +1629,30 @@ static void spice_session_class_init(SpiceSessionClass *klass)
                      G_TYPE_NONE,
                      0);
 
+    /**
+     * SpiceSession::channel-timeline:
+     * @session: the session that emitted the signal
+     * @channel: the #SpiceChannel that got connected
+     * @timeline: the connection timeline of @channel
+     *
+     * The #SpiceSession::channel-timeline signal is emitted when a
+     * channel receives its first message after connecting. @timeline
+     * is the same dictionary as returned by
+     * spice_channel_get_connect_timeline().
+     *
+     * Since: 0.31
+     **/
+    signals[SPICE_SESSION_CHANNEL_TIMELINE] =
+        g_signal_new("channel-timeline",
+                     G_OBJECT_CLASS_TYPE(gobject_class),
+                     G_SIGNAL_RUN_FIRST,
+                     0, NULL, NULL,
+                     g_cclosure_user_marshal_VOID__OBJECT_VARIANT,
+                     G_TYPE_NONE,
+                     2,
+                     SPICE_TYPE_CHANNEL,
+                     G_TYPE_VARIANT);
+
     /**
      * SpiceSession:read-only:
      *
@@ -1461,6 +1801,178 @@ static void spice_session_class_init(SpiceSessionClass *klass)
                            G_PARAM_READWRITE |
                            G_PARAM_STATIC_STRINGS));
 
+    /**
+     * SpiceSession:image-cache-limit:
+     *
+     * Maximum memory used by the decoded images cache, in bytes. The
+     * cache size advertised to the server is clamped to it, so it takes
+     * effect on the display channels connected afterwards. Should the
+     * cache still go over it, the least recently used images are
+     * dropped, and the draws the server later sends referencing them
+     * are rendered wrong. If 0, the cache is only bounded by
+     * #SpiceSession:cache-size, as accounted by the server.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_IMAGE_CACHE_LIMIT,
+         g_param_spec_uint64("image-cache-limit",
+                             "Image cache limit",
+                             "Maximum image cache memory (bytes)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READWRITE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:image-cache-stats:
+     *
+     * Image cache counters, as a dictionary of 64 bits unsigned
+     * integers: "hits", "misses", "evictions", "bytes" and "items".
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_IMAGE_CACHE_STATS,
+         g_param_spec_variant("image-cache-stats",
+                              "Image cache statistics",
+                              "Image cache counters",
+                              G_VARIANT_TYPE("a{st}"),
+                              NULL,
+                              G_PARAM_READABLE |
+                              G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:memory-budget:
+     *
+     * The memory the session allows itself to use, in bytes, from the
+     * client available memory when connecting. It sizes
+     * #SpiceSession:cache-size and #SpiceSession:glz-window-size on
+     * each connection when they are not set, what is left being for
+     * the surfaces. 0 if the available memory is unknown.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MEMORY_BUDGET,
+         g_param_spec_uint64("memory-budget",
+                             "Memory budget",
+                             "Memory the session may use (bytes)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:memory-pressure:
+     *
+     * The client memory pressure, checked periodically while connected
+     * where the system reports it. Under pressure, the images cache
+     * no longer keeps the images sent beyond #SpiceSession:cache-size.
+     * What the server accounts for can't be shrunk while connected,
+     * the application may react to it, or lower #SpiceSession:cache-size
+     * and #SpiceSession:glz-window-size for the next connection.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_MEMORY_PRESSURE,
+         g_param_spec_enum("memory-pressure",
+                           "Memory pressure",
+                           "Client memory pressure",
+                           SPICE_TYPE_SESSION_MEMORY_PRESSURE,
+                           SPICE_SESSION_MEMORY_PRESSURE_NONE,
+                           G_PARAM_READABLE |
+                           G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:image-cache-bytes:
+     *
+     * The memory currently used by the images cache, in bytes.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_IMAGE_CACHE_BYTES,
+         g_param_spec_uint64("image-cache-bytes",
+                             "Image cache bytes",
+                             "Memory used by the images cache",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:glz-window-bytes:
+     *
+     * The memory currently used by the glz dictionary window, in bytes.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_GLZ_WINDOW_BYTES,
+         g_param_spec_uint64("glz-window-bytes",
+                             "Glz window bytes",
+                             "Memory used by the glz window",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:surfaces-bytes:
+     *
+     * The memory currently used by the display surfaces, primary and
+     * off-screen, of all the display channels, in bytes.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_SURFACES_BYTES,
+         g_param_spec_uint64("surfaces-bytes",
+                             "Surfaces bytes",
+                             "Memory used by the display surfaces",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:rtt:
+     *
+     * The estimated round trip time to the server, in microseconds, 0
+     * until known. It is measured on the channels the server asks to
+     * acknowledge messages, mainly the display, from the time between
+     * an ack and the messages the server could only send after getting
+     * it. Notifications are only emitted for significant changes.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_RTT,
+         g_param_spec_uint64("rtt",
+                             "Round trip time",
+                             "Estimated round trip time to the server (us)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
+    /**
+     * SpiceSession:bandwidth:
+     *
+     * The estimated bandwidth from the server, in bytes per second, 0
+     * until known. It is measured from the rate data comes in during
+     * bursts of traffic, so it is the rate the client gets, which is
+     * below the link capacity when the server or the client are the
+     * bottleneck. Notifications are only emitted for significant
+     * changes.
+     *
+     * Since: 0.31
+     **/
+    g_object_class_install_property
+        (gobject_class, PROP_BANDWIDTH,
+         g_param_spec_uint64("bandwidth",
+                             "Bandwidth",
+                             "Estimated bandwidth from the server (bytes/s)",
+                             0, G_MAXUINT64, 0,
+                             G_PARAM_READABLE |
+                             G_PARAM_STATIC_STRINGS));
+
     g_type_class_add_private(klass, sizeof(SpiceSessionPrivate));
 }
 
@@ -1565,6 +2077,7 @@ gboolean spice_session_connect(SpiceSession *session)
     session_disconnect(session, TRUE);
 
     s->client_provided_sockets = FALSE;
+    g_clear_object(&s->host_address);
 
     if (s->cmain == NULL)
         s->cmain = spice_channel_new(session, SPICE_CHANNEL_MAIN, 0);
@@ -1797,7 +2310,7 @@ void spice_session_channel_migrate(SpiceSession *session, SpiceChannel *channel)
     c = spice_session_lookup_channel(s->migration, id, type);
     g_return_if_fail(c != NULL);
 
-    if (!g_queue_is_empty(&c->priv->xmit_queue) && s->full_migration) {
+    if (spice_channel_get_queue_size(c) > 0 && s->full_migration) {
         CHANNEL_DEBUG(channel, "mig channel xmit queue is not empty. type %s", c->priv->name);
     }
     spice_channel_swap(channel, c, !s->full_migration);
@@ -1940,6 +2453,8 @@ void spice_session_disconnect(SpiceSession *session)
     if (s->disconnecting != 0)
         return;
 
+    memory_check_stop(session);
+
     g_object_ref(session);
     s->disconnecting = g_idle_add((GSourceFunc)session_disconnect_idle, session);
 }
@@ -2021,8 +2536,21 @@ struct spice_open_host {
     GError *error;
     GSocketConnection *connection;
     GSocketClient *client;
+    gboolean cached_address;
 };
 
+/* main context */
+static GSocketConnectable *open_host_network_address(spice_open_host *open_host)
+{
+    SpiceSessionPrivate *s = open_host->session->priv;
+
+    open_host->cached_address = FALSE;
+    SPICE_DEBUG("open host %s:%d", s->host, open_host->port);
+    return g_network_address_new(s->host, open_host->port);
+}
+
+static void open_host_connectable_connect(spice_open_host *open_host, GSocketConnectable *connectable);
+
 static void socket_client_connect_ready(GObject *source_object, GAsyncResult *result,
                                         gpointer data)
 {
@@ -2034,6 +2562,20 @@ static void socket_client_connect_ready(GObject *source_object, GAsyncResult *re
     connection = g_socket_client_connect_finish(client, result, &open_host->error);
     if (connection == NULL) {
         g_warn_if_fail(open_host->error != NULL);
+        if (open_host->cached_address &&
+            !g_error_matches(open_host->error, G_IO_ERROR, G_IO_ERROR_CANCELLED)) {
+            GSocketConnectable *address;
+
+            /* the host may have moved, resolve it again */
+            CHANNEL_DEBUG(open_host->channel, "cached address failed: %s",
+                          open_host->error->message);
+            g_clear_error(&open_host->error);
+            g_clear_object(&open_host->session->priv->host_address);
+            address = open_host_network_address(open_host);
+            open_host_connectable_connect(open_host, address);
+            g_object_unref(address);
+            return;
+        }
         goto end;
     }
 
@@ -2123,9 +2665,17 @@ static gboolean open_host_idle_cb(gpointer data)
             g_set_error_literal(&open_host->error, SPICE_CLIENT_ERROR, SPICE_CLIENT_ERROR_FAILED,
                                 "Unix path unsupported on this platform");
 #endif
+        } else if (s->host_address != NULL && open_host->channel != s->cmain) {
+            /* secondary channels reuse the address resolved by the main channel */
+            gchar *str = g_inet_address_to_string(s->host_address);
+            SPICE_DEBUG("open host %s:%d (cached %s)", s->host, open_host->port, str);
+            g_free(str);
+            address = G_SOCKET_CONNECTABLE(g_inet_socket_address_new(s->host_address,
+                                                                     open_host->port));
+            open_host->cached_address = TRUE;
+            spice_channel_set_connect_time(open_host->channel, SPICE_CHANNEL_TIME_RESOLVED);
         } else {
-            SPICE_DEBUG("open host %s:%d", s->host, open_host->port);
-            address = g_network_address_new(s->host, open_host->port);
+            address = open_host_network_address(open_host);
         }
 
         if (address == NULL || open_host->error != NULL) {
@@ -2146,6 +2696,38 @@ static gboolean open_host_idle_cb(gpointer data)
     return FALSE;
 }
 
+#if GLIB_CHECK_VERSION(2, 32, 0)
+/* main context */
+static void socket_client_event(GSocketClient *client, GSocketClientEvent event,
+                                GSocketConnectable *connectable,
+                                GIOStream *connection, gpointer data)
+{
+    spice_open_host *open_host = data;
+
+    if (event == G_SOCKET_CLIENT_RESOLVED)
+        spice_channel_set_connect_time(open_host->channel, SPICE_CHANNEL_TIME_RESOLVED);
+}
+#endif
+
+/* remember where the main channel got connected, to spare the
+ * secondary channels a name resolution */
+static void session_set_host_address(SpiceSession *session, GSocketConnection *connection)
+{
+    SpiceSessionPrivate *s = session->priv;
+    GSocketAddress *address;
+
+    address = g_socket_connection_get_remote_address(connection, NULL);
+    if (address == NULL)
+        return;
+
+    if (G_IS_INET_SOCKET_ADDRESS(address)) {
+        g_clear_object(&s->host_address);
+        s->host_address =
+            g_object_ref(g_inet_socket_address_get_address(G_INET_SOCKET_ADDRESS(address)));
+    }
+    g_object_unref(address);
+}
+
 #define SOCKET_TIMEOUT 10
 
 /* coroutine context */
@@ -2199,6 +2781,9 @@ GSocketConnection* spice_session_channel_open_host(SpiceSession *session, SpiceC
     open_host.client = g_socket_client_new();
     g_socket_client_set_enable_proxy(open_host.client, s->proxy != NULL);
     g_socket_client_set_timeout(open_host.client, SOCKET_TIMEOUT);
+#if GLIB_CHECK_VERSION(2, 32, 0)
+    g_signal_connect(open_host.client, "event", G_CALLBACK(socket_client_event), &open_host);
+#endif
 
     g_idle_add(open_host_idle_cb, &open_host);
     /* switch to main loop and wait for connection */
@@ -2213,6 +2798,9 @@ GSocketConnection* spice_session_channel_open_host(SpiceSession *session, SpiceC
         g_socket_set_timeout(socket, 0);
         g_socket_set_blocking(socket, FALSE);
         g_socket_set_keepalive(socket, TRUE);
+
+        if (channel == s->cmain && s->proxy == NULL && s->unix_path == NULL)
+            session_set_host_address(session, open_host.connection);
     }
 
     g_clear_object(&open_host.client);
@@ -2220,6 +2808,130 @@ GSocketConnection* spice_session_channel_open_host(SpiceSession *session, SpiceC
 }
 
 
+typedef struct channels_new {
+    SpiceSession *session;
+    SpiceChannelId *channels;
+    guint n_channels;
+} channels_new_t;
+
+/* main context */
+static gboolean channels_new_idle(gpointer data)
+{
+    channels_new_t *c = data;
+    guint i;
+
+    /* create them all at once, so that the connections, started in
+       idle, proceed in parallel */
+    for (i = 0; i < c->n_channels; i++)
+        spice_channel_new(c->session, c->channels[i].type, c->channels[i].id);
+
+    g_object_unref(c->session);
+    g_free(c->channels);
+    g_free(c);
+
+    return FALSE;
+}
+
+/* any context */
+G_GNUC_INTERNAL
+void spice_session_channels_new(SpiceSession *session,
+                                const SpiceChannelId *channels, guint n_channels)
+{
+    channels_new_t *c;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    c = g_new(channels_new_t, 1);
+    c->session = g_object_ref(session);
+    c->channels = g_memdup(channels, n_channels * sizeof(SpiceChannelId));
+    c->n_channels = n_channels;
+    /* no need to explicitely switch to main context, since
+       synchronous call is not needed. */
+    /* no need to track idle, session is refed */
+    g_idle_add(channels_new_idle, c);
+}
+
+/* coroutine context */
+G_GNUC_INTERNAL
+void spice_session_channel_timeline(SpiceSession *session, SpiceChannel *channel)
+{
+    GVariant *timeline;
+    gchar *str;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    timeline = g_variant_ref_sink(spice_channel_get_connect_timeline(channel));
+    str = g_variant_print(timeline, FALSE);
+    CHANNEL_DEBUG(channel, "connect timeline: %s", str);
+    g_free(str);
+
+    g_coroutine_signal_emit(session, signals[SPICE_SESSION_CHANNEL_TIMELINE], 0,
+                            channel, timeline);
+    g_variant_unref(timeline);
+}
+
+/* whether @value moved by more than an eighth since it was last notified */
+static gboolean estimate_changed(guint64 value, guint64 notified)
+{
+    guint64 delta = value > notified ? value - notified : notified - value;
+
+    return notified == 0 || delta > notified / 8;
+}
+
+/* returns the new estimation */
+/* coroutine context */
+G_GNUC_INTERNAL
+guint64 spice_session_rtt_sample(SpiceSession *session, gint64 rtt)
+{
+    SpiceSessionPrivate *s;
+    gint64 min = G_MAXINT64;
+    guint i;
+
+    g_return_val_if_fail(SPICE_IS_SESSION(session), 0);
+    s = session->priv;
+
+    if (rtt <= 0)
+        return s->rtt;
+
+    s->rtt_samples[s->rtt_sample] = rtt;
+    s->rtt_sample = (s->rtt_sample + 1) % RTT_SAMPLES;
+    for (i = 0; i < RTT_SAMPLES; i++) {
+        if (s->rtt_samples[i] > 0)
+            min = MIN(min, s->rtt_samples[i]);
+    }
+
+    s->rtt = s->rtt ? (7 * s->rtt + min) / 8 : (guint64)min;
+    if (estimate_changed(s->rtt, s->rtt_notified)) {
+        SPICE_DEBUG("rtt: %" G_GUINT64_FORMAT " us", s->rtt);
+        s->rtt_notified = s->rtt;
+        g_coroutine_object_notify(G_OBJECT(session), "rtt");
+    }
+
+    return s->rtt;
+}
+
+/* coroutine context */
+G_GNUC_INTERNAL
+void spice_session_bandwidth_sample(SpiceSession *session, guint64 bytes, gint64 duration)
+{
+    SpiceSessionPrivate *s;
+    guint64 rate;
+
+    g_return_if_fail(SPICE_IS_SESSION(session));
+    s = session->priv;
+
+    if (duration <= 0)
+        return;
+
+    rate = bytes * G_USEC_PER_SEC / duration;
+    s->bandwidth = s->bandwidth ? (7 * s->bandwidth + rate) / 8 : rate;
+    if (estimate_changed(s->bandwidth, s->bandwidth_notified)) {
+        SPICE_DEBUG("bandwidth: %" G_GUINT64_FORMAT " bytes/s", s->bandwidth);
+        s->bandwidth_notified = s->bandwidth;
+        g_coroutine_object_notify(G_OBJECT(session), "bandwidth");
+    }
+}
+
 G_GNUC_INTERNAL
 void spice_session_channel_new(SpiceSession *session, SpiceChannel *channel)
 {
@@ -2385,6 +3097,53 @@ void spice_session_get_ca(SpiceSession *session, guint8 **ca, guint *size)
     *size = s->ca ? s->ca->len : 0;
 }
 
+static gchar *tls_session_peer(SpiceSessionPrivate *s)
+{
+    return g_strdup_printf("%s:%s", s->host, s->tls_port);
+}
+
+/*
+ * Returns the last TLS session negotiated with the current host by
+ * any channel of @session, for the other channels to resume it
+ * instead of doing a full handshake. The session is owned by
+ * @session.
+ */
+G_GNUC_INTERNAL
+SSL_SESSION* spice_session_get_tls_session(SpiceSession *session)
+{
+    g_return_val_if_fail(SPICE_IS_SESSION(session), NULL);
+
+    SpiceSessionPrivate *s = session->priv;
+    SSL_SESSION *tls_session = NULL;
+    gchar *peer;
+
+    if (s->tls_session == NULL)
+        return NULL;
+
+    peer = tls_session_peer(s);
+    if (g_strcmp0(peer, s->tls_session_peer) == 0)
+        tls_session = s->tls_session;
+    g_free(peer);
+
+    return tls_session;
+}
+
+/* takes ownership of @tls_session, which may be NULL to clear the cache */
+G_GNUC_INTERNAL
+void spice_session_set_tls_session(SpiceSession *session, SSL_SESSION *tls_session)
+{
+    g_return_if_fail(SPICE_IS_SESSION(session));
+
+    SpiceSessionPrivate *s = session->priv;
+
+    if (s->tls_session)
+        SSL_SESSION_free(s->tls_session);
+    g_free(s->tls_session_peer);
+
+    s->tls_session = tls_session;
+    s->tls_session_peer = tls_session ? tls_session_peer(s) : NULL;
+}
+
 G_GNUC_INTERNAL
 guint spice_session_get_verify(SpiceSession *session)
 {
@@ -2472,6 +3231,7 @@ const gchar* spice_session_get_ca_file(SpiceSession *session)
 G_GNUC_INTERNAL
 void spice_session_get_caches(SpiceSession *session,
                               display_cache **images,
+                              GCoroutineWaitQueue **images_waiters,
                               SpiceGlzDecoderWindow **glz_window)
 {
     g_return_if_fail(SPICE_IS_SESSION(session));
@@ -2480,6 +3240,8 @@ void spice_session_get_caches(SpiceSession *session,
 
     if (images)
         *images = s->images;
+    if (images_waiters)
+        *images_waiters = s->images_waiters;
     if (glz_window)
         *glz_window = s->glz_window;
 }
@@ -2496,16 +3258,38 @@ void spice_session_set_caches_hints(SpiceSession *session,
     s->pci_ram_size = pci_ram_size;
     s->n_display_channels = n_display_channels;
 
-    /* TODO: when setting cache and window size, we should consider the client's
-     *       available memory and the number of display channels */
-    if (s->images_cache_size == 0) {
-        s->images_cache_size = IMAGES_CACHE_SIZE_DEFAULT;
+    /* use up to a quarter of the available memory, half of it for the
+     * images cache, a quarter for the glz window, and the rest for the
+     * surfaces, which are up to the server */
+    s->memory_budget = get_available_memory() / 4;
+    SPICE_DEBUG("memory budget: %" G_GUINT64_FORMAT " bytes, %u displays",
+                s->memory_budget, n_display_channels);
+
+    /* computed again on each connection, from the memory available
+     * then, unless set by the user */
+    if (!s->images_cache_size_set) {
+        guint64 size = IMAGES_CACHE_SIZE_DEFAULT +
+            (guint64)IMAGES_CACHE_SIZE_PER_DISPLAY * (MAX(n_display_channels, 1) - 1);
+
+        if (s->memory_budget != 0)
+            size = MAX(MIN_IMAGES_CACHE_SIZE, MIN(size, s->memory_budget / 2));
+        s->images_cache_size = MIN(size, G_MAXINT);
     }
 
-    if (s->glz_window_size == 0) {
+    if (!s->glz_window_size_set) {
         s->glz_window_size = MIN(MAX_GLZ_WINDOW_SIZE_DEFAULT, pci_ram_size / 2);
+        if (s->memory_budget != 0)
+            s->glz_window_size = MIN(s->glz_window_size, s->memory_budget / 4);
         s->glz_window_size = MAX(MIN_GLZ_WINDOW_SIZE_DEFAULT, s->glz_window_size);
     }
+
+    SPICE_DEBUG("images cache: %d bytes, glz window: %d bytes, surfaces: %"
+                G_GUINT64_FORMAT " bytes", s->images_cache_size, s->glz_window_size,
+                get_surfaces_allowance(session));
+    g_object_notify(G_OBJECT(session), "memory-budget");
+
+    update_image_cache_limit(session);
+    memory_check_start(session);
 }
 
 G_GNUC_INTERNAL
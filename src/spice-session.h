@@ -67,6 +67,22 @@ typedef enum {
     SPICE_SESSION_MIGRATION_CONNECTING,
 } SpiceSessionMigration;
 
+/**
+ * SpiceSessionMemoryPressure:
+ * @SPICE_SESSION_MEMORY_PRESSURE_NONE: no memory shortage
+ * @SPICE_SESSION_MEMORY_PRESSURE_MODERATE: some tasks are stalled on memory
+ * @SPICE_SESSION_MEMORY_PRESSURE_CRITICAL: tasks are often stalled on memory
+ *
+ * Client memory pressure, as seen by the session memory governor.
+ *
+ * Since: 0.31
+ **/
+typedef enum {
+    SPICE_SESSION_MEMORY_PRESSURE_NONE,
+    SPICE_SESSION_MEMORY_PRESSURE_MODERATE,
+    SPICE_SESSION_MEMORY_PRESSURE_CRITICAL,
+} SpiceSessionMemoryPressure;
+
 /**
  * SpiceSession:
  *
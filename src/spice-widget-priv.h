@@ -63,6 +63,7 @@ struct _SpiceDisplayPrivate {
     gint                    ww, wh, mx, my;
 
     bool                    convert;
+    cairo_region_t          *convert_region; /* invalidated, not converted yet */
     bool                    have_mitshm;
     gboolean                allow_scaling;
     gboolean                only_downscale;
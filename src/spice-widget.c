@@ -426,6 +426,10 @@ static void spice_display_dispose(GObject *obj)
     SPICE_DEBUG("spice display dispose");
 
     spicex_image_destroy(display);
+    if (d->convert_region) {
+        cairo_region_destroy(d->convert_region);
+        d->convert_region = NULL;
+    }
     g_clear_object(&d->session);
     d->gtk_session = NULL;
 
@@ -1094,12 +1098,200 @@ static void recalc_geometry(GtkWidget *widget)
 
 #define CONVERT_0555_TO_8888(s) (CONVERT_0555_TO_0888(s) | 0xff000000)
 
+typedef void (*convert_row_func)(const guint16 *src, guint32 *dest, gint width);
+
+static void convert_row_555(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x < width; x++)
+        dest[x] = CONVERT_0555_TO_0888(src[x]);
+}
+
+static void convert_row_565(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x < width; x++)
+        dest[x] = CONVERT_0565_TO_0888(src[x]);
+}
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define HAVE_X86_CONVERT
+#include <immintrin.h>
+
+/* Each 16 bits lane is split into its components, which are widened
+ * to 8 bits by replicating their top bits, then interleaved as
+ * 0x00RRGGBB. 565 differs by its green width and the red offset. */
+__attribute__((target("sse2")))
+static inline void convert_8_sse2(const guint16 *src, guint32 *dest, gboolean is565)
+{
+    const __m128i mask5 = _mm_set1_epi16(0x1f);
+    __m128i s = _mm_loadu_si128((const __m128i *)src);
+    __m128i b, g, r, bg;
+
+    b = _mm_and_si128(s, mask5);
+    b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+    if (is565) {
+        g = _mm_and_si128(_mm_srli_epi16(s, 5), _mm_set1_epi16(0x3f));
+        g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        r = _mm_srli_epi16(s, 11);
+    } else {
+        g = _mm_and_si128(_mm_srli_epi16(s, 5), mask5);
+        g = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
+        r = _mm_and_si128(_mm_srli_epi16(s, 10), mask5);
+    }
+    r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+
+    bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+    _mm_storeu_si128((__m128i *)dest, _mm_unpacklo_epi16(bg, r));
+    _mm_storeu_si128((__m128i *)(dest + 4), _mm_unpackhi_epi16(bg, r));
+}
+
+__attribute__((target("sse2")))
+static void convert_row_555_sse2(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8)
+        convert_8_sse2(src + x, dest + x, FALSE);
+    convert_row_555(src + x, dest + x, width - x);
+}
+
+__attribute__((target("sse2")))
+static void convert_row_565_sse2(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8)
+        convert_8_sse2(src + x, dest + x, TRUE);
+    convert_row_565(src + x, dest + x, width - x);
+}
+
+/* same as above, the unpacks work within 128 bits lanes, hence the
+ * final permutes to store the pixels in order */
+__attribute__((target("avx2")))
+static inline void convert_16_avx2(const guint16 *src, guint32 *dest, gboolean is565)
+{
+    const __m256i mask5 = _mm256_set1_epi16(0x1f);
+    __m256i s = _mm256_loadu_si256((const __m256i *)src);
+    __m256i b, g, r, bg, lo, hi;
+
+    b = _mm256_and_si256(s, mask5);
+    b = _mm256_or_si256(_mm256_slli_epi16(b, 3), _mm256_srli_epi16(b, 2));
+    if (is565) {
+        g = _mm256_and_si256(_mm256_srli_epi16(s, 5), _mm256_set1_epi16(0x3f));
+        g = _mm256_or_si256(_mm256_slli_epi16(g, 2), _mm256_srli_epi16(g, 4));
+        r = _mm256_srli_epi16(s, 11);
+    } else {
+        g = _mm256_and_si256(_mm256_srli_epi16(s, 5), mask5);
+        g = _mm256_or_si256(_mm256_slli_epi16(g, 3), _mm256_srli_epi16(g, 2));
+        r = _mm256_and_si256(_mm256_srli_epi16(s, 10), mask5);
+    }
+    r = _mm256_or_si256(_mm256_slli_epi16(r, 3), _mm256_srli_epi16(r, 2));
+
+    bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+    lo = _mm256_unpacklo_epi16(bg, r);
+    hi = _mm256_unpackhi_epi16(bg, r);
+    _mm256_storeu_si256((__m256i *)dest, _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *)(dest + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+__attribute__((target("avx2")))
+static void convert_row_555_avx2(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+        convert_16_avx2(src + x, dest + x, FALSE);
+    convert_row_555(src + x, dest + x, width - x);
+}
+
+__attribute__((target("avx2")))
+static void convert_row_565_avx2(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x + 16 <= width; x += 16)
+        convert_16_avx2(src + x, dest + x, TRUE);
+    convert_row_565(src + x, dest + x, width - x);
+}
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define HAVE_NEON_CONVERT
+#include <arm_neon.h>
+
+static inline void convert_8_neon(const guint16 *src, guint32 *dest, gboolean is565)
+{
+    uint16x8_t s = vld1q_u16(src);
+    uint16x8_t b, g, r;
+    uint8x8x4_t bgrx;
+
+    b = vandq_u16(s, vdupq_n_u16(0x1f));
+    b = vorrq_u16(vshlq_n_u16(b, 3), vshrq_n_u16(b, 2));
+    if (is565) {
+        g = vandq_u16(vshrq_n_u16(s, 5), vdupq_n_u16(0x3f));
+        g = vorrq_u16(vshlq_n_u16(g, 2), vshrq_n_u16(g, 4));
+        r = vshrq_n_u16(s, 11);
+    } else {
+        g = vandq_u16(vshrq_n_u16(s, 5), vdupq_n_u16(0x1f));
+        g = vorrq_u16(vshlq_n_u16(g, 3), vshrq_n_u16(g, 2));
+        r = vandq_u16(vshrq_n_u16(s, 10), vdupq_n_u16(0x1f));
+    }
+    r = vorrq_u16(vshlq_n_u16(r, 3), vshrq_n_u16(r, 2));
+
+    bgrx.val[0] = vmovn_u16(b);
+    bgrx.val[1] = vmovn_u16(g);
+    bgrx.val[2] = vmovn_u16(r);
+    bgrx.val[3] = vdup_n_u8(0);
+    vst4_u8((uint8_t *)dest, bgrx);
+}
+
+static void convert_row_555_neon(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8)
+        convert_8_neon(src + x, dest + x, FALSE);
+    convert_row_555(src + x, dest + x, width - x);
+}
+
+static void convert_row_565_neon(const guint16 *src, guint32 *dest, gint width)
+{
+    gint x;
+
+    for (x = 0; x + 8 <= width; x += 8)
+        convert_8_neon(src + x, dest + x, TRUE);
+    convert_row_565(src + x, dest + x, width - x);
+}
+#endif
+
+/* picks the fastest implementation the CPU supports */
+static convert_row_func get_convert_row(enum SpiceSurfaceFmt format)
+{
+    gboolean is565 = format == SPICE_SURFACE_FMT_16_565;
+
+#ifdef HAVE_X86_CONVERT
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return is565 ? convert_row_565_avx2 : convert_row_555_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return is565 ? convert_row_565_sse2 : convert_row_555_sse2;
+#endif
+#ifdef HAVE_NEON_CONVERT
+    return is565 ? convert_row_565_neon : convert_row_555_neon;
+#endif
+    return is565 ? convert_row_565 : convert_row_555;
+}
+
 static gboolean do_color_convert(SpiceDisplay *display, GdkRectangle *r)
 {
     SpiceDisplayPrivate *d = display->priv;
     guint32 *dest = d->data;
     guint16 *src = d->data_origin;
-    gint x, y;
+    convert_row_func convert_row;
+    gint y;
 
     g_return_val_if_fail(r != NULL, false);
     g_return_val_if_fail(d->format == SPICE_SURFACE_FMT_16_555 ||
@@ -1108,27 +1300,49 @@ static gboolean do_color_convert(SpiceDisplay *display, GdkRectangle *r)
     src += (d->stride / 2) * r->y + r->x;
     dest += d->area.width * (r->y - d->area.y) + (r->x - d->area.x);
 
-    if (d->format == SPICE_SURFACE_FMT_16_555) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0555_TO_0888(src[x]);
-            }
+    convert_row = get_convert_row(d->format);
+    for (y = 0; y < r->height; y++) {
+        convert_row(src, dest, r->width);
+        dest += d->area.width;
+        src += d->stride / 2;
+    }
+    return true;
+}
 
-            dest += d->area.width;
-            src += d->stride / 2;
-        }
-    } else if (d->format == SPICE_SURFACE_FMT_16_565) {
-        for (y = 0; y < r->height; y++) {
-            for (x = 0; x < r->width; x++) {
-                dest[x] = CONVERT_0565_TO_0888(src[x]);
-            }
+static void clear_convert_region(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
 
-            dest += d->area.width;
-            src += d->stride / 2;
-        }
+    if (d->convert_region) {
+        cairo_region_destroy(d->convert_region);
+        d->convert_region = NULL;
     }
+}
 
-    return true;
+/* Convert what was invalidated since the last paint at once, so that
+ * areas updated several times in a frame are only converted once */
+static void flush_color_convert(SpiceDisplay *display)
+{
+    SpiceDisplayPrivate *d = display->priv;
+    cairo_rectangle_int_t *rects;
+    gint i, n;
+
+    if (!d->convert || d->convert_region == NULL)
+        return;
+
+#if GTK_CHECK_VERSION (3, 0, 0)
+    n = cairo_region_num_rectangles(d->convert_region);
+    rects = g_new(cairo_rectangle_int_t, n);
+    for (i = 0; i < n; i++)
+        cairo_region_get_rectangle(d->convert_region, i, &rects[i]);
+#else
+    gdk_region_get_rectangles(d->convert_region, &rects, &n);
+#endif
+    for (i = 0; i < n; i++)
+        do_color_convert(display, &rects[i]);
+    g_free(rects);
+
+    clear_convert_region(display);
 }
 
 
@@ -1144,6 +1358,7 @@ static gboolean draw_event(GtkWidget *widget, cairo_t *cr)
         return false;
     g_return_val_if_fail(d->ximage != NULL, false);
 
+    flush_color_convert(display);
     spicex_draw_event(display, cr);
     update_mouse_pointer(display);
 
@@ -1161,6 +1376,7 @@ static gboolean expose_event(GtkWidget *widget, GdkEventExpose *expose)
         return false;
     g_return_val_if_fail(d->ximage != NULL, false);
 
+    flush_color_convert(display);
     spicex_expose_event(display, expose);
     update_mouse_pointer(display);
 
@@ -1777,6 +1993,7 @@ static void update_image(SpiceDisplay *display)
     SpiceDisplayPrivate *d = display->priv;
 
     spicex_image_create(display);
+    clear_convert_region(display);
     if (d->convert)
         do_color_convert(display, &d->area);
 }
@@ -2212,8 +2429,12 @@ static void invalidate(SpiceChannel *channel,
     if (!gdk_rectangle_intersect(&rect, &d->area, &rect))
         return;
 
-    if (d->convert)
-        do_color_convert(display, &rect);
+    if (d->convert) {
+        if (d->convert_region == NULL)
+            d->convert_region = cairo_region_create_rectangle(&rect);
+        else
+            cairo_region_union_rectangle(d->convert_region, &rect);
+    }
 
     spice_display_get_scaling(display, &s,
                               &display_x, &display_y,
@@ -2645,6 +2866,9 @@ GdkPixbuf *spice_display_get_pixbuf(SpiceDisplay *display)
     /* TODO: ensure d->data has been exposed? */
     g_return_val_if_fail(d->data != NULL, NULL);
 
+    /* the conversion waits for a paint, which may not come when hidden */
+    flush_color_convert(display);
+
     data = g_malloc0(d->area.width * d->area.height * 3);
     src = d->data;
     dest = data;
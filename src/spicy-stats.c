@@ -23,12 +23,89 @@
 
 /* config */
 static gboolean version = FALSE;
+static gint stats_interval = 0;
 
 /* state */
 static SpiceSession  *session;
 static GMainLoop     *mainloop;
 
 /* ------------------------------------------------------------------ */
+/* one JSON object per line, for each channel and interval */
+static void channel_stats(SpiceChannel *channel, GVariant *stats, gpointer data)
+{
+    GString *line = g_string_new(NULL);
+    GVariantIter *iter;
+    gint64 time;
+    guint64 read_bytes, read_msgs, xmit_bytes, xmit_msgs;
+    guint64 messages, bytes, parse_time, handler_time, queue_wait;
+    guint16 type;
+    gint channel_type, channel_id;
+    gboolean first;
+
+    g_object_get(channel,
+                 "channel-type", &channel_type,
+                 "channel-id", &channel_id,
+                 NULL);
+    g_variant_lookup(stats, "time", "x", &time);
+    g_variant_lookup(stats, "read-bytes", "t", &read_bytes);
+    g_variant_lookup(stats, "read-messages", "t", &read_msgs);
+    g_variant_lookup(stats, "xmit-bytes", "t", &xmit_bytes);
+    g_variant_lookup(stats, "xmit-messages", "t", &xmit_msgs);
+
+    g_string_append_printf(line,
+                           "{\"time\":%" G_GINT64_FORMAT ",\"channel\":\"%s\",\"id\":%d,"
+                           "\"read-bytes\":%" G_GUINT64_FORMAT ",\"read-messages\":%" G_GUINT64_FORMAT ","
+                           "\"xmit-bytes\":%" G_GUINT64_FORMAT ",\"xmit-messages\":%" G_GUINT64_FORMAT,
+                           time, spice_channel_type_to_string(channel_type), channel_id,
+                           read_bytes, read_msgs, xmit_bytes, xmit_msgs);
+
+    g_string_append(line, ",\"received\":[");
+    first = TRUE;
+    if (g_variant_lookup(stats, "received", "a(qtttt)", &iter)) {
+        while (g_variant_iter_next(iter, "(qtttt)", &type, &messages, &bytes,
+                                   &parse_time, &handler_time)) {
+            g_string_append_printf(line,
+                                   "%s{\"type\":%u,\"messages\":%" G_GUINT64_FORMAT ","
+                                   "\"bytes\":%" G_GUINT64_FORMAT ",\"parse-us\":%" G_GUINT64_FORMAT ","
+                                   "\"handler-us\":%" G_GUINT64_FORMAT "}",
+                                   first ? "" : ",", type, messages, bytes,
+                                   parse_time, handler_time);
+            first = FALSE;
+        }
+        g_variant_iter_free(iter);
+    }
+
+    g_string_append(line, "],\"sent\":[");
+    first = TRUE;
+    if (g_variant_lookup(stats, "sent", "a(qttt)", &iter)) {
+        while (g_variant_iter_next(iter, "(qttt)", &type, &messages, &bytes, &queue_wait)) {
+            g_string_append_printf(line,
+                                   "%s{\"type\":%u,\"messages\":%" G_GUINT64_FORMAT ","
+                                   "\"bytes\":%" G_GUINT64_FORMAT ",\"queue-us\":%" G_GUINT64_FORMAT "}",
+                                   first ? "" : ",", type, messages, bytes, queue_wait);
+            first = FALSE;
+        }
+        g_variant_iter_free(iter);
+    }
+    g_string_append(line, "]}");
+
+    printf("%s\n", line->str);
+    fflush(stdout);
+    g_string_free(line, TRUE);
+}
+
+/* and one for the link estimations, as they change */
+static void link_estimation(SpiceSession *s, GParamSpec *pspec, gpointer data)
+{
+    guint64 rtt, bandwidth;
+
+    g_object_get(s, "rtt", &rtt, "bandwidth", &bandwidth, NULL);
+    printf("{\"time\":%" G_GINT64_FORMAT ",\"rtt-us\":%" G_GUINT64_FORMAT
+           ",\"bandwidth\":%" G_GUINT64_FORMAT "}\n",
+           g_get_monotonic_time(), rtt, bandwidth);
+    fflush(stdout);
+}
+
 static void main_channel_event(SpiceChannel *channel, SpiceChannelEvent event,
                                gpointer data)
 {
@@ -57,6 +134,12 @@ static void channel_new(SpiceSession *s, SpiceChannel *channel, gpointer *data)
             return;
     }
 
+    if (stats_interval > 0) {
+        g_signal_connect(channel, "channel-stats",
+                         G_CALLBACK(channel_stats), data);
+        g_object_set(channel, "stats-interval", stats_interval, NULL);
+    }
+
     spice_channel_connect(channel);
 }
 
@@ -69,6 +152,13 @@ static GOptionEntry app_entries[] = {
         .arg_data         = &version,
         .description      = "Display version and quit",
     },
+    {
+        .long_name        = "stats-interval",
+        .arg              = G_OPTION_ARG_INT,
+        .arg_data         = &stats_interval,
+        .description      = "Print the channels statistics as JSON lines every MS milliseconds",
+        .arg_description  = "MS",
+    },
     {
         /* end of list */
     }
@@ -111,6 +201,12 @@ int main(int argc, char *argv[])
     session = spice_session_new();
     g_signal_connect(session, "channel-new",
                      G_CALLBACK(channel_new), NULL);
+    if (stats_interval > 0) {
+        g_signal_connect(session, "notify::rtt",
+                         G_CALLBACK(link_estimation), NULL);
+        g_signal_connect(session, "notify::bandwidth",
+                         G_CALLBACK(link_estimation), NULL);
+    }
     spice_cmdline_session_setup(session);
 
     if (!spice_session_connect(session)) {
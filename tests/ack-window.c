@@ -0,0 +1,139 @@
+#include "config.h"
+
+#include <glib.h>
+#include <spice/protocol.h>
+
+#include "spice-client.h"
+
+#include "fake-server.h"
+
+/*
+ * The client acks against a fake server enforcing the window as
+ * spice-server does: on a local link the acks may be held back and
+ * sent together, over a slow one they go as soon as due, and never
+ * before the server sent what they acknowledge.
+ */
+
+#define TEST_WINDOW 8
+
+typedef struct {
+    gint64 latency;
+    guint messages;
+} AckTest;
+
+static const AckTest tests[] = {
+    { 0, 2000 },
+    { 20 * 1000, 200 },
+};
+
+static gboolean timeout_cb(gpointer user_data)
+{
+    gboolean *timed_out = user_data;
+
+    *timed_out = TRUE;
+    return FALSE;
+}
+
+static void channel_new(SpiceSession *session, SpiceChannel *channel, gpointer user_data)
+{
+    SpiceChannel **main_channel = user_data;
+
+    if (SPICE_IS_MAIN_CHANNEL(channel))
+        *main_channel = channel;
+}
+
+static void put_32(GByteArray *out, guint32 word)
+{
+    word = GUINT32_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 4);
+}
+
+static void put_64(GByteArray *out, guint64 word)
+{
+    word = GUINT64_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 8);
+}
+
+static void test_ack_window(gconstpointer user_data)
+{
+    const AckTest *test = user_data;
+    FakeServer *server = fake_server_new();
+    SpiceSession *session = spice_session_new();
+    SpiceChannel *main_channel = NULL;
+    GByteArray *msg = g_byte_array_new();
+    FakeServerStats stats;
+    gboolean timed_out = FALSE;
+    guint64 coalesced, rtt;
+    GVariant *channel_stats;
+    guint timeout, i;
+
+    /* the client answers each ping, and the pongs are ignored */
+    for (i = 0; i < test->messages; i++) {
+        put_32(msg, i + 1);
+        put_64(msg, 0);
+        fake_server_queue(server, SPICE_CHANNEL_MAIN, 0, SPICE_MSG_PING, msg->data, msg->len);
+        g_byte_array_set_size(msg, 0);
+    }
+    g_byte_array_unref(msg);
+    fake_server_set_ack_window(server, SPICE_CHANNEL_MAIN, 0, TEST_WINDOW);
+    fake_server_set_latency(server, test->latency);
+
+    g_signal_connect(session, "channel-new", G_CALLBACK(channel_new), &main_channel);
+    fake_server_connect(server, session);
+    g_assert(spice_session_open_fd(session, -1));
+    timeout = g_timeout_add_seconds(60, timeout_cb, &timed_out);
+    while (!fake_server_is_done(server) && !timed_out)
+        g_main_context_iteration(NULL, TRUE);
+    g_assert(!timed_out);
+    g_source_remove(timeout);
+
+    g_assert(main_channel != NULL);
+    channel_stats = spice_channel_get_stats(main_channel);
+    g_assert(g_variant_lookup(channel_stats, "acks-coalesced", "t", &coalesced));
+    g_variant_unref(channel_stats);
+    g_object_get(session, "rtt", &rtt, NULL);
+
+    g_assert(fake_server_get_stats(server, SPICE_CHANNEL_MAIN, 0, &stats));
+    g_test_message("%" G_GUINT64_FORMAT " acks, %" G_GUINT64_FORMAT " coalesced, "
+                   "%" G_GUINT64_FORMAT " window stalls, rtt %" G_GUINT64_FORMAT " us",
+                   stats.acks, coalesced, stats.window_stalls, rtt);
+    g_assert_cmpuint(stats.window_violations, ==, 0);
+    g_assert_cmpuint(stats.acks, >, 0);
+    /* how the acks go out depends on the scheduling of the test
+     * process, only check it when asked for the slow tests */
+    if (!g_test_slow()) {
+        g_test_message("skipping timing checks, run with -m slow");
+    } else if (test->latency == 0) {
+        g_assert_cmpuint(coalesced, >, 0);
+    } else {
+        /* the server waits for each ack, holding them back would only
+         * make it wait longer */
+        g_assert_cmpuint(stats.window_stalls, >, 0);
+        g_assert_cmpuint(coalesced, ==, 0);
+        g_assert_cmpuint(rtt, >=, test->latency);
+        g_assert_cmpuint(rtt, <, 4 * test->latency);
+    }
+
+    spice_session_disconnect(session);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    fake_server_free(server);
+    g_object_unref(session);
+}
+
+int main(int argc, char* argv[])
+{
+    guint i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < G_N_ELEMENTS(tests); i++) {
+        gchar *path = g_strdup_printf("/ack-window/latency-%" G_GINT64_FORMAT "ms",
+                                      tests[i].latency / 1000);
+
+        g_test_add_data_func(path, &tests[i], test_ack_window);
+        g_free(path);
+    }
+
+    return g_test_run();
+}
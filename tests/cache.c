@@ -0,0 +1,141 @@
+#include "config.h"
+
+#include <glib.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-cache.h"
+
+#define IMAGE_SIZE 100
+
+static gint live;
+
+static gpointer value_new(void)
+{
+    live++;
+    return g_malloc(1);
+}
+
+static void value_free(gpointer value)
+{
+    live--;
+    g_free(value);
+}
+
+static gsize value_size(gpointer value)
+{
+    return IMAGE_SIZE;
+}
+
+static void test_cache_basic(void)
+{
+    display_cache *cache = cache_image_new(value_free, value_size);
+    display_cache_stats stats;
+    guint64 id;
+
+    live = 0;
+    for (id = 0; id < 10000; id++)
+        cache_add(cache, id * 7919, value_new());
+    for (id = 0; id < 10000; id++)
+        g_assert(cache_find(cache, id * 7919) != NULL);
+    g_assert(cache_find(cache, 1) == NULL);
+
+    cache_get_stats(cache, &stats);
+    g_assert_cmpuint(stats.items, ==, 10000);
+    g_assert_cmpuint(stats.bytes, ==, 10000 * IMAGE_SIZE);
+    g_assert_cmpuint(stats.hits, ==, 10000);
+    g_assert_cmpuint(stats.misses, ==, 1);
+    g_assert_cmpint(live, ==, 10000);
+
+    for (id = 0; id < 10000; id += 2)
+        g_assert(cache_remove(cache, id * 7919));
+    g_assert(cache_find(cache, 0) == NULL);
+    g_assert(cache_find(cache, 7919) != NULL);
+    g_assert(!cache_remove(cache, 0));
+    cache_get_stats(cache, &stats);
+    g_assert_cmpuint(stats.items, ==, 5000);
+    g_assert_cmpint(live, ==, 5000);
+
+    cache_free(cache);
+    g_assert_cmpint(live, ==, 0);
+}
+
+static void test_cache_ref_counted(void)
+{
+    display_cache *cache = cache_image_new(value_free, value_size);
+
+    live = 0;
+    cache_add(cache, 5, value_new());
+    cache_add(cache, 5, value_new());
+    g_assert_cmpint(live, ==, 1);
+
+    g_assert(cache_remove(cache, 5));
+    g_assert(cache_find(cache, 5) != NULL);
+    g_assert(cache_remove(cache, 5));
+    g_assert(cache_find(cache, 5) == NULL);
+    g_assert(!cache_remove(cache, 5));
+
+    cache_free(cache);
+}
+
+static void test_cache_evict(void)
+{
+    display_cache *cache = cache_image_new(value_free, value_size);
+    display_cache_stats stats;
+    guint64 id;
+
+    live = 0;
+    for (id = 0; id < 1000; id++)
+        cache_add(cache, id, value_new());
+    /* make the first one the most recently used */
+    g_assert(cache_find(cache, 0) != NULL);
+
+    cache_set_max_bytes(cache, 100 * IMAGE_SIZE);
+    cache_get_stats(cache, &stats);
+    g_assert_cmpuint(stats.items, ==, 100);
+    g_assert_cmpuint(stats.bytes, ==, 100 * IMAGE_SIZE);
+    g_assert_cmpuint(stats.evictions, ==, 900);
+    g_assert_cmpint(live, ==, 100);
+
+    g_assert(cache_find(cache, 0) != NULL);
+    g_assert(cache_find(cache, 999) != NULL);
+    g_assert(cache_find(cache, 1) == NULL);
+    g_assert(cache_is_evicted(cache, 1));
+    g_assert(!cache_is_evicted(cache, 0));
+    g_assert(!cache_is_evicted(cache, 5000));
+
+    /* the server removing an evicted image */
+    g_assert(cache_remove(cache, 1));
+    g_assert(!cache_is_evicted(cache, 1));
+
+    /* or sending it again */
+    cache_add(cache, 2, value_new());
+    g_assert(!cache_is_evicted(cache, 2));
+    g_assert(cache_find(cache, 2) != NULL);
+
+    /* churn, with the table growing and being cleaned */
+    for (id = 100000; id < 300000; id++) {
+        cache_add(cache, id, value_new());
+        if (id % 3 == 0)
+            cache_remove(cache, id);
+    }
+    cache_get_stats(cache, &stats);
+    g_assert_cmpuint(stats.bytes, <=, 100 * IMAGE_SIZE);
+    g_assert_cmpint(live, ==, stats.items);
+
+    cache_clear(cache);
+    g_assert_cmpint(live, ==, 0);
+    g_assert(!cache_is_evicted(cache, 3));
+    cache_free(cache);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/cache/basic", test_cache_basic);
+    g_test_add_func("/cache/ref-counted", test_cache_ref_counted);
+    g_test_add_func("/cache/evict", test_cache_evict);
+
+    return g_test_run();
+}
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 
 #include "coroutine.h"
+#include "gio-coroutine.h"
 
 static gpointer co_entry_check_self(gpointer data)
 {
@@ -124,6 +125,85 @@ static void test_coroutine_yield(void)
 #endif
 }
 
+#define N_WAITERS 4
+
+typedef struct {
+    GCoroutineWaitQueue *queue;
+    guint64 key;
+    gboolean *ready;
+    guint checks;
+    gboolean done;
+} WaitData;
+
+static gboolean wait_ready(gpointer data)
+{
+    WaitData *wait = data;
+
+    wait->checks++;
+    return wait->ready[wait->key];
+}
+
+static gpointer co_entry_wait(gpointer data)
+{
+    WaitData *wait = data;
+
+    g_assert(g_coroutine_wait_queue_wait(wait->queue, g_coroutine_self(),
+                                         wait->key, wait_ready, wait));
+    wait->done = TRUE;
+
+    return NULL;
+}
+
+static gboolean idle_count(gpointer data)
+{
+    guint *n = data;
+
+    return ++(*n) < 10;
+}
+
+static void test_coroutine_wait_queue(void)
+{
+    GCoroutineWaitQueue *queue = g_coroutine_wait_queue_new();
+    gboolean ready[N_WAITERS + 1] = { FALSE, };
+    GCoroutine co[N_WAITERS];
+    WaitData wait[N_WAITERS];
+    guint i, key, idles = 0;
+
+    memset(co, 0, sizeof(co));
+    for (i = 0; i < N_WAITERS; i++) {
+        wait[i] = (WaitData) { .queue = queue, .key = i, .ready = ready };
+        co[i].coroutine.stack_size = 16 << 20;
+        co[i].coroutine.entry = co_entry_wait;
+        coroutine_init(&co[i].coroutine);
+        coroutine_yieldto(&co[i].coroutine, &wait[i]);
+        g_assert(!wait[i].done);
+        g_assert_cmpuint(wait[i].checks, ==, 1);
+    }
+
+    /* unrelated main loop activity doesn't check the conditions again */
+    g_idle_add(idle_count, &idles);
+    while (idles < 10)
+        g_main_context_iteration(NULL, TRUE);
+
+    /* nobody waits for this one */
+    ready[N_WAITERS] = TRUE;
+    g_assert_cmpuint(g_coroutine_wait_queue_wake(queue, N_WAITERS), ==, 0);
+
+    /* each wakeup resumes exactly its waiter, and only once */
+    for (key = N_WAITERS; key-- > 0;) {
+        ready[key] = TRUE;
+        g_assert_cmpuint(g_coroutine_wait_queue_wake(queue, key), ==, 1);
+        while (!wait[key].done)
+            g_main_context_iteration(NULL, TRUE);
+        while (g_main_context_iteration(NULL, FALSE));
+
+        for (i = 0; i < N_WAITERS; i++)
+            g_assert_cmpuint(wait[i].checks, ==, i >= key ? 2 : 1);
+    }
+
+    g_coroutine_wait_queue_free(queue);
+}
+
 int main(int argc, char* argv[])
 {
     g_test_init(&argc, &argv, NULL);
@@ -131,6 +211,7 @@ int main(int argc, char* argv[])
     g_test_add_func("/coroutine/simple", test_coroutine_simple);
     g_test_add_func("/coroutine/two", test_coroutine_two);
     g_test_add_func("/coroutine/yield", test_coroutine_yield);
+    g_test_add_func("/coroutine/wait-queue", test_coroutine_wait_queue);
 
     return g_test_run ();
 }
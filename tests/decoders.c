@@ -0,0 +1,576 @@
+#include "config.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+#include <zlib.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+#include "channel-display-priv.h"
+#include "decode.h"
+#include "gio-coroutine.h"
+#include "common/canvas_utils.h"
+
+#include "glz-encoder.h"
+
+/*
+ * Decoding throughput, allocations and latency of the image and video
+ * decoders, on payloads as they come from the server.
+ *
+ * The payloads are generated, unless SPICE_DECODERS_CORPUS points to a
+ * directory of captured ones, decoded in name order:
+ *   *.glz       glz images, a whole dictionary history starting from id 0
+ *   *.zlib-glz  the decoded size, 32 bits big endian, then the zlib data
+ *   *.jpeg      jpeg images
+ *   *.mjpeg     mjpeg stream frames
+ *
+ * The allocations and frees are counted by replacing malloc() and co,
+ * which glib uses since 2.46. That relies on glibc's __libc_malloc(),
+ * and is left out with other C libraries and under AddressSanitizer or
+ * ThreadSanitizer, which replace malloc() themselves.
+ */
+
+typedef enum {
+    PAYLOAD_GLZ,
+    PAYLOAD_ZLIB_GLZ,
+    PAYLOAD_JPEG,
+    PAYLOAD_MJPEG,
+    PAYLOAD_LAST,
+} PayloadType;
+
+static const char *payload_names[] = { "glz", "zlib-glz", "jpeg", "mjpeg" };
+
+typedef struct {
+    guint8 *data;
+    gsize size;
+    guint width;
+    guint height;
+    guint glz_size;
+} Payload;
+
+/* Payload, for each PayloadType */
+static GPtrArray *corpus[PAYLOAD_LAST];
+
+#ifndef __has_feature
+#define __has_feature(x) 0
+#endif
+
+#if defined(__GLIBC__) && \
+    !defined(__SANITIZE_ADDRESS__) && !defined(__SANITIZE_THREAD__) && \
+    !__has_feature(address_sanitizer) && !__has_feature(thread_sanitizer)
+#define HAVE_ALLOCATIONS_COUNT
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static volatile gint allocations;
+static volatile gint frees;
+
+void *malloc(size_t size)
+{
+    g_atomic_int_inc(&allocations);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    g_atomic_int_inc(&allocations);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    g_atomic_int_inc(&allocations);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr != NULL)
+        g_atomic_int_inc(&frees);
+    __libc_free(ptr);
+}
+#endif
+
+static void payload_free(gpointer data)
+{
+    Payload *payload = data;
+
+    g_free(payload->data);
+    g_free(payload);
+}
+
+static Payload *payload_new(gpointer data, gsize size, guint width, guint height)
+{
+    Payload *payload = g_new0(Payload, 1);
+
+    payload->data = data;
+    payload->size = size;
+    payload->width = width;
+    payload->height = height;
+
+    return payload;
+}
+
+static guint32 read_32(const guint8 *data)
+{
+    return data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static gboolean jpeg_get_size(const guint8 *data, gsize size, guint *width, guint *height)
+{
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    gboolean valid;
+
+    /* the default error handler exits */
+    if (size < 2 || data[0] != 0xff || data[1] != 0xd8)
+        return FALSE;
+
+    dinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, (guint8 *)data, size);
+    valid = jpeg_read_header(&dinfo, TRUE) == JPEG_HEADER_OK;
+    *width = dinfo.image_width;
+    *height = dinfo.image_height;
+    jpeg_destroy_decompress(&dinfo);
+
+    return valid;
+}
+
+/* ------------------------------------------------------------------ */
+
+static Payload *glz_payload_new(GByteArray *glz)
+{
+    /* the sizes are after the magic, the version and the type */
+    guint width = read_32(glz->data + 9);
+    guint height = read_32(glz->data + 13);
+    gsize size = glz->len;
+
+    return payload_new(g_byte_array_free(glz, FALSE), size, width, height);
+}
+
+static Payload *zlib_glz_payload_new(const Payload *glz)
+{
+    uLongf size = compressBound(glz->size);
+    guint8 *data = g_malloc(size);
+    Payload *payload;
+
+    g_assert_cmpint(compress2(data, &size, glz->data, glz->size, Z_DEFAULT_COMPRESSION), ==, Z_OK);
+    payload = payload_new(data, size, glz->width, glz->height);
+    payload->glz_size = glz->size;
+
+    return payload;
+}
+
+static Payload *jpeg_payload_new(const guint32 *pixels, guint width, guint height)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *jpeg = NULL;
+    unsigned long size = 0;
+    guint8 *row;
+    guint x, y;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &jpeg, &size);
+    cinfo.image_width = width;
+    cinfo.image_height = height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 80, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    row = g_malloc(width * 3);
+    for (y = 0; y < height; y++) {
+        for (x = 0; x < width; x++) {
+            guint32 rgb = pixels[y * width + x];
+
+            row[x * 3 + 0] = rgb >> 16;
+            row[x * 3 + 1] = rgb >> 8;
+            row[x * 3 + 2] = rgb;
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    g_free(row);
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    /* libjpeg allocated it with malloc() */
+    return payload_new(g_memdup(jpeg, size), size, width, height);
+}
+
+/* a glz history of frames going back and forth between the first two
+ * frames, and the same frames as jpeg */
+static void corpus_generate(guint width, guint height, guint n)
+{
+    guint32 *frames[2];
+    guint i, x, y;
+
+    for (i = 0; i < 2; i++) {
+        frames[i] = g_new(guint32, width * height);
+        for (y = 0; y < height; y++)
+            for (x = 0; x < width; x++)
+                frames[i][y * width + x] = glz_encode_desktop_pixel(width, x, y, i);
+    }
+
+    for (i = 0; i < n; i++) {
+        GByteArray *glz = glz_encode(LZ_IMAGE_TYPE_RGB32, width, height, i,
+                                     frames[i % 2], NULL,
+                                     i == 0 ? NULL : frames[(i + 1) % 2], NULL);
+        Payload *payload = glz_payload_new(glz);
+
+        g_ptr_array_add(corpus[PAYLOAD_GLZ], payload);
+        g_ptr_array_add(corpus[PAYLOAD_ZLIB_GLZ], zlib_glz_payload_new(payload));
+        g_ptr_array_add(corpus[PAYLOAD_JPEG], jpeg_payload_new(frames[i % 2], width, height));
+    }
+
+    /* the same jpeg images, as a stream */
+    for (i = 0; i < corpus[PAYLOAD_JPEG]->len; i++) {
+        Payload *jpeg = g_ptr_array_index(corpus[PAYLOAD_JPEG], i);
+
+        g_ptr_array_add(corpus[PAYLOAD_MJPEG],
+                        payload_new(g_memdup(jpeg->data, jpeg->size), jpeg->size,
+                                    jpeg->width, jpeg->height));
+    }
+
+    g_free(frames[0]);
+    g_free(frames[1]);
+}
+
+static Payload *corpus_load_file(PayloadType type, const gchar *path)
+{
+    GError *err = NULL;
+    guint8 *data;
+    gsize size;
+    guint width, height;
+    Payload *payload;
+
+    if (!g_file_get_contents(path, (gchar **)&data, &size, &err)) {
+        g_warning("%s", err->message);
+        g_clear_error(&err);
+        return NULL;
+    }
+
+    switch (type) {
+    case PAYLOAD_GLZ:
+        if (size < 17)
+            goto invalid;
+        width = read_32(data + 9);
+        height = read_32(data + 13);
+        break;
+    case PAYLOAD_ZLIB_GLZ:
+        if (size < 4)
+            goto invalid;
+        /* the dimensions are in the compressed glz header */
+        width = height = 0;
+        break;
+    default:
+        if (!jpeg_get_size(data, size, &width, &height))
+            goto invalid;
+        break;
+    }
+
+    if (type == PAYLOAD_ZLIB_GLZ) {
+        payload = payload_new(g_memdup(data + 4, size - 4), size - 4, width, height);
+        payload->glz_size = read_32(data);
+        g_free(data);
+    } else {
+        payload = payload_new(data, size, width, height);
+    }
+
+    return payload;
+
+invalid:
+    g_warning("invalid %s payload: %s", payload_names[type], path);
+    g_free(data);
+    return NULL;
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+    /* g_ptr_array_sort() gives pointers to the elements */
+    return g_strcmp0(*(gchar * const *)a, *(gchar * const *)b);
+}
+
+/* returns TRUE if there was a corpus to load */
+static gboolean corpus_load(const gchar *dirname)
+{
+    GDir *dir;
+    GPtrArray *names;
+    const gchar *name;
+    gboolean loaded = FALSE;
+    guint i;
+    int type;
+
+    dir = g_dir_open(dirname, 0, NULL);
+    if (dir == NULL)
+        return FALSE;
+
+    names = g_ptr_array_new_with_free_func(g_free);
+    while ((name = g_dir_read_name(dir)) != NULL)
+        g_ptr_array_add(names, g_strdup(name));
+    g_dir_close(dir);
+    g_ptr_array_sort(names, compare_names);
+
+    for (i = 0; i < names->len; i++) {
+        name = g_ptr_array_index(names, i);
+        for (type = 0; type < PAYLOAD_LAST; type++) {
+            gchar *suffix = g_strconcat(".", payload_names[type], NULL);
+
+            if (g_str_has_suffix(name, suffix) &&
+                !(type == PAYLOAD_GLZ && g_str_has_suffix(name, ".zlib-glz"))) {
+                gchar *path = g_build_filename(dirname, name, NULL);
+                Payload *payload = corpus_load_file(type, path);
+
+                if (payload != NULL) {
+                    g_ptr_array_add(corpus[type], payload);
+                    loaded = TRUE;
+                }
+                g_free(path);
+            }
+            g_free(suffix);
+        }
+    }
+    g_ptr_array_unref(names);
+
+    return loaded;
+}
+
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    SpiceGlzDecoderWindow *glz_window;
+    SpiceGlzDecoder *glz_decoder;
+    SpiceZlibDecoder *zlib_decoder;
+    SpiceJpegDecoder *jpeg_decoder;
+    display_stream_decoder *mjpeg_decoder;
+    guint8 *surface; /* for the streams, which decode in place */
+    gsize surface_size;
+    GCoroutine coroutine; /* glz waits on images as a channel does */
+} Decoders;
+
+typedef struct {
+    Decoders *d;
+    PayloadType type;
+    Payload *payload;
+    guint pixels;
+} DecodeCall;
+
+/* as canvas_get_glz() does */
+static void decode_glz(Decoders *d, guint8 *data)
+{
+    LzDecodeUsrData usr_data = { NULL, };
+
+    d->glz_decoder->ops->decode(d->glz_decoder, data, NULL, &usr_data);
+    g_assert(usr_data.out_surface != NULL);
+    pixman_image_unref(usr_data.out_surface);
+}
+
+/* returns the number of pixels decoded */
+static guint decode_payload(Decoders *d, PayloadType type, Payload *payload)
+{
+    guint8 *data = payload->data;
+    gsize size = payload->size;
+    int width, height;
+
+    switch (type) {
+    case PAYLOAD_GLZ:
+        decode_glz(d, data);
+        return payload->width * payload->height;
+    case PAYLOAD_ZLIB_GLZ: {
+        /* as canvas_get_zlib_glz_rgb() does */
+        guint8 *glz = g_malloc(payload->glz_size);
+
+        d->zlib_decoder->ops->decode(d->zlib_decoder, data, size, glz, payload->glz_size);
+        decode_glz(d, glz);
+        width = read_32(glz + 9);
+        height = read_32(glz + 13);
+        g_free(glz);
+        return width * height;
+    }
+    case PAYLOAD_JPEG: {
+        /* as canvas_get_jpeg() does, in a new surface */
+        pixman_image_t *surface;
+
+        d->jpeg_decoder->ops->begin_decode(d->jpeg_decoder, data, size, &width, &height);
+        surface = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height, NULL, 0);
+        d->jpeg_decoder->ops->decode(d->jpeg_decoder,
+                                     (guint8 *)pixman_image_get_data(surface),
+                                     pixman_image_get_stride(surface),
+                                     SPICE_BITMAP_FMT_32BIT);
+        pixman_image_unref(surface);
+        return width * height;
+    }
+    case PAYLOAD_MJPEG: {
+        display_frame frame = {
+            .data = data,
+            .data_size = size,
+            .width = payload->width,
+            .height = payload->height,
+            .out_stride = payload->width * 4,
+        };
+
+        if (d->surface_size < (gsize)frame.out_stride * frame.height) {
+            d->surface_size = (gsize)frame.out_stride * frame.height;
+            d->surface = g_realloc(d->surface, d->surface_size);
+        }
+        frame.out = d->surface;
+        g_assert(d->mjpeg_decoder->decode_frame(d->mjpeg_decoder, &frame));
+        return frame.width * frame.height;
+    }
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* decodes the payload of each call decode() resumes it with */
+static gpointer decode_coroutine(gpointer data)
+{
+    DecodeCall *call = data;
+
+    while (call != NULL) {
+        call->pixels = decode_payload(call->d, call->type, call->payload);
+        call = coroutine_yield(NULL);
+    }
+
+    return NULL;
+}
+
+static guint decode(Decoders *d, PayloadType type, Payload *payload)
+{
+    DecodeCall call = { d, type, payload, 0 };
+
+    coroutine_yieldto(&d->coroutine.coroutine, &call);
+
+    return call.pixels;
+}
+
+static gint compare_double(gconstpointer a, gconstpointer b)
+{
+    gdouble x = *(const gdouble *)a, y = *(const gdouble *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void test_decoders(gconstpointer user_data)
+{
+    PayloadType type = GPOINTER_TO_INT(user_data);
+    GPtrArray *payloads = corpus[type];
+    guint passes = g_test_perf() ? 5 : 1;
+    GArray *latencies;
+    Decoders d = { NULL, };
+    GTimer *timer;
+    guint64 pixels = 0;
+#ifdef HAVE_ALLOCATIONS_COUNT
+    gint allocs = 0, freed = 0;
+#endif
+    gdouble total = 0;
+    guint i, pass;
+
+    if (payloads->len == 0) {
+        g_test_message("no %s payload", payload_names[type]);
+        return;
+    }
+
+    d.glz_window = glz_decoder_window_new();
+    d.glz_decoder = glz_decoder_new(d.glz_window);
+    d.zlib_decoder = zlib_decoder_new();
+    d.jpeg_decoder = jpeg_decoder_new();
+    d.mjpeg_decoder = mjpeg_decoder_new(FALSE);
+    d.coroutine.coroutine.stack_size = 16 << 20;
+    d.coroutine.coroutine.entry = decode_coroutine;
+    coroutine_init(&d.coroutine.coroutine);
+
+    latencies = g_array_sized_new(FALSE, FALSE, sizeof(gdouble), payloads->len * passes);
+    timer = g_timer_new();
+    for (pass = 0; pass < passes; pass++) {
+        /* the glz ids start over */
+        glz_decoder_window_clear(d.glz_window);
+
+        for (i = 0; i < payloads->len; i++) {
+            gdouble elapsed;
+#ifdef HAVE_ALLOCATIONS_COUNT
+            gint start = g_atomic_int_get(&allocations);
+            gint start_frees = g_atomic_int_get(&frees);
+#endif
+
+            g_timer_start(timer);
+            pixels += decode(&d, type, g_ptr_array_index(payloads, i));
+            elapsed = g_timer_elapsed(timer, NULL);
+#ifdef HAVE_ALLOCATIONS_COUNT
+            allocs += g_atomic_int_get(&allocations) - start;
+            freed += g_atomic_int_get(&frees) - start_frees;
+#endif
+
+            total += elapsed;
+            g_array_append_val(latencies, elapsed);
+        }
+    }
+    g_timer_destroy(timer);
+    g_array_sort(latencies, compare_double);
+
+    g_test_message("%s: %u images, %.1f MPixel/s, "
+#ifdef HAVE_ALLOCATIONS_COUNT
+                   "%.1f allocations/image, %.1f frees/image, "
+#endif
+                   "p50 %.2f ms, p99 %.2f ms",
+                   payload_names[type], latencies->len, pixels / total / 1e6,
+#ifdef HAVE_ALLOCATIONS_COUNT
+                   (gdouble)allocs / latencies->len, (gdouble)freed / latencies->len,
+#endif
+                   g_array_index(latencies, gdouble, latencies->len / 2) * 1000,
+                   g_array_index(latencies, gdouble, latencies->len * 99 / 100) * 1000);
+    g_test_maximized_result(pixels / total / 1e6, "%s: %.1f MPixel/s",
+                            payload_names[type], pixels / total / 1e6);
+
+    g_array_unref(latencies);
+    /* lets it return, which releases it */
+    coroutine_yieldto(&d.coroutine.coroutine, NULL);
+    g_free(d.surface);
+    d.mjpeg_decoder->destroy(d.mjpeg_decoder);
+    jpeg_decoder_destroy(d.jpeg_decoder);
+    zlib_decoder_destroy(d.zlib_decoder);
+    glz_decoder_destroy(d.glz_decoder);
+    glz_decoder_window_destroy(d.glz_window);
+}
+
+int main(int argc, char* argv[])
+{
+    const gchar *dir = g_getenv("SPICE_DECODERS_CORPUS");
+    int type, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (type = 0; type < PAYLOAD_LAST; type++)
+        corpus[type] = g_ptr_array_new_with_free_func(payload_free);
+
+    if (dir == NULL || !corpus_load(dir)) {
+        /* short enough for make check by default */
+        if (g_test_perf())
+            corpus_generate(1920, 1080, 60);
+        else
+            corpus_generate(640, 480, 6);
+    }
+
+    for (type = 0; type < PAYLOAD_LAST; type++) {
+        gchar *path = g_strdup_printf("/decoders/%s", payload_names[type]);
+
+        g_test_add_data_func(path, GINT_TO_POINTER(type), test_decoders);
+        g_free(path);
+    }
+
+    ret = g_test_run();
+
+    for (type = 0; type < PAYLOAD_LAST; type++)
+        g_ptr_array_unref(corpus[type]);
+
+    return ret;
+}
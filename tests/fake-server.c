@@ -0,0 +1,727 @@
+#include "config.h"
+
+#include <glib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <openssl/rsa.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#include "fake-server.h"
+
+typedef struct {
+    gint64 time; /* us after the main channel link */
+    GByteArray *data; /* with the header */
+} FakeMessage;
+
+typedef struct {
+    guint8 type;
+    guint8 id;
+    GQueue messages; /* FakeMessage */
+    GArray *caps;
+    guint ack_window;
+    guint32 last_pong;
+    FakeServerStats stats;
+} FakeChannel;
+
+struct FakeServer {
+    GMutex *lock; /* stats and connections */
+    GThreadPool *threads;
+    GSList *channels; /* FakeChannel, the main channel first */
+    GSList *connections;
+    EVP_PKEY *key; /* shared, see get_key() */
+    gboolean realtime;
+    gint64 latency; /* before the client messages are seen */
+    gint64 epoch; /* when the main channel was linked */
+    volatile gint done;
+};
+
+typedef struct {
+    guint type; /* G_MAXUINT on disconnection */
+    gint64 time; /* when it was read */
+} FakeEvent;
+
+typedef struct {
+    FakeServer *server;
+    FakeChannel *channel;
+    int fd;
+    GAsyncQueue *events; /* FakeEvent, from the reader */
+    GQueue deferred; /* event types seen while waiting for acks */
+    gboolean window_set;
+    guint window; /* messages sent since the last ack, as spice-server counts */
+} FakeConnection;
+
+/* what the threads of a connection run */
+typedef enum {
+    TASK_WRITER = 1,
+    TASK_READER,
+} Task;
+
+#define PING_ID 0x5350
+
+static void put_8(GByteArray *out, guint8 byte)
+{
+    g_byte_array_append(out, &byte, 1);
+}
+
+static void put_16(GByteArray *out, guint16 word)
+{
+    word = GUINT16_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 2);
+}
+
+static void put_32(GByteArray *out, guint32 word)
+{
+    word = GUINT32_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 4);
+}
+
+static void put_64(GByteArray *out, guint64 word)
+{
+    word = GUINT64_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 8);
+}
+
+static GByteArray *message_new(guint16 msg_type, gconstpointer data, gsize size)
+{
+    GByteArray *msg = g_byte_array_sized_new(sizeof(SpiceMiniDataHeader) + size);
+
+    put_16(msg, msg_type);
+    put_32(msg, size);
+    g_byte_array_append(msg, data, size);
+
+    return msg;
+}
+
+static FakeChannel *fake_channel_new(FakeServer *server, guint8 type, guint8 id)
+{
+    FakeChannel *channel = g_new0(FakeChannel, 1);
+
+    channel->type = type;
+    channel->id = id;
+    channel->caps = g_array_new(FALSE, FALSE, sizeof(guint32));
+    server->channels = g_slist_append(server->channels, channel);
+
+    return channel;
+}
+
+static FakeChannel *fake_channel_find(FakeServer *server, guint8 type, guint8 id)
+{
+    GSList *l;
+
+    for (l = server->channels; l != NULL; l = l->next) {
+        FakeChannel *channel = l->data;
+
+        if (channel->type == type && channel->id == id)
+            return channel;
+    }
+
+    return NULL;
+}
+
+static void fake_channel_free(gpointer data)
+{
+    FakeChannel *channel = data;
+    FakeMessage *msg;
+
+    while ((msg = g_queue_pop_head(&channel->messages)) != NULL) {
+        g_byte_array_unref(msg->data);
+        g_free(msg);
+    }
+    g_array_free(channel->caps, TRUE);
+    g_free(channel);
+}
+
+/* ------------------------------------------------------------------ */
+
+static gboolean read_all(int fd, gpointer data, gsize size)
+{
+    guint8 *p = data;
+
+    while (size > 0) {
+        ssize_t rc = read(fd, p, size);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return FALSE;
+        p += rc;
+        size -= rc;
+    }
+
+    return TRUE;
+}
+
+static gboolean write_all(int fd, gconstpointer data, gsize size)
+{
+    const guint8 *p = data;
+
+    while (size > 0) {
+        ssize_t rc = send(fd, p, size, MSG_NOSIGNAL);
+
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return FALSE;
+        p += rc;
+        size -= rc;
+    }
+
+    return TRUE;
+}
+
+/* the next client message type, once the latency elapsed */
+static guint connection_pop(FakeConnection *conn)
+{
+    FakeServer *server = conn->server;
+    FakeChannel *channel = conn->channel;
+    FakeEvent *event = g_async_queue_pop(conn->events);
+    gint64 delay = event->time + server->latency - g_get_monotonic_time();
+    guint type = event->type;
+
+    g_free(event);
+    if (delay > 0 && type != G_MAXUINT)
+        g_usleep(delay);
+
+    if (type == SPICE_MSGC_ACK && conn->window_set) {
+        g_mutex_lock(server->lock);
+        channel->stats.acks++;
+        /* spice-server's counter is unsigned, it would wrap around */
+        if (conn->window < channel->ack_window)
+            channel->stats.window_violations++;
+        else
+            conn->window -= channel->ack_window;
+        g_mutex_unlock(server->lock);
+    }
+
+    return type;
+}
+
+/* waits for a client message of @msg_type, FALSE on disconnection */
+static gboolean connection_wait(FakeConnection *conn, guint16 msg_type)
+{
+    for (;;) {
+        guint type;
+
+        if (!g_queue_is_empty(&conn->deferred))
+            type = GPOINTER_TO_UINT(g_queue_pop_head(&conn->deferred));
+        else
+            type = connection_pop(conn);
+
+        if (type == G_MAXUINT)
+            return FALSE;
+        if (type == msg_type)
+            return TRUE;
+    }
+}
+
+/* as spice-server, which stops sending past twice the window */
+static gboolean connection_wait_window(FakeConnection *conn)
+{
+    FakeServer *server = conn->server;
+    FakeChannel *channel = conn->channel;
+    gboolean stalled = FALSE;
+
+    if (!conn->window_set)
+        return TRUE;
+
+    while (conn->window > 2 * channel->ack_window) {
+        guint type;
+
+        if (!stalled) {
+            g_mutex_lock(server->lock);
+            channel->stats.window_stalls++;
+            g_mutex_unlock(server->lock);
+            stalled = TRUE;
+        }
+
+        type = connection_pop(conn);
+        if (type == G_MAXUINT)
+            return FALSE;
+        if (type != SPICE_MSGC_ACK)
+            g_queue_push_tail(&conn->deferred, GUINT_TO_POINTER(type));
+    }
+
+    return TRUE;
+}
+
+static gboolean connection_send(FakeConnection *conn, GByteArray *msg)
+{
+    FakeServer *server = conn->server;
+
+    if (!connection_wait_window(conn) ||
+        !write_all(conn->fd, msg->data, msg->len))
+        return FALSE;
+    conn->window++;
+
+    g_mutex_lock(server->lock);
+    conn->channel->stats.messages++;
+    conn->channel->stats.bytes += msg->len;
+    g_mutex_unlock(server->lock);
+
+    return TRUE;
+}
+
+/* the window starts counting once the client synced with it */
+static gboolean connection_set_ack(FakeConnection *conn)
+{
+    GByteArray *ack = g_byte_array_new();
+    GByteArray *msg;
+    gboolean ret;
+
+    put_32(ack, 1); /* generation */
+    put_32(ack, conn->channel->ack_window);
+    msg = message_new(SPICE_MSG_SET_ACK, ack->data, ack->len);
+    ret = connection_send(conn, msg) &&
+        connection_wait(conn, SPICE_MSGC_ACK_SYNC);
+    g_byte_array_unref(msg);
+    g_byte_array_unref(ack);
+
+    conn->window_set = TRUE;
+    conn->window = 0;
+
+    return ret;
+}
+
+/* as spice_channel_send_link() and spice_channel_recv_link_msg() expect */
+static FakeChannel *connection_link(FakeConnection *conn)
+{
+    FakeServer *server = conn->server;
+    SpiceLinkHeader header;
+    SpiceLinkMess *link;
+    SpiceLinkReply reply = { 0, };
+    SpiceLinkAuthMechanism auth;
+    FakeChannel *channel;
+    guint8 *ticket, *key;
+    guint32 caps = 0, result = SPICE_LINK_ERR_OK;
+    int ticket_size;
+
+    if (!read_all(conn->fd, &header, sizeof(header)) ||
+        header.magic != SPICE_MAGIC ||
+        header.major_version != SPICE_VERSION_MAJOR ||
+        header.size < sizeof(SpiceLinkMess))
+        return NULL;
+
+    link = g_malloc(header.size);
+    if (!read_all(conn->fd, link, header.size)) {
+        g_free(link);
+        return NULL;
+    }
+
+    g_mutex_lock(server->lock);
+    channel = fake_channel_find(server, link->channel_type, link->channel_id);
+    g_mutex_unlock(server->lock);
+    g_free(link);
+    if (channel == NULL) {
+        g_warning("unknown channel");
+        return NULL;
+    }
+
+    caps |= 1 << SPICE_COMMON_CAP_PROTOCOL_AUTH_SELECTION;
+    caps |= 1 << SPICE_COMMON_CAP_AUTH_SPICE;
+    caps |= 1 << SPICE_COMMON_CAP_MINI_HEADER;
+
+    header.magic = SPICE_MAGIC;
+    header.major_version = SPICE_VERSION_MAJOR;
+    header.minor_version = SPICE_VERSION_MINOR;
+    header.size = sizeof(reply) + sizeof(caps) + channel->caps->len * sizeof(guint32);
+    key = reply.pub_key;
+    g_assert_cmpint(i2d_PUBKEY(server->key, &key), ==, SPICE_TICKET_PUBKEY_BYTES);
+    reply.num_common_caps = 1;
+    reply.num_channel_caps = channel->caps->len;
+    reply.caps_offset = sizeof(reply);
+    if (!write_all(conn->fd, &header, sizeof(header)) ||
+        !write_all(conn->fd, &reply, sizeof(reply)) ||
+        !write_all(conn->fd, &caps, sizeof(caps)) ||
+        !write_all(conn->fd, channel->caps->data, channel->caps->len * sizeof(guint32)))
+        return NULL;
+
+    /* any password will do */
+    ticket_size = EVP_PKEY_size(server->key);
+    ticket = g_alloca(ticket_size);
+    if (!read_all(conn->fd, &auth, sizeof(auth)) ||
+        auth.auth_mechanism != SPICE_COMMON_CAP_AUTH_SPICE ||
+        !read_all(conn->fd, ticket, ticket_size) ||
+        !write_all(conn->fd, &result, sizeof(result)))
+        return NULL;
+
+    return channel;
+}
+
+static gboolean connection_send_main_init(FakeConnection *conn)
+{
+    FakeServer *server = conn->server;
+    GByteArray *init = g_byte_array_new();
+    GByteArray *list = g_byte_array_new();
+    GByteArray *msg;
+    GSList *l;
+    gboolean ret;
+
+    put_32(init, 1); /* session_id */
+    put_32(init, 1); /* display_channels_hint */
+    put_32(init, SPICE_MOUSE_MODE_SERVER); /* supported_mouse_modes */
+    put_32(init, SPICE_MOUSE_MODE_SERVER); /* current_mouse_mode */
+    put_32(init, 1); /* agent_connected */
+    put_32(init, 10); /* agent_tokens */
+    put_32(init, 0); /* multi_media_time */
+    put_32(init, 0); /* ram_hint */
+    msg = message_new(SPICE_MSG_MAIN_INIT, init->data, init->len);
+    ret = connection_send(conn, msg);
+    g_byte_array_unref(msg);
+    g_byte_array_unref(init);
+    if (!ret || !connection_wait(conn, SPICE_MSGC_MAIN_ATTACH_CHANNELS)) {
+        g_byte_array_unref(list);
+        return FALSE;
+    }
+
+    put_32(list, g_slist_length(server->channels) - 1);
+    for (l = server->channels->next; l != NULL; l = l->next) {
+        FakeChannel *channel = l->data;
+
+        put_8(list, channel->type);
+        put_8(list, channel->id);
+    }
+    msg = message_new(SPICE_MSG_MAIN_CHANNELS_LIST, list->data, list->len);
+    ret = connection_send(conn, msg);
+    g_byte_array_unref(msg);
+    g_byte_array_unref(list);
+
+    return ret;
+}
+
+static void connection_write(FakeConnection *conn)
+{
+    FakeServer *server = conn->server;
+    FakeChannel *channel = conn->channel;
+    GByteArray *ping, *msg;
+    GList *l;
+    gint64 epoch, ping_time;
+
+    if (channel->ack_window != 0 && !connection_set_ack(conn))
+        return;
+
+    if (channel->type == SPICE_CHANNEL_MAIN) {
+        g_mutex_lock(server->lock);
+        server->epoch = g_get_monotonic_time();
+        g_mutex_unlock(server->lock);
+        if (!connection_send_main_init(conn))
+            return;
+    }
+
+    g_mutex_lock(server->lock);
+    channel->stats.start = g_get_monotonic_time();
+    epoch = server->epoch;
+    g_mutex_unlock(server->lock);
+
+    for (l = channel->messages.head; l != NULL; l = l->next) {
+        FakeMessage *queued = l->data;
+
+        if (server->realtime) {
+            gint64 delay = epoch + queued->time - g_get_monotonic_time();
+
+            if (delay > 0)
+                g_usleep(delay);
+        }
+        if (!connection_send(conn, queued->data))
+            return;
+    }
+
+    ping_time = g_get_monotonic_time();
+    ping = g_byte_array_new();
+    put_32(ping, PING_ID);
+    put_64(ping, ping_time);
+    msg = message_new(SPICE_MSG_PING, ping->data, ping->len);
+    g_byte_array_unref(ping);
+    if (!connection_send(conn, msg) ||
+        !connection_wait(conn, SPICE_MSGC_PONG)) {
+        g_byte_array_unref(msg);
+        return;
+    }
+    g_byte_array_unref(msg);
+
+    g_mutex_lock(server->lock);
+    channel->stats.end = g_get_monotonic_time();
+    channel->stats.ping_rtt = channel->stats.end - ping_time;
+    g_mutex_unlock(server->lock);
+    g_atomic_int_inc(&server->done);
+    g_main_context_wakeup(NULL);
+}
+
+/* the client messages, the events the writer waits for */
+static void connection_read(FakeConnection *conn)
+{
+    FakeServer *server = conn->server;
+    SpiceMiniDataHeader header;
+    FakeEvent *event;
+    guint8 *data;
+
+    while (read_all(conn->fd, &header, sizeof(header))) {
+        gint64 now = g_get_monotonic_time();
+
+        data = g_malloc(header.size);
+        if (!read_all(conn->fd, data, header.size)) {
+            g_free(data);
+            break;
+        }
+
+        g_mutex_lock(server->lock);
+        conn->channel->stats.client_messages++;
+        conn->channel->stats.client_bytes += sizeof(header) + header.size;
+        g_mutex_unlock(server->lock);
+
+        /* the pongs to the queued pings are only counted */
+        if (header.type == SPICE_MSGC_PONG &&
+            header.size >= sizeof(guint32) && *(guint32 *)data != PING_ID) {
+            guint32 ping_id = GUINT32_FROM_LE(*(guint32 *)data);
+
+            g_mutex_lock(server->lock);
+            conn->channel->stats.pongs++;
+            if (ping_id <= conn->channel->last_pong)
+                conn->channel->stats.pongs_out_of_order++;
+            conn->channel->last_pong = ping_id;
+            g_mutex_unlock(server->lock);
+            g_free(data);
+            continue;
+        }
+        event = g_new(FakeEvent, 1);
+        event->type = header.type;
+        event->time = now;
+        g_async_queue_push(conn->events, event);
+        g_free(data);
+    }
+
+    event = g_new(FakeEvent, 1);
+    event->type = G_MAXUINT;
+    event->time = g_get_monotonic_time();
+    g_async_queue_push(conn->events, event);
+}
+
+typedef struct {
+    FakeConnection *conn;
+    Task task;
+} FakeTask;
+
+static void thread_push(FakeConnection *conn, Task task)
+{
+    FakeTask *t = g_new(FakeTask, 1);
+
+    t->conn = conn;
+    t->task = task;
+    g_thread_pool_push(conn->server->threads, t, NULL);
+}
+
+static void thread_func(gpointer data, gpointer user_data)
+{
+    FakeConnection *conn = ((FakeTask *)data)->conn;
+    Task task = ((FakeTask *)data)->task;
+
+    g_free(data);
+
+    if (task == TASK_READER) {
+        connection_read(conn);
+        return;
+    }
+
+    conn->channel = connection_link(conn);
+    if (conn->channel == NULL) {
+        shutdown(conn->fd, SHUT_RDWR);
+        return;
+    }
+
+    /* no reading before the link is done */
+    thread_push(conn, TASK_READER);
+    connection_write(conn);
+}
+
+/* ------------------------------------------------------------------ */
+
+/* main context */
+static void open_fd(SpiceChannel *channel, gint with_tls, gpointer user_data)
+{
+    FakeServer *server = user_data;
+    FakeConnection *conn;
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        g_warning("socketpair failed: %s", g_strerror(errno));
+        return;
+    }
+
+    conn = g_new0(FakeConnection, 1);
+    conn->server = server;
+    conn->fd = sv[0];
+    conn->events = g_async_queue_new_full(g_free);
+    g_mutex_lock(server->lock);
+    server->connections = g_slist_prepend(server->connections, conn);
+    g_mutex_unlock(server->lock);
+
+    thread_push(conn, TASK_WRITER);
+    spice_channel_open_fd(channel, sv[1]);
+}
+
+/* main context */
+static void channel_new(SpiceSession *session, SpiceChannel *channel, gpointer user_data)
+{
+    g_signal_connect(channel, "open-fd", G_CALLBACK(open_fd), user_data);
+}
+
+/* the ticket public key is that of a 1024 bits RSA key, generating
+ * one takes a while, all the servers of the process share it */
+static EVP_PKEY *get_key(void)
+{
+    static gsize key = 0;
+
+    if (g_once_init_enter(&key)) {
+        EVP_PKEY *pkey = EVP_PKEY_new();
+        RSA *rsa = RSA_new();
+        BIGNUM *e = BN_new();
+
+        BN_set_word(e, RSA_F4);
+        g_assert(RSA_generate_key_ex(rsa, 1024, e, NULL));
+        BN_free(e);
+        EVP_PKEY_assign_RSA(pkey, rsa);
+        g_once_init_leave(&key, (gsize)pkey);
+    }
+
+    return (EVP_PKEY *)key;
+}
+
+FakeServer *fake_server_new(void)
+{
+    FakeServer *server = g_new0(FakeServer, 1);
+
+#if !GLIB_CHECK_VERSION(2,31,0)
+    if (!g_thread_supported())
+        g_thread_init(NULL);
+#endif
+    server->lock = g_new0(GMutex, 1);
+#if GLIB_CHECK_VERSION(2,32,0)
+    g_mutex_init(server->lock);
+#else
+    g_free(server->lock);
+    server->lock = g_mutex_new();
+#endif
+    /* a thread for each side of each connection */
+    server->threads = g_thread_pool_new(thread_func, NULL, -1, FALSE, NULL);
+    fake_channel_new(server, SPICE_CHANNEL_MAIN, 0);
+    server->key = get_key();
+
+    return server;
+}
+
+void fake_server_free(FakeServer *server)
+{
+    GSList *l;
+
+    /* the threads stop when the connections are shut down */
+    g_mutex_lock(server->lock);
+    for (l = server->connections; l != NULL; l = l->next) {
+        FakeConnection *conn = l->data;
+
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    g_mutex_unlock(server->lock);
+    g_thread_pool_free(server->threads, FALSE, TRUE);
+
+    for (l = server->connections; l != NULL; l = l->next) {
+        FakeConnection *conn = l->data;
+
+        close(conn->fd);
+        g_async_queue_unref(conn->events);
+        g_queue_clear(&conn->deferred);
+        g_free(conn);
+    }
+    g_slist_free(server->connections);
+    g_slist_free_full(server->channels, fake_channel_free);
+#if GLIB_CHECK_VERSION(2,32,0)
+    g_mutex_clear(server->lock);
+    g_free(server->lock);
+#else
+    g_mutex_free(server->lock);
+#endif
+    g_free(server);
+}
+
+void fake_server_add_channel(FakeServer *server, guint8 type, guint8 id)
+{
+    g_return_if_fail(fake_channel_find(server, type, id) == NULL);
+
+    fake_channel_new(server, type, id);
+}
+
+void fake_server_queue(FakeServer *server, guint8 type, guint8 id,
+                       guint16 msg_type, gconstpointer data, gsize size)
+{
+    fake_server_queue_at(server, type, id, 0, msg_type, data, size);
+}
+
+void fake_server_queue_at(FakeServer *server, guint8 type, guint8 id, gint64 time,
+                          guint16 msg_type, gconstpointer data, gsize size)
+{
+    FakeChannel *channel = fake_channel_find(server, type, id);
+    FakeMessage *msg;
+
+    g_return_if_fail(channel != NULL);
+
+    msg = g_new(FakeMessage, 1);
+    msg->time = time;
+    msg->data = message_new(msg_type, data, size);
+    g_queue_push_tail(&channel->messages, msg);
+}
+
+void fake_server_set_caps(FakeServer *server, guint8 type, guint8 id,
+                          const guint32 *caps, guint n_caps)
+{
+    FakeChannel *channel = fake_channel_find(server, type, id);
+
+    g_return_if_fail(channel != NULL);
+
+    g_array_set_size(channel->caps, 0);
+    g_array_append_vals(channel->caps, caps, n_caps);
+}
+
+void fake_server_set_realtime(FakeServer *server, gboolean realtime)
+{
+    server->realtime = realtime;
+}
+
+void fake_server_set_ack_window(FakeServer *server, guint8 type, guint8 id, guint window)
+{
+    FakeChannel *channel = fake_channel_find(server, type, id);
+
+    g_return_if_fail(channel != NULL);
+
+    channel->ack_window = window;
+}
+
+void fake_server_set_latency(FakeServer *server, gint64 latency)
+{
+    server->latency = latency;
+}
+
+void fake_server_connect(FakeServer *server, SpiceSession *session)
+{
+    g_signal_connect(session, "channel-new", G_CALLBACK(channel_new), server);
+}
+
+gboolean fake_server_is_done(FakeServer *server)
+{
+    return (guint)g_atomic_int_get(&server->done) == g_slist_length(server->channels);
+}
+
+gboolean fake_server_get_stats(FakeServer *server, guint8 type, guint8 id,
+                               FakeServerStats *stats)
+{
+    FakeChannel *channel = fake_channel_find(server, type, id);
+
+    if (channel == NULL)
+        return FALSE;
+
+    g_mutex_lock(server->lock);
+    *stats = channel->stats;
+    g_mutex_unlock(server->lock);
+
+    return TRUE;
+}
@@ -0,0 +1,69 @@
+#ifndef FAKE_SERVER_H
+#define FAKE_SERVER_H
+
+#include <glib.h>
+
+#include "spice-client.h"
+
+G_BEGIN_DECLS
+
+/*
+ * A stand-in for a spice server, enough to link the channels of a
+ * session, over socket pairs given to SpiceChannel::open-fd, and send
+ * them scripted messages. Each channel is served by its own threads,
+ * the messages are written with the mini header, as fast as the client
+ * reads them, and followed by a ping: when the pong comes back, the
+ * client handled all of them. The pongs to pings queued with
+ * increasing ids, other than 0x5350 of the final ping, tell whether
+ * the client handled the messages in order.
+ */
+typedef struct FakeServer FakeServer;
+
+typedef struct {
+    guint64 messages; /* sent to the client, after the link */
+    guint64 bytes;
+    guint64 client_messages;
+    guint64 client_bytes;
+    gint64 start; /* monotonic time of the first queued message */
+    gint64 end; /* monotonic time of the final pong */
+    guint64 acks;
+    guint64 window_stalls; /* times the server waited for an ack */
+    guint64 window_violations; /* acks for messages not sent yet */
+    guint64 pongs; /* answers to the queued pings */
+    guint64 pongs_out_of_order; /* with an id below that of the previous one */
+    gint64 ping_rtt; /* us, from the final ping to its pong */
+} FakeServerStats;
+
+FakeServer *fake_server_new(void);
+void fake_server_free(FakeServer *server);
+
+/* the channels announced to the client, besides the main channel */
+void fake_server_add_channel(FakeServer *server, guint8 type, guint8 id);
+/* a message to send on a channel once linked, data is copied */
+void fake_server_queue(FakeServer *server, guint8 type, guint8 id,
+                       guint16 msg_type, gconstpointer data, gsize size);
+/* the same, to send @time us after the main channel link when the
+ * server is realtime, rather than as fast as possible */
+void fake_server_queue_at(FakeServer *server, guint8 type, guint8 id, gint64 time,
+                          guint16 msg_type, gconstpointer data, gsize size);
+/* the channel capabilities announced in the link reply */
+void fake_server_set_caps(FakeServer *server, guint8 type, guint8 id,
+                          const guint32 *caps, guint n_caps);
+void fake_server_set_realtime(FakeServer *server, gboolean realtime);
+/* sends SET_ACK first, and then waits for the client acks as
+ * spice-server does, a @window of 0 doesn't */
+void fake_server_set_ack_window(FakeServer *server, guint8 type, guint8 id, guint window);
+/* the client messages are seen by the server @latency us after they
+ * were sent, as over a link with that round trip */
+void fake_server_set_latency(FakeServer *server, gint64 latency);
+
+/* serves @session, which is then opened with spice_session_open_fd() */
+void fake_server_connect(FakeServer *server, SpiceSession *session);
+/* whether all the channels got the pong to their final ping */
+gboolean fake_server_is_done(FakeServer *server);
+gboolean fake_server_get_stats(FakeServer *server, guint8 type, guint8 id,
+                               FakeServerStats *stats);
+
+G_END_DECLS
+
+#endif /* FAKE_SERVER_H */
@@ -0,0 +1,208 @@
+#include "config.h"
+
+#include <glib.h>
+
+#include "glz-encoder.h"
+
+#define MAX_MATCH 4096
+
+static void put_32(GByteArray *out, guint32 word)
+{
+    guint8 bytes[4] = { word >> 24, word >> 16, word >> 8, word };
+
+    g_byte_array_append(out, bytes, 4);
+}
+
+static void put_8(GByteArray *out, guint8 byte)
+{
+    g_byte_array_append(out, &byte, 1);
+}
+
+static void put_literal(GByteArray *out, LzImageType type, guint32 symbol)
+{
+    switch (type) {
+    case LZ_IMAGE_TYPE_RGB16:
+        put_8(out, symbol >> 8);
+        put_8(out, symbol);
+        break;
+    case LZ_IMAGE_TYPE_PLT8:
+    case LZ_IMAGE_TYPE_XXXA:
+        put_8(out, symbol);
+        break;
+    default:
+        put_8(out, symbol);
+        put_8(out, symbol >> 8);
+        put_8(out, symbol >> 16);
+        break;
+    }
+}
+
+static void put_ref(GByteArray *out, guint len, guint32 ofs, guint32 image_dist)
+{
+    gboolean long_ofs;
+    guint8 ctrl;
+
+    if (image_dist == 0)
+        ofs--; /* offset is biased by 1 */
+    long_ofs = ofs >= (1 << 12) || image_dist >= (1 << 6);
+
+    ctrl = (MIN(len, 7) << 5) | (long_ofs << 4) | (ofs & 0x0f);
+    put_8(out, ctrl);
+    if (len >= 7) {
+        for (len -= 7; len >= 255; len -= 255)
+            put_8(out, 255);
+        put_8(out, len);
+    }
+    put_8(out, ofs >> 4);
+
+    if (!long_ofs) {
+        put_8(out, image_dist);
+    } else {
+        guint n = image_dist == 0 ? 0 : image_dist < (1 << 8) ? 1 : image_dist < (1 << 16) ? 2 : 3;
+        gboolean very_long_ofs = ofs >= (1 << 17);
+        guint i;
+
+        put_8(out, (n << 6) | (very_long_ofs << 5) | ((ofs >> 12) & 0x1f));
+        for (i = 0; i < n; i++)
+            put_8(out, image_dist >> (8 * i));
+        if (very_long_ofs)
+            put_8(out, ofs >> 17);
+    }
+}
+
+static guint match_len(const guint32 *a, const guint32 *b, guint max)
+{
+    guint len = 0;
+
+    while (len < max && a[len] == b[len])
+        len++;
+
+    return len;
+}
+
+/* the matches are at least that long, how much depends on the type */
+static guint len_bias(LzImageType type)
+{
+    switch (type) {
+    case LZ_IMAGE_TYPE_RGB16:
+        return 1;
+    case LZ_IMAGE_TYPE_RGB24:
+    case LZ_IMAGE_TYPE_RGB32:
+    case LZ_IMAGE_TYPE_RGBA:
+        return 0;
+    default:
+        /* the palettes and the alpha channel */
+        return 2;
+    }
+}
+
+/* tries runs, short patterns, the row above and the same place in the
+ * previous image */
+static void encode_stream(GByteArray *out, LzImageType type, guint width,
+                          const guint32 *symbols, const guint32 *prev, guint n)
+{
+    const guint offsets[] = { 1, 2, 3, 4, 5, 10, width };
+    guint pos = 0, literals = 0, literals_pos = 0;
+
+    while (pos < n) {
+        guint max = MIN(n - pos, MAX_MATCH);
+        guint best_len = 0, best_ofs = 0, image_dist = 0;
+        guint i, len;
+
+        for (i = 0; i < G_N_ELEMENTS(offsets); i++) {
+            if (offsets[i] > pos)
+                break;
+            len = match_len(symbols + pos, symbols + pos - offsets[i], max);
+            if (len > best_len) {
+                best_len = len;
+                best_ofs = offsets[i];
+            }
+        }
+        if (prev != NULL) {
+            len = match_len(symbols + pos, prev + pos, max);
+            if (len > best_len) {
+                best_len = len;
+                best_ofs = pos;
+                image_dist = 1;
+            }
+        }
+
+        if (best_len < 3) {
+            if (literals == 0 || literals == MAX_COPY) {
+                literals_pos = out->len;
+                literals = 0;
+                put_8(out, 0);
+            }
+            put_literal(out, type, symbols[pos]);
+            out->data[literals_pos] = literals++;
+            pos++;
+            continue;
+        }
+
+        literals = 0;
+        put_ref(out, best_len - len_bias(type), best_ofs, image_dist);
+        pos += best_len;
+    }
+}
+
+GByteArray *glz_encode(LzImageType type, guint width, guint height, guint64 id,
+                       const guint32 *symbols, const guint32 *alpha,
+                       const guint32 *prev, const guint32 *prev_alpha)
+{
+    GByteArray *out = g_byte_array_new();
+    guint stride = type == LZ_IMAGE_TYPE_PLT8 ? width : width * 4;
+
+    g_return_val_if_fail(type == LZ_IMAGE_TYPE_PLT8 || type == LZ_IMAGE_TYPE_RGB16 ||
+                         type == LZ_IMAGE_TYPE_RGB32 || type == LZ_IMAGE_TYPE_RGBA, NULL);
+
+    put_32(out, LZ_MAGIC);
+    put_32(out, LZ_VERSION);
+    put_8(out, type | (1 << LZ_IMAGE_TYPE_LOG)); /* top down */
+    put_32(out, width);
+    put_32(out, height);
+    put_32(out, stride);
+    put_32(out, id >> 32);
+    put_32(out, id);
+    put_32(out, prev != NULL ? 1 : 0); /* win_head_dist */
+
+    encode_stream(out, type, width, symbols, prev, width * height);
+    if (type == LZ_IMAGE_TYPE_RGBA)
+        encode_stream(out, LZ_IMAGE_TYPE_XXXA, width, alpha, prev_alpha, width * height);
+
+    return out;
+}
+
+/* the id is right after the 21 bytes of magic, version, type and sizes */
+void glz_encode_set_id(GByteArray *image, guint64 id)
+{
+    guint i;
+
+    for (i = 0; i < 8; i++)
+        image->data[21 + i] = id >> (56 - 8 * i);
+}
+
+/* how many images before this one the decoder keeps, after the id */
+void glz_encode_set_win_head_dist(GByteArray *image, guint32 dist)
+{
+    guint i;
+
+    for (i = 0; i < 4; i++)
+        image->data[29 + i] = dist >> (24 - 8 * i);
+}
+
+/* a solid background, text, a gradient, and a striped border, with a
+ * few repeated rows */
+guint32 glz_encode_desktop_pixel(guint width, guint x, guint y, guint frame)
+{
+    if (frame > 0 && x >= 100 + frame * 8 && x < 300 + frame * 8 && y >= 200 && y < 400)
+        return 0x3366cc;
+    if (y % 16 == 15)
+        y--;
+    if (x < width / 4)
+        return 0x202020;
+    if (x < width / 2)
+        return ((x / 2 + y) % 5 == 0) ? 0xf0f0f0 : 0x202020;
+    if (x < width * 3 / 4)
+        return ((x * 7) & 0xff) << 16 | ((y * 3) & 0xff) << 8 | ((x ^ y) & 0xff);
+    return (x % 3 == 0) ? 0x808080 : (x % 3 == 1) ? 0xc0c0c0 : 0x404040;
+}
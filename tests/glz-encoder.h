@@ -0,0 +1,29 @@
+#ifndef GLZ_ENCODER_H
+#define GLZ_ENCODER_H
+
+#include <glib.h>
+
+#include "common/lz_common.h"
+
+G_BEGIN_DECLS
+
+/*
+ * A greedy glz encoder, good enough to produce payloads for the decoder
+ * tests and benchmarks. The symbols are 0xRRGGBB pixels, or 16 bits
+ * pixels, or palette indexes, depending on the image type, and @alpha
+ * is only used by rgba images. When @prev is set, the image references
+ * the previous one in the dictionary.
+ */
+GByteArray *glz_encode(LzImageType type, guint width, guint height, guint64 id,
+                       const guint32 *symbols, const guint32 *alpha,
+                       const guint32 *prev, const guint32 *prev_alpha);
+void glz_encode_set_id(GByteArray *image, guint64 id);
+void glz_encode_set_win_head_dist(GByteArray *image, guint32 dist);
+
+/* something resembling a desktop, frames after the first only differ
+ * by a moving box */
+guint32 glz_encode_desktop_pixel(guint width, guint x, guint y, guint frame);
+
+G_END_DECLS
+
+#endif /* GLZ_ENCODER_H */
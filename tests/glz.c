@@ -0,0 +1,414 @@
+#include "config.h"
+
+#include <glib.h>
+#include <string.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "decode.h"
+#include "gio-coroutine.h"
+#include "common/canvas_utils.h"
+#include "common/lz_common.h"
+
+#include "glz-encoder.h"
+
+/* large enough to make the per-image overhead negligible */
+#define WIDTH 1024
+#define HEIGHT 768
+
+typedef struct {
+    const char *name;
+    LzImageType type;
+} Format;
+
+static const Format formats[] = {
+    { "rgb32", LZ_IMAGE_TYPE_RGB32 },
+    { "rgba", LZ_IMAGE_TYPE_RGBA },
+    { "rgb16", LZ_IMAGE_TYPE_RGB16 },
+    { "plt8", LZ_IMAGE_TYPE_PLT8 },
+};
+
+static guint32 palette_ents[16];
+
+/* the text and the gradient are opaque, not the border */
+static guint32 desktop_alpha(int x, int y, int frame)
+{
+    if (x < WIDTH * 3 / 4)
+        return 0xff;
+    return (y + frame) & 0xff;
+}
+
+static guint16 to_rgb16(guint32 rgb)
+{
+    return ((rgb >> 9) & 0x7c00) | ((rgb >> 6) & 0x03e0) | ((rgb >> 3) & 0x001f);
+}
+
+static guint32 from_rgb16(guint16 p)
+{
+    guint32 r = (p >> 10) & 0x1f, g = (p >> 5) & 0x1f, b = p & 0x1f;
+
+    r = (r << 3) | (r >> 2);
+    g = (g << 3) | (g >> 2);
+    b = (b << 3) | (b >> 2);
+    return (r << 16) | (g << 8) | b;
+}
+
+static guint32 to_plt8(guint32 rgb)
+{
+    return ((rgb >> 16) ^ (rgb >> 8) ^ rgb) & 0x0f;
+}
+
+/* the symbols the encoder works on, and the decoded pixels */
+static void make_frame(const Format *format, int frame,
+                       guint32 *symbols, guint32 *alpha, guint32 *expected)
+{
+    int x, y;
+
+    for (y = 0; y < HEIGHT; y++) {
+        for (x = 0; x < WIDTH; x++) {
+            guint32 rgb = glz_encode_desktop_pixel(WIDTH, x, y, frame);
+            int i = y * WIDTH + x;
+
+            switch (format->type) {
+            case LZ_IMAGE_TYPE_RGB16:
+                symbols[i] = to_rgb16(rgb);
+                expected[i] = from_rgb16(symbols[i]);
+                break;
+            case LZ_IMAGE_TYPE_PLT8:
+                symbols[i] = to_plt8(rgb);
+                expected[i] = palette_ents[symbols[i]];
+                break;
+            case LZ_IMAGE_TYPE_RGBA:
+                symbols[i] = rgb;
+                alpha[i] = desktop_alpha(x, y, frame);
+                expected[i] = rgb | alpha[i] << 24;
+                break;
+            default:
+                symbols[i] = rgb;
+                expected[i] = rgb;
+                break;
+            }
+        }
+    }
+}
+
+typedef struct {
+    SpiceGlzDecoderWindow *window;
+    SpiceGlzDecoder *decoder;
+    SpicePalette *palette;
+    GCoroutine coroutine; /* the decoder waits on images as a channel does */
+} Fixture;
+
+typedef struct {
+    SpiceGlzDecoder *decoder;
+    SpicePalette *palette;
+    GByteArray *frame;
+    pixman_image_t *surface;
+    gboolean done;
+} DecodeCall;
+
+/* decodes the frame of each call it is resumed with, it returns to
+ * the caller early if it waits for an image */
+static gpointer decode_coroutine(gpointer data)
+{
+    DecodeCall *call = data;
+
+    while (call != NULL) {
+        LzDecodeUsrData usr_data = { NULL, };
+
+        call->decoder->ops->decode(call->decoder, call->frame->data,
+                                   call->palette, &usr_data);
+        call->surface = usr_data.out_surface;
+        call->done = TRUE;
+        call = coroutine_yield(NULL);
+    }
+
+    return NULL;
+}
+
+static void decode_coroutine_init(GCoroutine *coroutine)
+{
+    coroutine->coroutine.stack_size = 16 << 20;
+    coroutine->coroutine.entry = decode_coroutine;
+    coroutine_init(&coroutine->coroutine);
+}
+
+static void fixture_setup(Fixture *f, gconstpointer user_data)
+{
+    guint i;
+
+    for (i = 0; i < G_N_ELEMENTS(palette_ents); i++)
+        palette_ents[i] = (i * 0x3f1f2f) & 0xffffff;
+
+    f->window = glz_decoder_window_new();
+    f->decoder = glz_decoder_new(f->window);
+    f->palette = g_malloc0(sizeof(SpicePalette) + sizeof(palette_ents));
+    f->palette->num_ents = G_N_ELEMENTS(palette_ents);
+    memcpy(f->palette->ents, palette_ents, sizeof(palette_ents));
+
+    decode_coroutine_init(&f->coroutine);
+}
+
+static void fixture_teardown(Fixture *f, gconstpointer user_data)
+{
+    /* lets it return, which releases it */
+    coroutine_yieldto(&f->coroutine.coroutine, NULL);
+    glz_decoder_destroy(f->decoder);
+    glz_decoder_window_destroy(f->window);
+    g_free(f->palette);
+}
+
+static pixman_image_t *decode_frame(Fixture *f, GByteArray *frame)
+{
+    DecodeCall call = { f->decoder, f->palette, frame, NULL, FALSE };
+
+    coroutine_yieldto(&f->coroutine.coroutine, &call);
+    g_assert(call.done);
+    g_assert(call.surface != NULL);
+
+    return call.surface;
+}
+
+static void check_frame(pixman_image_t *surface, const guint32 *expected,
+                        gboolean has_alpha)
+{
+    guint8 *data = (guint8 *)pixman_image_get_data(surface);
+    int stride = pixman_image_get_stride(surface);
+    guint32 mask = has_alpha ? 0xffffffff : 0x00ffffff;
+    int x, y;
+
+    g_assert_cmpint(pixman_image_get_width(surface), ==, WIDTH);
+    g_assert_cmpint(pixman_image_get_height(surface), ==, HEIGHT);
+    for (y = 0; y < HEIGHT; y++) {
+        guint32 *row = (guint32 *)(data + y * stride);
+
+        for (x = 0; x < WIDTH; x++)
+            g_assert_cmphex(row[x] & mask, ==, expected[y * WIDTH + x]);
+    }
+}
+
+static void test_glz_decode(Fixture *f, gconstpointer user_data)
+{
+    const Format *format = user_data;
+    const guint64 frame_bytes = WIDTH * HEIGHT * 4;
+    guint32 *symbols[2], *alpha[2], *expected[2];
+    GByteArray *first, *next, *back;
+    pixman_image_t *surface;
+    guint64 id = 2;
+    guint i, n = g_test_perf() ? 200 : 4;
+    gdouble intra, inter;
+
+    for (i = 0; i < 2; i++) {
+        symbols[i] = g_new(guint32, WIDTH * HEIGHT);
+        alpha[i] = g_new(guint32, WIDTH * HEIGHT);
+        expected[i] = g_new(guint32, WIDTH * HEIGHT);
+        make_frame(format, i, symbols[i], alpha[i], expected[i]);
+    }
+    first = glz_encode(format->type, WIDTH, HEIGHT, 0, symbols[0], alpha[0], NULL, NULL);
+    next = glz_encode(format->type, WIDTH, HEIGHT, 1, symbols[1], alpha[1], symbols[0], alpha[0]);
+    back = glz_encode(format->type, WIDTH, HEIGHT, 2, symbols[0], alpha[0], symbols[1], alpha[1]);
+    g_test_message("%s: %u bytes, then %u bytes", format->name, first->len, next->len);
+
+    surface = decode_frame(f, first);
+    check_frame(surface, expected[0], format->type == LZ_IMAGE_TYPE_RGBA);
+    pixman_image_unref(surface);
+    surface = decode_frame(f, next);
+    check_frame(surface, expected[1], format->type == LZ_IMAGE_TYPE_RGBA);
+    pixman_image_unref(surface);
+
+    /* frames on their own, as after a screen change */
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        glz_encode_set_id(first, id++);
+        pixman_image_unref(decode_frame(f, first));
+    }
+    intra = g_test_timer_elapsed();
+
+    /* back and forth, each frame references the one before */
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        GByteArray *frame = i % 2 ? back : next;
+
+        glz_encode_set_id(frame, id++);
+        surface = decode_frame(f, frame);
+        if (i == n - 1)
+            check_frame(surface, expected[i % 2 ? 0 : 1], format->type == LZ_IMAGE_TYPE_RGBA);
+        pixman_image_unref(surface);
+    }
+    inter = g_test_timer_elapsed();
+
+    g_test_message("%s: %.1f MB/s decoded, %.1f MB/s with references to the previous frame",
+                   format->name, n * frame_bytes / intra / (1024. * 1024.),
+                   n * frame_bytes / inter / (1024. * 1024.));
+    g_test_maximized_result(n * frame_bytes / intra / (1024. * 1024.),
+                            "%s: %.1f MB/s decoded", format->name,
+                            n * frame_bytes / intra / (1024. * 1024.));
+
+    g_byte_array_unref(first);
+    g_byte_array_unref(next);
+    g_byte_array_unref(back);
+    for (i = 0; i < 2; i++) {
+        g_free(symbols[i]);
+        g_free(alpha[i]);
+        g_free(expected[i]);
+    }
+}
+
+/* small rgb32 images for the window tests, @seed picks the pixels */
+#define SMALL 16
+
+static void make_small(guint32 *pixels, guint seed)
+{
+    guint i;
+
+    for (i = 0; i < SMALL * SMALL; i++)
+        pixels[i] = (seed * 0x010203 + i / 3) & 0xffffff;
+}
+
+static void check_small(pixman_image_t *surface, const guint32 *expected)
+{
+    guint8 *data = (guint8 *)pixman_image_get_data(surface);
+    int stride = pixman_image_get_stride(surface);
+    int x, y;
+
+    for (y = 0; y < SMALL; y++)
+        for (x = 0; x < SMALL; x++)
+            g_assert_cmphex(((guint32 *)(data + y * stride))[x] & 0xffffff, ==,
+                            expected[y * SMALL + x]);
+}
+
+#define SMALL_BYTES (SMALL * SMALL * 4)
+
+/* many more images than the window has records at first, each one
+ * referencing the one before, which is all the window keeps */
+static void test_glz_window_wrap_around(Fixture *f, gconstpointer user_data)
+{
+    guint32 pixels[2][SMALL * SMALL];
+    GByteArray *first, *frames[2];
+    guint64 id;
+
+    make_small(pixels[0], 0);
+    make_small(pixels[1], 1);
+    first = glz_encode(LZ_IMAGE_TYPE_RGB32, SMALL, SMALL, 0, pixels[0], NULL, NULL, NULL);
+    frames[0] = glz_encode(LZ_IMAGE_TYPE_RGB32, SMALL, SMALL, 0,
+                           pixels[0], NULL, pixels[1], NULL);
+    frames[1] = glz_encode(LZ_IMAGE_TYPE_RGB32, SMALL, SMALL, 0,
+                           pixels[1], NULL, pixels[0], NULL);
+
+    pixman_image_unref(decode_frame(f, first));
+    g_assert_cmpuint(glz_decoder_window_get_bytes(f->window), ==, SMALL_BYTES);
+    for (id = 1; id < 1000; id++) {
+        pixman_image_t *surface;
+
+        glz_encode_set_id(frames[id % 2], id);
+        surface = decode_frame(f, frames[id % 2]);
+        check_small(surface, pixels[id % 2]);
+        pixman_image_unref(surface);
+        g_assert_cmpuint(glz_decoder_window_get_bytes(f->window), ==, 2 * SMALL_BYTES);
+    }
+
+    g_byte_array_unref(first);
+    g_byte_array_unref(frames[0]);
+    g_byte_array_unref(frames[1]);
+}
+
+/* an image referencing one from another channel, not decoded yet */
+static void test_glz_window_out_of_order(Fixture *f, gconstpointer user_data)
+{
+    guint32 pixels[2][SMALL * SMALL];
+    GByteArray *first, *next;
+    GCoroutine other = { { 0, }, };
+    DecodeCall late = { glz_decoder_new(f->window), f->palette, NULL, NULL, FALSE };
+    pixman_image_t *surface;
+
+    make_small(pixels[0], 0);
+    make_small(pixels[1], 1);
+    first = glz_encode(LZ_IMAGE_TYPE_RGB32, SMALL, SMALL, 0, pixels[0], NULL, NULL, NULL);
+    next = glz_encode(LZ_IMAGE_TYPE_RGB32, SMALL, SMALL, 1, pixels[1], NULL, pixels[0], NULL);
+
+    decode_coroutine_init(&other);
+    late.frame = next;
+    coroutine_yieldto(&other.coroutine, &late);
+    g_assert(!late.done);
+
+    surface = decode_frame(f, first);
+    check_small(surface, pixels[0]);
+    pixman_image_unref(surface);
+    while (!late.done)
+        g_main_context_iteration(NULL, TRUE);
+    check_small(late.surface, pixels[1]);
+    pixman_image_unref(late.surface);
+    g_assert_cmpuint(glz_decoder_window_get_bytes(f->window), ==, 2 * SMALL_BYTES);
+
+    coroutine_yieldto(&other.coroutine, NULL);
+    glz_decoder_destroy(late.decoder);
+    g_byte_array_unref(first);
+    g_byte_array_unref(next);
+}
+
+/* the window grows to keep what the server tells, and gives it back
+ * once the server moves its window past it */
+static void test_glz_window_release(Fixture *f, gconstpointer user_data)
+{
+    guint32 pixels[SMALL * SMALL];
+    GByteArray *frame;
+    guint64 id;
+
+    make_small(pixels, 0);
+    frame = glz_encode(LZ_IMAGE_TYPE_RGB32, SMALL, SMALL, 0, pixels, NULL, NULL, NULL);
+
+    /* far more than the records and slots the window starts with */
+    for (id = 0; id < 300; id++) {
+        glz_encode_set_id(frame, id);
+        glz_encode_set_win_head_dist(frame, id);
+        pixman_image_unref(decode_frame(f, frame));
+    }
+    g_assert_cmpuint(glz_decoder_window_get_bytes(f->window), ==, 300 * SMALL_BYTES);
+
+    /* a sparse id, the ones in between are on another channel */
+    glz_encode_set_id(frame, 1000);
+    glz_encode_set_win_head_dist(frame, 1000 - 290);
+    pixman_image_unref(decode_frame(f, frame));
+    g_assert_cmpuint(glz_decoder_window_get_bytes(f->window), ==, 301 * SMALL_BYTES);
+
+    /* once the gap is closed, the window is down to ids 290 and up */
+    for (id = 300; id < 1000; id++) {
+        glz_encode_set_id(frame, id);
+        glz_encode_set_win_head_dist(frame, id - 290);
+        pixman_image_unref(decode_frame(f, frame));
+    }
+    g_assert_cmpuint(glz_decoder_window_get_bytes(f->window), ==, 711 * SMALL_BYTES);
+
+    /* an image on its own releases all the others */
+    glz_encode_set_id(frame, 1001);
+    glz_encode_set_win_head_dist(frame, 0);
+    pixman_image_unref(decode_frame(f, frame));
+    g_assert_cmpuint(glz_decoder_window_get_bytes(f->window), ==, SMALL_BYTES);
+
+    glz_decoder_window_clear(f->window);
+    g_assert_cmpuint(glz_decoder_window_get_bytes(f->window), ==, 0);
+    g_byte_array_unref(frame);
+}
+
+int main(int argc, char* argv[])
+{
+    guint i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < G_N_ELEMENTS(formats); i++) {
+        gchar *path = g_strdup_printf("/glz/decode/%s", formats[i].name);
+
+        g_test_add(path, Fixture, &formats[i],
+                   fixture_setup, test_glz_decode, fixture_teardown);
+        g_free(path);
+    }
+    g_test_add("/glz/window/wrap-around", Fixture, NULL,
+               fixture_setup, test_glz_window_wrap_around, fixture_teardown);
+    g_test_add("/glz/window/out-of-order", Fixture, NULL,
+               fixture_setup, test_glz_window_out_of_order, fixture_teardown);
+    g_test_add("/glz/window/release", Fixture, NULL,
+               fixture_setup, test_glz_window_release, fixture_teardown);
+
+    return g_test_run();
+}
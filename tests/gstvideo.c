@@ -0,0 +1,144 @@
+#include "config.h"
+
+#include <glib.h>
+#include <string.h>
+#include <gst/gst.h>
+#include <gst/app/gstappsink.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+#include "channel-display-priv.h"
+
+#define WIDTH 320
+#define HEIGHT 240
+#define NUM_FRAMES 30
+/* as spice-server sends them, ~30fps */
+#define FRAME_DURATION 33
+
+typedef struct {
+    int codec_type;
+    const char *encoder;
+} Codec;
+
+static const Codec vp8 = {
+    SPICE_VIDEO_CODEC_TYPE_VP8,
+    "vp8enc deadline=1 lag-in-frames=0",
+};
+
+static const Codec h264 = {
+    SPICE_VIDEO_CODEC_TYPE_H264,
+    "x264enc tune=zerolatency ! video/x-h264,stream-format=byte-stream",
+};
+
+/* record an elementary stream, frame by frame, the way a server would
+ * send it */
+static GPtrArray *record_stream(const Codec *codec)
+{
+    GPtrArray *frames;
+    GstElement *pipeline;
+    GstAppSink *sink;
+    GstSample *sample;
+    GError *err = NULL;
+    gchar *desc;
+
+    desc = g_strdup_printf("videotestsrc num-buffers=%d pattern=ball ! "
+                           "video/x-raw,width=%d,height=%d,framerate=30/1 ! "
+                           "videoconvert ! %s ! appsink name=sink sync=false",
+                           NUM_FRAMES, WIDTH, HEIGHT, codec->encoder);
+    pipeline = gst_parse_launch_full(desc, NULL, GST_PARSE_FLAG_FATAL_ERRORS, &err);
+    g_free(desc);
+    if (pipeline == NULL) {
+        g_test_message("can't record the stream: %s", err->message);
+        g_clear_error(&err);
+        return NULL;
+    }
+
+    frames = g_ptr_array_new_with_free_func((GDestroyNotify)g_bytes_unref);
+    sink = GST_APP_SINK(gst_bin_get_by_name(GST_BIN(pipeline), "sink"));
+    gst_element_set_state(pipeline, GST_STATE_PLAYING);
+    while ((sample = gst_app_sink_pull_sample(sink)) != NULL) {
+        GstBuffer *buffer = gst_sample_get_buffer(sample);
+        GstMapInfo map;
+
+        gst_buffer_map(buffer, &map, GST_MAP_READ);
+        g_ptr_array_add(frames, g_bytes_new(map.data, map.size));
+        gst_buffer_unmap(buffer, &map);
+        gst_sample_unref(sample);
+    }
+    gst_element_set_state(pipeline, GST_STATE_NULL);
+    gst_object_unref(sink);
+    gst_object_unref(pipeline);
+
+    return frames;
+}
+
+static void test_gstvideo_decode(gconstpointer data)
+{
+    const Codec *codec = data;
+    display_stream_decoder *decoder;
+    GPtrArray *frames;
+    guint8 *out;
+    guint i, decoded = 0;
+
+    if (!gstvideo_has_codec(codec->codec_type)) {
+        g_test_message("no decoder, skipping");
+        return;
+    }
+
+    frames = record_stream(codec);
+    if (frames == NULL)
+        return;
+    g_assert_cmpint(frames->len, ==, NUM_FRAMES);
+
+    decoder = gstvideo_decoder_new(codec->codec_type);
+    g_assert(decoder != NULL);
+    g_assert_cmpint(decoder->codec_type, ==, codec->codec_type);
+
+    out = g_malloc(WIDTH * HEIGHT * 4);
+    for (i = 0; i < frames->len; i++) {
+        GBytes *bytes = g_ptr_array_index(frames, i);
+        display_frame frame = {
+            .mm_time = 1000 + i * FRAME_DURATION,
+            .width = WIDTH,
+            .height = HEIGHT,
+            .out = out,
+            .out_stride = WIDTH * 4,
+        };
+        gsize size;
+
+        frame.data = (uint8_t *)g_bytes_get_data(bytes, &size);
+        frame.data_size = size;
+
+        memset(out, 0, WIDTH * HEIGHT * 4);
+        if (decoder->decode_frame(decoder, &frame)) {
+            guint8 *p;
+
+            decoded++;
+            /* the test pattern has a black background, but a white ball */
+            for (p = out; p < out + WIDTH * HEIGHT * 4; p++) {
+                if (*p != 0)
+                    break;
+            }
+            g_assert(p < out + WIDTH * HEIGHT * 4);
+        }
+    }
+    g_test_message("decoded %u/%u frames", decoded, frames->len);
+    /* the decoder may hold a few frames back */
+    g_assert_cmpint(decoded, >=, NUM_FRAMES - 4);
+
+    g_free(out);
+    decoder->destroy(decoder);
+    g_ptr_array_unref(frames);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+    gst_init(&argc, &argv);
+
+    g_test_add_data_func("/gstvideo/vp8", &vp8, test_gstvideo_decode);
+    g_test_add_data_func("/gstvideo/h264", &h264, test_gstvideo_decode);
+
+    return g_test_run();
+}
@@ -0,0 +1,181 @@
+#include "config.h"
+
+#include <glib.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <jpeglib.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "decode.h"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+
+typedef struct {
+    SpiceJpegDecoder *decoder;
+    guint8 *jpeg;
+    unsigned long jpeg_size;
+    /* what the image looks like, decoded to plain RGB */
+    guint8 *rgb;
+    guint8 *out;
+} Fixture;
+
+static void fixture_setup(Fixture *f, gconstpointer user_data)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_decompress_struct dinfo;
+    struct jpeg_error_mgr jerr;
+    guint8 *row;
+    int x, y;
+
+    row = g_malloc(WIDTH * 3);
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, &f->jpeg, &f->jpeg_size);
+    cinfo.image_width = WIDTH;
+    cinfo.image_height = HEIGHT;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 80, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+    for (y = 0; y < HEIGHT; y++) {
+        for (x = 0; x < WIDTH; x++) {
+            row[x * 3 + 0] = x ^ y;
+            row[x * 3 + 1] = x + y;
+            row[x * 3 + 2] = (x * y) >> 4;
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    g_free(row);
+
+    f->rgb = g_malloc(WIDTH * HEIGHT * 3);
+    dinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&dinfo);
+    jpeg_mem_src(&dinfo, f->jpeg, f->jpeg_size);
+    jpeg_read_header(&dinfo, TRUE);
+    dinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&dinfo);
+    while (dinfo.output_scanline < dinfo.output_height) {
+        row = f->rgb + dinfo.output_scanline * WIDTH * 3;
+        jpeg_read_scanlines(&dinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&dinfo);
+    jpeg_destroy_decompress(&dinfo);
+
+    f->out = g_malloc(WIDTH * HEIGHT * 4);
+    f->decoder = jpeg_decoder_new();
+}
+
+static void fixture_teardown(Fixture *f, gconstpointer user_data)
+{
+    jpeg_decoder_destroy(f->decoder);
+    g_free(f->out);
+    g_free(f->rgb);
+    free(f->jpeg);
+}
+
+static void decode(Fixture *f, int format, int stride)
+{
+    int width, height;
+
+    f->decoder->ops->begin_decode(f->decoder, f->jpeg, f->jpeg_size, &width, &height);
+    g_assert_cmpint(width, ==, WIDTH);
+    g_assert_cmpint(height, ==, HEIGHT);
+    f->decoder->ops->decode(f->decoder, f->out, stride, format);
+}
+
+static void check_bgr(const guint8 *rgb, const guint8 *out, int bpp, int width)
+{
+    int x;
+
+    for (x = 0; x < width; x++) {
+        g_assert_cmpint(out[x * bpp + 0], ==, rgb[x * 3 + 2]);
+        g_assert_cmpint(out[x * bpp + 1], ==, rgb[x * 3 + 1]);
+        g_assert_cmpint(out[x * bpp + 2], ==, rgb[x * 3 + 0]);
+    }
+}
+
+static void test_jpeg_decode(Fixture *f, gconstpointer user_data)
+{
+    int format = GPOINTER_TO_INT(user_data);
+    int bpp = format == SPICE_BITMAP_FMT_32BIT ? 4 : 3;
+    int y;
+
+    decode(f, format, WIDTH * bpp);
+    for (y = 0; y < HEIGHT; y++)
+        check_bgr(f->rgb + y * WIDTH * 3, f->out + y * WIDTH * bpp, bpp, WIDTH);
+}
+
+static void test_jpeg_converter(Fixture *f, gconstpointer user_data)
+{
+    int format = GPOINTER_TO_INT(user_data);
+    int bpp = format == SPICE_BITMAP_FMT_32BIT ? 4 : 3;
+    SpiceRgbConverter converter = jpeg_get_converter(format);
+    int width;
+
+    g_assert(converter != NULL);
+    /* all the widths around the vector sizes, to check the tails */
+    for (width = 0; width < 100; width++) {
+        memset(f->out, 0xaa, (width + 1) * bpp);
+        converter(f->rgb, f->out, width);
+        check_bgr(f->rgb, f->out, bpp, width);
+        g_assert_cmpint(f->out[width * bpp], ==, 0xaa);
+    }
+}
+
+static void test_jpeg_bench(Fixture *f, gconstpointer user_data)
+{
+    int format = GPOINTER_TO_INT(user_data);
+    int bpp = format == SPICE_BITMAP_FMT_32BIT ? 4 : 3;
+    SpiceRgbConverter converter = jpeg_get_converter(format);
+    guint n = g_test_perf() ? 100 : 3;
+    gdouble decode_time, convert_time;
+    guint i;
+    int y;
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++)
+        decode(f, format, WIDTH * bpp);
+    decode_time = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++) {
+        for (y = 0; y < HEIGHT; y++)
+            converter(f->rgb + y * WIDTH * 3, f->out + y * WIDTH * bpp, WIDTH);
+    }
+    convert_time = g_test_timer_elapsed();
+
+    g_test_minimized_result(decode_time / n * 1000,
+                            "%d bpp: decode %.2f ms/frame, "
+                            "RGB conversion alone %.2f ms/frame",
+                            bpp * 8, decode_time / n * 1000,
+                            convert_time / n * 1000);
+}
+
+int main(int argc, char* argv[])
+{
+    gconstpointer fmt24 = GINT_TO_POINTER(SPICE_BITMAP_FMT_24BIT);
+    gconstpointer fmt32 = GINT_TO_POINTER(SPICE_BITMAP_FMT_32BIT);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/jpeg/decode/24", Fixture, fmt24,
+               fixture_setup, test_jpeg_decode, fixture_teardown);
+    g_test_add("/jpeg/decode/32", Fixture, fmt32,
+               fixture_setup, test_jpeg_decode, fixture_teardown);
+    g_test_add("/jpeg/converter/24", Fixture, fmt24,
+               fixture_setup, test_jpeg_converter, fixture_teardown);
+    g_test_add("/jpeg/converter/32", Fixture, fmt32,
+               fixture_setup, test_jpeg_converter, fixture_teardown);
+    g_test_add("/jpeg/bench/24", Fixture, fmt24,
+               fixture_setup, test_jpeg_bench, fixture_teardown);
+    g_test_add("/jpeg/bench/32", Fixture, fmt32,
+               fixture_setup, test_jpeg_bench, fixture_teardown);
+
+    return g_test_run();
+}
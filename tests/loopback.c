@@ -0,0 +1,392 @@
+#include "config.h"
+
+#include <glib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <spice/vd_agent.h>
+
+#include "spice-client.h"
+#include "common/lz_common.h"
+
+#include "fake-server.h"
+#include "glz-encoder.h"
+
+/*
+ * End to end throughput of a session, against the fake server: each
+ * test streams messages of one kind, and reports how fast the client
+ * took them, and what it cost it. Short enough for make check by
+ * default, use -m perf for meaningful numbers.
+ */
+
+static guint width = 640;
+static guint height = 480;
+static guint frames = 8;
+
+/* what the current test queued, by message type */
+#define MAX_MSG_TYPE 512
+static guint queued[MAX_MSG_TYPE];
+static guint32 pings;
+
+static void put_8(GByteArray *out, guint8 byte)
+{
+    g_byte_array_append(out, &byte, 1);
+}
+
+static void put_16(GByteArray *out, guint16 word)
+{
+    word = GUINT16_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 2);
+}
+
+static void put_32(GByteArray *out, guint32 word)
+{
+    word = GUINT32_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 4);
+}
+
+static void put_64(GByteArray *out, guint64 word)
+{
+    word = GUINT64_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 8);
+}
+
+static void put_rect(GByteArray *out, gint32 left, gint32 top, gint32 right, gint32 bottom)
+{
+    put_32(out, top);
+    put_32(out, left);
+    put_32(out, bottom);
+    put_32(out, right);
+}
+
+/* each message is followed by a ping, to check they come in order */
+static void queue(FakeServer *server, guint8 type, guint16 msg_type, GByteArray *msg)
+{
+    g_assert_cmpuint(msg_type, <, MAX_MSG_TYPE);
+    fake_server_queue(server, type, 0, msg_type, msg->data, msg->len);
+    queued[msg_type]++;
+
+    g_byte_array_set_size(msg, 0);
+    put_32(msg, ++pings);
+    put_64(msg, 0);
+    fake_server_queue(server, type, 0, SPICE_MSG_PING, msg->data, msg->len);
+    queued[SPICE_MSG_PING]++;
+    g_byte_array_set_size(msg, 0);
+}
+
+/* a primary surface, then glz frames going back and forth */
+static void queue_display(FakeServer *server)
+{
+    GByteArray *msg = g_byte_array_new();
+    guint32 *pixels[2];
+    guint i, x, y;
+
+    fake_server_add_channel(server, SPICE_CHANNEL_DISPLAY, 0);
+
+    put_32(msg, 0); /* surface_id */
+    put_32(msg, width);
+    put_32(msg, height);
+    put_32(msg, SPICE_SURFACE_FMT_32_xRGB);
+    put_32(msg, SPICE_SURFACE_FLAGS_PRIMARY);
+    queue(server, SPICE_CHANNEL_DISPLAY, SPICE_MSG_DISPLAY_SURFACE_CREATE, msg);
+    queue(server, SPICE_CHANNEL_DISPLAY, SPICE_MSG_DISPLAY_MARK, msg);
+
+    for (i = 0; i < 2; i++) {
+        pixels[i] = g_new(guint32, width * height);
+        for (y = 0; y < height; y++)
+            for (x = 0; x < width; x++)
+                pixels[i][y * width + x] = glz_encode_desktop_pixel(width, x, y, i);
+    }
+
+    for (i = 0; i < frames; i++) {
+        GByteArray *glz = glz_encode(LZ_IMAGE_TYPE_RGB32, width, height, i,
+                                     pixels[i % 2], NULL,
+                                     i == 0 ? NULL : pixels[(i + 1) % 2], NULL);
+        const guint32 image_offset = 57;
+
+        /* DisplayBase */
+        put_32(msg, 0);
+        put_rect(msg, 0, 0, width, height);
+        put_8(msg, SPICE_CLIP_TYPE_NONE);
+        /* Copy */
+        put_32(msg, image_offset);
+        put_rect(msg, 0, 0, width, height);
+        put_16(msg, SPICE_ROPD_OP_PUT);
+        put_8(msg, SPICE_IMAGE_SCALE_MODE_NEAREST);
+        put_8(msg, 0); /* mask flags */
+        put_32(msg, 0);
+        put_32(msg, 0);
+        put_32(msg, 0); /* no mask bitmap */
+        g_assert_cmpint(msg->len, ==, image_offset);
+        /* ImageDescriptor and LZRGBData */
+        put_64(msg, i);
+        put_8(msg, SPICE_IMAGE_TYPE_GLZ_RGB);
+        put_8(msg, 0);
+        put_32(msg, width);
+        put_32(msg, height);
+        put_32(msg, glz->len);
+        g_byte_array_append(msg, glz->data, glz->len);
+        queue(server, SPICE_CHANNEL_DISPLAY, SPICE_MSG_DISPLAY_DRAW_COPY, msg);
+        g_byte_array_unref(glz);
+    }
+
+    g_free(pixels[0]);
+    g_free(pixels[1]);
+    g_byte_array_unref(msg);
+}
+
+/* 32x32 alpha cursors, moving around */
+static void queue_cursor(FakeServer *server)
+{
+    GByteArray *msg = g_byte_array_new();
+    guint i, j;
+
+    fake_server_add_channel(server, SPICE_CHANNEL_CURSOR, 0);
+
+    put_16(msg, 0);
+    put_16(msg, 0); /* position */
+    put_16(msg, 0); /* trail_length */
+    put_16(msg, 0); /* trail_frequency */
+    put_8(msg, 1); /* visible */
+    put_16(msg, SPICE_CURSOR_FLAGS_NONE);
+    queue(server, SPICE_CHANNEL_CURSOR, SPICE_MSG_CURSOR_INIT, msg);
+
+    for (i = 0; i < frames * 10; i++) {
+        put_16(msg, i % width);
+        put_16(msg, i % height);
+        put_8(msg, 1); /* visible */
+        put_16(msg, 0); /* cursor flags */
+        put_64(msg, i); /* unique */
+        put_8(msg, SPICE_CURSOR_TYPE_ALPHA);
+        put_16(msg, 32);
+        put_16(msg, 32);
+        put_16(msg, 0);
+        put_16(msg, 0); /* hot spot */
+        for (j = 0; j < 32 * 32; j++)
+            put_32(msg, 0xff000000 | (i * 0x10101 + j));
+        queue(server, SPICE_CHANNEL_CURSOR, SPICE_MSG_CURSOR_SET, msg);
+
+        put_32(msg, i % width);
+        put_32(msg, i % height);
+        queue(server, SPICE_CHANNEL_CURSOR, SPICE_MSG_CURSOR_MOVE, msg);
+    }
+
+    g_byte_array_unref(msg);
+}
+
+/* 10ms packets of 48kHz stereo pcm */
+static void queue_playback(FakeServer *server)
+{
+    GByteArray *msg = g_byte_array_new();
+    guint i, j;
+
+    fake_server_add_channel(server, SPICE_CHANNEL_PLAYBACK, 0);
+
+    put_32(msg, 0); /* time */
+    put_16(msg, SPICE_AUDIO_DATA_MODE_RAW);
+    queue(server, SPICE_CHANNEL_PLAYBACK, SPICE_MSG_PLAYBACK_MODE, msg);
+
+    put_32(msg, 2); /* channels */
+    put_16(msg, SPICE_AUDIO_FMT_S16);
+    put_32(msg, 48000);
+    put_32(msg, 0); /* time */
+    queue(server, SPICE_CHANNEL_PLAYBACK, SPICE_MSG_PLAYBACK_START, msg);
+
+    for (i = 0; i < frames * 100; i++) {
+        put_32(msg, i * 10); /* time */
+        for (j = 0; j < 480 * 2; j++)
+            put_16(msg, i + j);
+        queue(server, SPICE_CHANNEL_PLAYBACK, SPICE_MSG_PLAYBACK_DATA, msg);
+    }
+
+    queue(server, SPICE_CHANNEL_PLAYBACK, SPICE_MSG_PLAYBACK_STOP, msg);
+    g_byte_array_unref(msg);
+}
+
+static void put_agent_message(GByteArray *msg, guint32 type, guint32 size)
+{
+    put_32(msg, VD_AGENT_PROTOCOL);
+    put_32(msg, type);
+    put_64(msg, 0); /* opaque */
+    put_32(msg, size);
+}
+
+/* the agent sending 4kB text clipboards */
+static void queue_agent(FakeServer *server)
+{
+    GByteArray *msg = g_byte_array_new();
+    guint i, j;
+
+    put_agent_message(msg, VD_AGENT_ANNOUNCE_CAPABILITIES, 2 * sizeof(guint32));
+    put_32(msg, 0); /* request */
+    put_32(msg, 0); /* caps */
+    queue(server, SPICE_CHANNEL_MAIN, SPICE_MSG_MAIN_AGENT_DATA, msg);
+
+    for (i = 0; i < frames * 10; i++) {
+        put_agent_message(msg, VD_AGENT_CLIPBOARD, sizeof(guint32) + 4096);
+        put_32(msg, VD_AGENT_CLIPBOARD_UTF8_TEXT);
+        for (j = 0; j < 4096; j++)
+            put_8(msg, 'a' + (i + j) % 26);
+        queue(server, SPICE_CHANNEL_MAIN, SPICE_MSG_MAIN_AGENT_DATA, msg);
+    }
+
+    g_byte_array_unref(msg);
+}
+
+typedef struct {
+    const char *name;
+    guint8 channel_type;
+    const char *signal; /* what counts as handled */
+    void (*queue)(FakeServer *server);
+} Stream;
+
+static const Stream streams[] = {
+    { "display", SPICE_CHANNEL_DISPLAY, "display-invalidate", queue_display },
+    { "cursor", SPICE_CHANNEL_CURSOR, "cursor-set", queue_cursor },
+    { "playback", SPICE_CHANNEL_PLAYBACK, "playback-data", queue_playback },
+    { "agent", SPICE_CHANNEL_MAIN, "main-clipboard-selection", queue_agent },
+};
+
+typedef struct {
+    const Stream *stream;
+    SpiceChannel *channel;
+    guint handled;
+} Counter;
+
+static void count_handled(Counter *counter)
+{
+    counter->handled++;
+}
+
+static void channel_new(SpiceSession *session, SpiceChannel *channel, gpointer user_data)
+{
+    Counter *counter = user_data;
+    gint type;
+
+    g_object_get(channel, "channel-type", &type, NULL);
+    if (type == counter->stream->channel_type) {
+        counter->channel = channel;
+        /* start timing the messages */
+        g_variant_unref(g_variant_ref_sink(spice_channel_get_stats(channel)));
+        g_signal_connect_swapped(channel, counter->stream->signal,
+                                 G_CALLBACK(count_handled), counter);
+    }
+}
+
+static gboolean timeout_cb(gpointer user_data)
+{
+    gboolean *timed_out = user_data;
+
+    *timed_out = TRUE;
+    return FALSE;
+}
+
+/* the cpu time of the main thread, where the channels run */
+static gdouble cpu_time(void)
+{
+    struct rusage usage;
+
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &usage);
+#else
+    getrusage(RUSAGE_SELF, &usage);
+#endif
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void test_loopback(gconstpointer user_data)
+{
+    const Stream *stream = user_data;
+    Counter counter = { stream, NULL, 0 };
+    FakeServer *server = fake_server_new();
+    SpiceSession *session = spice_session_new();
+    FakeServerStats stats;
+    GVariant *channel_stats;
+    GVariantIter *iter;
+    guint64 messages, bytes, parse_time, handler_time;
+    guint received[MAX_MSG_TYPE] = { 0, };
+    guint16 type;
+    gboolean timed_out = FALSE;
+    gdouble cpu, elapsed;
+    guint timeout, i;
+
+    memset(queued, 0, sizeof(queued));
+    pings = 0;
+    stream->queue(server);
+    /* and the final ping */
+    queued[SPICE_MSG_PING]++;
+    fake_server_connect(server, session);
+    g_signal_connect(session, "channel-new", G_CALLBACK(channel_new), &counter);
+
+    cpu = cpu_time();
+    g_assert(spice_session_open_fd(session, -1));
+    timeout = g_timeout_add_seconds(60, timeout_cb, &timed_out);
+    while (!fake_server_is_done(server) && !timed_out)
+        g_main_context_iteration(NULL, TRUE);
+    g_assert(!timed_out);
+    g_source_remove(timeout);
+    cpu = cpu_time() - cpu;
+
+    g_assert(fake_server_get_stats(server, stream->channel_type, 0, &stats));
+    elapsed = (stats.end - stats.start) / 1e6;
+    g_test_message("%s: %" G_GUINT64_FORMAT " messages, %.0f messages/s, %.1f MB/s, "
+                   "%u handled, %.3f s cpu",
+                   stream->name, stats.messages, stats.messages / elapsed,
+                   stats.bytes / elapsed / (1024. * 1024.), counter.handled, cpu);
+    g_test_maximized_result(stats.bytes / elapsed / (1024. * 1024.), "%s: %.1f MB/s",
+                            stream->name, stats.bytes / elapsed / (1024. * 1024.));
+    g_assert_cmpuint(counter.handled, >, 0);
+    g_assert_cmpuint(stats.pongs, ==, pings);
+    g_assert_cmpuint(stats.pongs_out_of_order, ==, 0);
+    g_assert_cmpint(stats.ping_rtt, >, 0);
+
+    /* where the client time went, by message type */
+    g_assert(counter.channel != NULL);
+    channel_stats = g_variant_ref_sink(spice_channel_get_stats(counter.channel));
+    g_assert(g_variant_lookup(channel_stats, "received", "a(qtttt)", &iter));
+    while (g_variant_iter_next(iter, "(qtttt)", &type, &messages, &bytes,
+                               &parse_time, &handler_time)) {
+        g_test_message("%s: type %u, %" G_GUINT64_FORMAT " messages, %" G_GUINT64_FORMAT
+                       " bytes, %.3f s parsing, %.3f s handling",
+                       stream->name, type, messages, bytes,
+                       parse_time / 1e6, handler_time / 1e6);
+        if (type < MAX_MSG_TYPE)
+            received[type] = messages;
+    }
+    g_variant_iter_free(iter);
+    g_variant_unref(channel_stats);
+    /* everything queued was received, the main channel gets more */
+    for (i = 0; i < MAX_MSG_TYPE; i++) {
+        if (queued[i] != 0)
+            g_assert_cmpuint(received[i], ==, queued[i]);
+    }
+
+    spice_session_disconnect(session);
+    fake_server_free(server);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+    g_object_unref(session);
+}
+
+int main(int argc, char* argv[])
+{
+    guint i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    if (g_test_perf()) {
+        width = 1920;
+        height = 1080;
+        frames = 200;
+    }
+
+    for (i = 0; i < G_N_ELEMENTS(streams); i++) {
+        gchar *path = g_strdup_printf("/loopback/%s", streams[i].name);
+
+        g_test_add_data_func(path, &streams[i], test_loopback);
+        g_free(path);
+    }
+
+    return g_test_run();
+}
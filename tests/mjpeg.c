@@ -0,0 +1,170 @@
+#include "config.h"
+
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "spice-client.h"
+#include "spice-common.h"
+#include "spice-channel-priv.h"
+#include "channel-display-priv.h"
+
+/* a 1080p frame with a bit of detail, so that decoding isn't trivial */
+#define WIDTH 1920
+#define HEIGHT 1080
+
+/* the surface is a bit larger than the stream, as usual */
+#define SURFACE_WIDTH (WIDTH + 64)
+#define SURFACE_HEIGHT (HEIGHT + 32)
+#define SURFACE_STRIDE (SURFACE_WIDTH * 4)
+#define DEST_LEFT 32
+#define DEST_TOP 16
+
+static guint8 *encode_frame(unsigned long *size)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned char *jpeg = NULL;
+    guint8 *row;
+    int x, y;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    *size = 0;
+    jpeg_mem_dest(&cinfo, &jpeg, size);
+
+    cinfo.image_width = WIDTH;
+    cinfo.image_height = HEIGHT;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, 80, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    row = g_malloc(WIDTH * 3);
+    for (y = 0; y < HEIGHT; y++) {
+        for (x = 0; x < WIDTH; x++) {
+            row[x * 3 + 0] = x ^ y;
+            row[x * 3 + 1] = x + y;
+            row[x * 3 + 2] = (x * y) >> 4;
+        }
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    g_free(row);
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return jpeg;
+}
+
+typedef struct {
+    display_stream_decoder *decoder;
+    display_frame frame;
+    guint8 *jpeg;
+    guint8 *buffer;
+    guint8 *surface;
+} Fixture;
+
+static void fixture_setup(Fixture *f, gconstpointer user_data)
+{
+    unsigned long size;
+
+    f->jpeg = encode_frame(&size);
+    f->buffer = g_malloc(WIDTH * HEIGHT * 4);
+    f->surface = g_malloc0(SURFACE_STRIDE * SURFACE_HEIGHT);
+
+    f->decoder = mjpeg_decoder_new(FALSE);
+
+    f->frame.width = WIDTH;
+    f->frame.height = HEIGHT;
+    f->frame.data = f->jpeg;
+    f->frame.data_size = size;
+}
+
+static void fixture_teardown(Fixture *f, gconstpointer user_data)
+{
+    f->decoder->destroy(f->decoder);
+    g_free(f->surface);
+    g_free(f->buffer);
+    free(f->jpeg);
+}
+
+/* what put_image() amounts to without clipping nor scaling */
+static void decode_copy(Fixture *f)
+{
+    guint8 *dest = f->surface + DEST_TOP * SURFACE_STRIDE + DEST_LEFT * 4;
+    int y;
+
+    f->frame.out = f->buffer;
+    f->frame.out_stride = WIDTH * 4;
+    g_assert(f->decoder->decode_frame(f->decoder, &f->frame));
+
+    for (y = 0; y < HEIGHT; y++) {
+        memcpy(dest, f->buffer + y * WIDTH * 4, WIDTH * 4);
+        dest += SURFACE_STRIDE;
+    }
+}
+
+static void decode_direct(Fixture *f)
+{
+    f->frame.out = f->surface + DEST_TOP * SURFACE_STRIDE + DEST_LEFT * 4;
+    f->frame.out_stride = SURFACE_STRIDE;
+    g_assert(f->decoder->decode_frame(f->decoder, &f->frame));
+}
+
+static void test_mjpeg_direct(Fixture *f, gconstpointer user_data)
+{
+    guint8 *expected;
+
+    decode_copy(f);
+    expected = g_memdup(f->surface, SURFACE_STRIDE * SURFACE_HEIGHT);
+
+    memset(f->surface, 0, SURFACE_STRIDE * SURFACE_HEIGHT);
+    decode_direct(f);
+    g_assert(memcmp(expected, f->surface, SURFACE_STRIDE * SURFACE_HEIGHT) == 0);
+
+    g_free(expected);
+}
+
+static void test_mjpeg_bench(Fixture *f, gconstpointer user_data)
+{
+    const guint64 frame_bytes = WIDTH * HEIGHT * 4;
+    guint n = g_test_perf() ? 300 : 3;
+    gdouble copy, direct;
+    guint i;
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++)
+        decode_copy(f);
+    copy = g_test_timer_elapsed();
+
+    g_test_timer_start();
+    for (i = 0; i < n; i++)
+        decode_direct(f);
+    direct = g_test_timer_elapsed();
+
+    /* the copy reads and writes each decoded pixel once more */
+    g_test_message("%u frames: decode+copy %.2f fps, direct %.2f fps, "
+                   "%.1f MB/s of memory traffic saved at 30 fps",
+                   n, n / copy, n / direct,
+                   2 * frame_bytes * 30 / (1024. * 1024.));
+    g_test_minimized_result(direct / n * 1000, "direct decode: %.2f ms/frame "
+                            "(decode+copy: %.2f ms/frame)",
+                            direct / n * 1000, copy / n * 1000);
+}
+
+int main(int argc, char* argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+#ifdef JCS_EXTENSIONS
+    /* the direct path needs libjpeg-turbo */
+    g_test_add("/mjpeg/direct", Fixture, NULL,
+               fixture_setup, test_mjpeg_direct, fixture_teardown);
+    g_test_add("/mjpeg/bench", Fixture, NULL,
+               fixture_setup, test_mjpeg_bench, fixture_teardown);
+#endif
+
+    return g_test_run();
+}
@@ -0,0 +1,381 @@
+#include "config.h"
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <spice/protocol.h>
+
+#include "spice-client.h"
+#include "spice-capture.h"
+
+#include "fake-server.h"
+
+/*
+ * Replays a capture taken with SPICE_CAPTURE=file: the fake server
+ * sends the recorded messages again, to a session without widgets, so
+ * they go through the same parsers and handlers as they did live.
+ *
+ *   replay [--realtime] FILE   replays FILE, and reports per channel
+ *   replay                     the self-test, records and replays a session
+ *
+ * The fake server sends its own main init and channels list, so the
+ * recorded ones are skipped, as are the pings it would confuse with its
+ * final one. Sub-message lists are sent as separate messages.
+ */
+
+typedef struct {
+    guint8 type;
+    guint8 id;
+} ReplayChannel;
+
+typedef struct {
+    FakeServer *server;
+    GArray *channels; /* ReplayChannel, in link order */
+    guint64 messages;
+    guint64 sent; /* by the client, during the capture */
+} Replay;
+
+static gboolean replay_has_channel(Replay *replay, guint8 type, guint8 id)
+{
+    guint i;
+
+    for (i = 0; i < replay->channels->len; i++) {
+        ReplayChannel *c = &g_array_index(replay->channels, ReplayChannel, i);
+
+        if (c->type == type && c->id == id)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void replay_link(Replay *replay, const SpiceCaptureRecord *record)
+{
+    ReplayChannel c = { record->channel_type, record->channel_id };
+    guint32 link[3];
+    guint32 *caps;
+
+    /* a later link is a reconnection, keep the first capabilities */
+    if (replay_has_channel(replay, c.type, c.id))
+        return;
+
+    g_array_append_val(replay->channels, c);
+    if (c.type != SPICE_CHANNEL_MAIN)
+        fake_server_add_channel(replay->server, c.type, c.id);
+
+    g_return_if_fail(record->size >= sizeof(link));
+    memcpy(link, record->data, sizeof(link));
+    link[1] = GUINT32_FROM_LE(link[1]);
+    link[2] = GUINT32_FROM_LE(link[2]);
+    g_return_if_fail(record->size == sizeof(link) + (link[1] + link[2]) * sizeof(guint32));
+
+    caps = g_memdup(record->data + sizeof(link) + link[1] * sizeof(guint32),
+                    link[2] * sizeof(guint32));
+    fake_server_set_caps(replay->server, c.type, c.id, caps, link[2]);
+    g_free(caps);
+}
+
+/* as spice_channel_recv_msg() splits them */
+static void replay_sub_list(Replay *replay, const SpiceCaptureRecord *record, gint64 time)
+{
+    const SpiceSubMessageList *sub_list;
+    guint i;
+
+    g_return_if_fail(record->sub_list + sizeof(SpiceSubMessageList) <= record->size);
+    sub_list = (const SpiceSubMessageList *)(record->data + record->sub_list);
+    g_return_if_fail(record->sub_list + sizeof(SpiceSubMessageList) +
+                     sub_list->size * sizeof(guint32) <= record->size);
+
+    for (i = 0; i < sub_list->size; i++) {
+        const SpiceSubMessage *sub;
+
+        g_return_if_fail(sub_list->sub_messages[i] + sizeof(SpiceSubMessage) <= record->size);
+        sub = (const SpiceSubMessage *)(record->data + sub_list->sub_messages[i]);
+        g_return_if_fail(sub_list->sub_messages[i] + sizeof(SpiceSubMessage) + sub->size
+                         <= record->size);
+        fake_server_queue_at(replay->server, record->channel_type, record->channel_id,
+                             time, sub->type, sub + 1, sub->size);
+        replay->messages++;
+    }
+}
+
+static Replay *replay_new(const gchar *filename, GError **error)
+{
+    SpiceCaptureReader *reader;
+    SpiceCaptureRecord record;
+    Replay *replay;
+    gint64 start = -1;
+
+    reader = spice_capture_reader_new(filename, error);
+    if (reader == NULL)
+        return NULL;
+
+    replay = g_new0(Replay, 1);
+    replay->server = fake_server_new();
+    replay->channels = g_array_new(FALSE, FALSE, sizeof(ReplayChannel));
+
+    while (spice_capture_reader_next(reader, &record)) {
+        gint64 time;
+
+        if (record.direction == SPICE_CAPTURE_LINK) {
+            if (start < 0)
+                start = record.time;
+            replay_link(replay, &record);
+            continue;
+        }
+        if (record.direction == SPICE_CAPTURE_SEND) {
+            replay->sent++;
+            continue;
+        }
+        if (!replay_has_channel(replay, record.channel_type, record.channel_id))
+            continue;
+
+        if (record.msg_type == SPICE_MSG_PING ||
+            (record.channel_type == SPICE_CHANNEL_MAIN &&
+             (record.msg_type == SPICE_MSG_MAIN_INIT ||
+              record.msg_type == SPICE_MSG_MAIN_CHANNELS_LIST)))
+            continue;
+
+        time = record.time - start;
+        /* mini header lists have theirs at 0, and aren't split */
+        if (record.sub_list)
+            replay_sub_list(replay, &record, time);
+        if (record.sub_list && record.msg_type == SPICE_MSG_LIST)
+            continue;
+        fake_server_queue_at(replay->server, record.channel_type, record.channel_id,
+                             time, record.msg_type, record.data, record.size);
+        replay->messages++;
+    }
+
+    spice_capture_reader_free(reader);
+    return replay;
+}
+
+static void replay_free(Replay *replay)
+{
+    fake_server_free(replay->server);
+    g_array_free(replay->channels, TRUE);
+    g_free(replay);
+}
+
+static gboolean timeout_cb(gpointer user_data)
+{
+    gboolean *timed_out = user_data;
+
+    *timed_out = TRUE;
+    return FALSE;
+}
+
+/* the cpu time of the main thread, where the channels run */
+static gdouble cpu_time(void)
+{
+    struct rusage usage;
+
+#ifdef RUSAGE_THREAD
+    getrusage(RUSAGE_THREAD, &usage);
+#else
+    getrusage(RUSAGE_SELF, &usage);
+#endif
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+        usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+/* runs @session against @server until all its messages are handled */
+static gdouble run_session(FakeServer *server, SpiceSession *session, guint timeout_secs)
+{
+    gboolean timed_out = FALSE;
+    gdouble cpu = cpu_time();
+    guint timeout;
+
+    fake_server_connect(server, session);
+    g_assert(spice_session_open_fd(session, -1));
+    timeout = g_timeout_add_seconds(timeout_secs, timeout_cb, &timed_out);
+    while (!fake_server_is_done(server) && !timed_out)
+        g_main_context_iteration(NULL, TRUE);
+    g_assert(!timed_out);
+    g_source_remove(timeout);
+    cpu = cpu_time() - cpu;
+
+    spice_session_disconnect(session);
+    while (g_main_context_iteration(NULL, FALSE))
+        ;
+
+    return cpu;
+}
+
+static void replay_report(Replay *replay, gdouble cpu)
+{
+    guint i;
+
+    g_print("%" G_GUINT64_FORMAT " messages replayed, %" G_GUINT64_FORMAT
+            " sent by the client during the capture, %.3f s cpu\n",
+            replay->messages, replay->sent, cpu);
+    for (i = 0; i < replay->channels->len; i++) {
+        ReplayChannel *c = &g_array_index(replay->channels, ReplayChannel, i);
+        FakeServerStats stats;
+        gdouble elapsed;
+
+        if (!fake_server_get_stats(replay->server, c->type, c->id, &stats))
+            continue;
+        elapsed = MAX(stats.end - stats.start, 1) / 1e6;
+        g_print("%s %d: %" G_GUINT64_FORMAT " messages, %.1f MB in %.3f s, "
+                "%.0f messages/s, %.1f MB/s, %" G_GUINT64_FORMAT " client messages\n",
+                spice_channel_type_to_string(c->type), c->id,
+                stats.messages, stats.bytes / (1024. * 1024.), elapsed,
+                stats.messages / elapsed, stats.bytes / elapsed / (1024. * 1024.),
+                stats.client_messages);
+    }
+}
+
+/* ------------------------------------------------------------------ */
+
+#define TEST_PACKETS 50
+
+static void count_handled(guint *handled)
+{
+    (*handled)++;
+}
+
+static void channel_new(SpiceSession *session, SpiceChannel *channel, gpointer user_data)
+{
+    if (SPICE_IS_PLAYBACK_CHANNEL(channel))
+        g_signal_connect_swapped(channel, "playback-data",
+                                 G_CALLBACK(count_handled), user_data);
+}
+
+static void put_16(GByteArray *out, guint16 word)
+{
+    word = GUINT16_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 2);
+}
+
+static void put_32(GByteArray *out, guint32 word)
+{
+    word = GUINT32_TO_LE(word);
+    g_byte_array_append(out, (guint8 *)&word, 4);
+}
+
+static void queue(FakeServer *server, guint16 msg_type, GByteArray *msg)
+{
+    fake_server_queue(server, SPICE_CHANNEL_PLAYBACK, 0, msg_type, msg->data, msg->len);
+    g_byte_array_set_size(msg, 0);
+}
+
+/* a short playback stream, through a capture, and again from it */
+static void test_replay(gconstpointer user_data)
+{
+    const gchar *filename = user_data;
+    FakeServer *server = fake_server_new();
+    SpiceSession *session = spice_session_new();
+    GByteArray *msg = g_byte_array_new();
+    GError *error = NULL;
+    Replay *replay;
+    guint handled = 0;
+    guint i, j;
+
+    fake_server_add_channel(server, SPICE_CHANNEL_PLAYBACK, 0);
+    put_32(msg, 0); /* time */
+    put_16(msg, SPICE_AUDIO_DATA_MODE_RAW);
+    queue(server, SPICE_MSG_PLAYBACK_MODE, msg);
+    put_32(msg, 2); /* channels */
+    put_16(msg, SPICE_AUDIO_FMT_S16);
+    put_32(msg, 48000);
+    put_32(msg, 0); /* time */
+    queue(server, SPICE_MSG_PLAYBACK_START, msg);
+    for (i = 0; i < TEST_PACKETS; i++) {
+        put_32(msg, i * 10); /* time */
+        for (j = 0; j < 480 * 2; j++)
+            put_16(msg, i + j);
+        queue(server, SPICE_MSG_PLAYBACK_DATA, msg);
+    }
+    queue(server, SPICE_MSG_PLAYBACK_STOP, msg);
+    g_byte_array_unref(msg);
+
+    g_signal_connect(session, "channel-new", G_CALLBACK(channel_new), &handled);
+    run_session(server, session, 60);
+    g_assert_cmpuint(handled, ==, TEST_PACKETS);
+    fake_server_free(server);
+    g_object_unref(session);
+    spice_capture_flush(spice_capture_get());
+
+    replay = replay_new(filename, &error);
+    g_assert_no_error(error);
+    g_assert_cmpuint(replay->channels->len, ==, 2);
+    g_assert_cmpuint(replay->sent, >, 0);
+    /* mode, start, the packets and stop, and what the main channel got */
+    g_assert_cmpuint(replay->messages, >=, TEST_PACKETS + 3);
+
+    /* at the recorded pace, which is as fast as it went */
+    fake_server_set_realtime(replay->server, TRUE);
+    session = spice_session_new();
+    handled = 0;
+    g_signal_connect(session, "channel-new", G_CALLBACK(channel_new), &handled);
+    run_session(replay->server, session, 60);
+    g_assert_cmpuint(handled, ==, TEST_PACKETS);
+    replay_free(replay);
+    g_object_unref(session);
+}
+
+int main(int argc, char* argv[])
+{
+    gboolean realtime = FALSE;
+    gchar **files = NULL;
+    GOptionEntry entries[] = {
+        { "realtime", 'r', 0, G_OPTION_ARG_NONE, &realtime,
+          "Replay at the recorded pace, rather than as fast as possible", NULL },
+        { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &files,
+          NULL, "[FILE]" },
+        { NULL }
+    };
+    GOptionContext *context;
+    GError *error = NULL;
+    gchar *filename;
+    int fd, ret;
+
+    /* the self-test runs with the g_test options */
+    context = g_option_context_new("- replay a spice capture");
+    g_option_context_add_main_entries(context, entries, NULL);
+    g_option_context_set_ignore_unknown_options(context, TRUE);
+    g_option_context_set_help_enabled(context, FALSE);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_printerr("%s\n", error->message);
+        return 1;
+    }
+    g_option_context_free(context);
+
+    if (files != NULL && files[0] != NULL) {
+        SpiceSession *session;
+        Replay *replay;
+        gdouble cpu;
+
+        replay = replay_new(files[0], &error);
+        if (replay == NULL) {
+            g_printerr("%s\n", error->message);
+            return 1;
+        }
+        fake_server_set_realtime(replay->server, realtime);
+        session = spice_session_new();
+        cpu = run_session(replay->server, session, 3600);
+        replay_report(replay, cpu);
+        replay_free(replay);
+        g_object_unref(session);
+        g_strfreev(files);
+        return 0;
+    }
+
+    /* before any channel, which would open the capture */
+    fd = g_file_open_tmp("spice-capture-XXXXXX", &filename, &error);
+    g_assert_no_error(error);
+    close(fd);
+    g_setenv("SPICE_CAPTURE", filename, TRUE);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/replay/playback", filename, test_replay);
+    ret = g_test_run();
+
+    g_unlink(filename);
+    g_free(filename);
+    return ret;
+}